@@ -40,6 +40,9 @@ __FBSDID("$FreeBSD$");
 #include <sys/queue.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
 
 #include <geom/geom.h>
 #include <geom/geom_disk.h>
@@ -52,16 +55,23 @@ static struct nand_device_info nand_chips[] = {
 	    NAND_MANF_SAMSUNG, NAND_DEV_SAMSUNG_256MB,
 	    64, 2048, 64, 2048, 1,
 	    8, 2, 3, 1, "Samsung 256MiB 8bit Nand Flash",
+	    .ndi_options = NAND_OPT_CACHE_PROGRAM | NAND_OPT_CACHE_READ,
+	    .ndi_timing = { { 25, 25 }, { 200, 700 }, { 1500, 2000 },
+		{ 5, 500 } },
 	},
 	{
 	    NAND_MANF_SAMSUNG, NAND_DEV_SAMSUNG_64MB,
 	    16, 512, 32, 4096, 1,
 	    8, 1, 3, 0, "Samsung 64MiB 8bit Nand Flash",
+	    .ndi_timing = { { 12, 12 }, { 200, 500 }, { 2000, 3000 },
+		{ 5, 500 } },
 	},
 	{
 	    NAND_MANF_SAMSUNG, NAND_DEV_SAMSUNG_32MB,
 	    16, 512, 32, 2048, 1,
 	    8, 1, 2, 0, "Samsung 32MiB 8bit Nand Flash",
+	    .ndi_timing = { { 10, 10 }, { 200, 500 }, { 2000, 3000 },
+		{ 5, 500 } },
 	},
 
 	{ .ndi_name = NULL, }
@@ -73,244 +83,1777 @@ MALLOC_DEFINE(M_NAND, "NAND", "Memory for the NAND flash driver");
 uma_zone_t nand_device_zone;
 unsigned int next_unit = 0;
 
-static int nand_readid(nand_device_t);
+SYSCTL_NODE(_hw, OID_AUTO, nand, CTLFLAG_RD, 0, "NAND flash driver");
+
+static int nand_readid(nand_device_t, uint8_t *, uint8_t *);
 static int nand_read_data(nand_device_t, off_t, uint8_t *);
 static int nand_write_data(nand_device_t, off_t, uint8_t *);
+static int nand_erase_data(nand_device_t, off_t);
+static void nand_ra_used(nand_device_t);
+static void nand_ra_wasted(nand_device_t);
+
+static d_strategy_t nand_strategy;
+
+/*
+ * Moves the chip enable to the given LUN
+ */
+static inline void
+nand_select_lun(nand_device_t ndev, int lun)
+{
+	if (ndev->ndev_lun != lun) {
+		nand_wait_select(ndev, 0);
+		ndev->ndev_lun = lun;
+	}
+	nand_wait_select(ndev, 1);
+}
+
+/*
+ * Finds the LUN and the page within it of a page on the disk.
+ * Consecutive pages are striped across the LUNs.
+ */
+static inline int
+nand_page_lun(nand_device_t ndev, off_t page, off_t *lun_page)
+{
+	*lun_page = page / ndev->ndev_lun_cnt;
+	return (page % ndev->ndev_lun_cnt);
+}
+
+/*
+ * Waiting on the chip. When the controller can signal the chip is
+ * ready we sleep until it does. Otherwise each type of operation
+ * expects to wait for the typical time from the chip table at first
+ * then for the average of the recent waits. When that is at least a
+ * tick most of it is slept, the rest is polled every NAND_WAIT_POLL
+ * microseconds.
+ */
+#define	NAND_WAIT_POLL		5
+
+static const char *nand_wait_names[NAND_WAIT_OPS] = {
+	"read", "program", "erase", "reset",
+};
+
+static void
+nand_wait_init(nand_device_t ndev)
+{
+	int op;
+
+	for (op = 0; op < NAND_WAIT_OPS; op++)
+		ndev->ndev_wait[op].nw_expect =
+		    ndev->ndev_info.ndi_timing[op].nt_typ;
+}
+
+/*
+ * Is the chip ready. With ready set the status is read until all
+ * the bits in it are set, otherwise the ready/busy line is used.
+ */
+static inline int
+nand_ready(nand_device_t ndev, uint8_t ready, uint8_t *status)
+{
+
+	if (ready == 0)
+		return (nand_read_rnb(ndev) != 0);
+
+	nand_command(ndev, NAND_CMD_READ_STATUS);
+	nand_read_8(ndev, status);
+	return ((*status & ready) == ready);
+}
+
+static uint8_t
+nand_wait(nand_device_t ndev, int op, uint8_t ready)
+{
+	struct timespec start, slept, end;
+	struct nand_wait *nw;
+	u_int sleep, waited, max;
+	uint8_t status;
+
+	nw = &ndev->ndev_wait[op];
+	nw->nw_waits++;
+	status = 0;
+
+	nanouptime(&start);
+	slept = start;
+	max = ndev->ndev_info.ndi_timing[op].nt_max;
+	if (!nand_ready(ndev, ready, &status)) {
+		/*
+		 * The ready/busy line is shared by the LUNs so is only
+		 * used for the status of one LUN when there is no other.
+		 * Should the interrupt be lost we poll after a while.
+		 */
+		if (!cold && ndev->ndev_driver->ndri_wait_ready != NULL &&
+		    (ready == 0 || ndev->ndev_lun_cnt == 1) &&
+		    ndev->ndev_driver->ndri_wait_ready(ndev,
+		    howmany(max, tick) + hz / 10 + 1) == 0) {
+			nanouptime(&slept);
+		} else if (!cold && (sleep = nw->nw_expect / tick) > 0) {
+			pause("nandwt", sleep);
+			nanouptime(&slept);
+		}
+		while (!nand_ready(ndev, ready, &status))
+			DELAY(NAND_WAIT_POLL);
+	}
+	nanouptime(&end);
+
+	/* Learn how long this operation takes */
+	waited = (end.tv_sec - start.tv_sec) * 1000000 +
+	    (end.tv_nsec - start.tv_nsec) / 1000;
+	if (max != 0 && waited > max)
+		waited = max;
+	nw->nw_expect = (nw->nw_expect * 7 + waited) / 8;
+
+	sleep = (slept.tv_sec - start.tv_sec) * 1000000 +
+	    (slept.tv_nsec - start.tv_nsec) / 1000;
+	nw->nw_slept += sleep;
+	nw->nw_polled += (end.tv_sec - slept.tv_sec) * 1000000 +
+	    (end.tv_nsec - slept.tv_nsec) / 1000;
+
+	return (status);
+}
+
+static void
+nand_wait_sysctl(nand_device_t ndev, struct sysctl_oid_list *children)
+{
+	struct sysctl_oid_list *wait, *op_list;
+	struct sysctl_oid *oid;
+	struct nand_wait *nw;
+	int op;
+
+	oid = SYSCTL_ADD_NODE(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "wait", CTLFLAG_RD, 0, "Waits on the chip");
+	wait = SYSCTL_CHILDREN(oid);
+	for (op = 0; op < NAND_WAIT_OPS; op++) {
+		nw = &ndev->ndev_wait[op];
+		oid = SYSCTL_ADD_NODE(&ndev->ndev_sysctl_ctx, wait, OID_AUTO,
+		    nand_wait_names[op], CTLFLAG_RD, 0, "");
+		op_list = SYSCTL_CHILDREN(oid);
+		SYSCTL_ADD_UINT(&ndev->ndev_sysctl_ctx, op_list, OID_AUTO,
+		    "expect", CTLFLAG_RD, &nw->nw_expect, 0,
+		    "Expected microseconds to wait");
+		SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, op_list, OID_AUTO,
+		    "waits", CTLFLAG_RD, &nw->nw_waits, "Times waited");
+		SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, op_list, OID_AUTO,
+		    "slept", CTLFLAG_RD, &nw->nw_slept, "Microseconds slept");
+		SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, op_list, OID_AUTO,
+		    "polled", CTLFLAG_RD, &nw->nw_polled,
+		    "Microseconds spent polling");
+	}
+}
+
+/*
+ * Waits on the ready/busy line. Without one we have to trust the
+ * controller to hold off the next access until the chip is ready.
+ */
+static inline void
+nand_wait_rnb(nand_device_t ndev, int op)
+{
+
+	if (ndev->ndev_driver->ndri_read_rnb != NULL)
+		nand_wait(ndev, op, 0);
+}
+
+/*
+ * Polls the status until all the bits in ready are set
+ */
+static inline uint8_t
+nand_wait_status_bits(nand_device_t ndev, int op, uint8_t ready)
+{
+
+	return (nand_wait(ndev, op, ready));
+}
+
+static inline uint8_t
+nand_wait_status(nand_device_t ndev, int op)
+{
+	return (nand_wait_status_bits(ndev, op, NAND_STATUS_RDY));
+}
+
+/*
+ * Operations are built as a list of instructions which is handed to
+ * the controller in one go or, when it has no sequencer, run here.
+ */
+static inline void
+nand_op_init(struct nand_op *op)
+{
+
+	op->no_cnt = 0;
+}
+
+static inline struct nand_op_instr *
+nand_op_add(struct nand_op *op, int type)
+{
+	struct nand_op_instr *noi;
+
+	KASSERT(op->no_cnt < NAND_OP_MAX_INSTR,
+	    ("nand_op_add: Too many instructions"));
+	noi = &op->no_instr[op->no_cnt++];
+	noi->noi_type = type;
+	noi->noi_naddr = 0;
+	noi->noi_buf = NULL;
+	return (noi);
+}
+
+static inline void
+nand_op_cmd(struct nand_op *op, uint8_t cmd)
+{
+
+	nand_op_add(op, NAND_OP_CMD)->noi_cmd = cmd;
+}
+
+/*
+ * Adds an address byte, the address cycles in a row go together
+ */
+static inline void
+nand_op_addr(struct nand_op *op, uint8_t addr)
+{
+	struct nand_op_instr *noi;
+
+	if (op->no_cnt == 0 ||
+	    op->no_instr[op->no_cnt - 1].noi_type != NAND_OP_ADDR)
+		nand_op_add(op, NAND_OP_ADDR);
+	noi = &op->no_instr[op->no_cnt - 1];
+
+	KASSERT(noi->noi_naddr < NAND_OP_MAX_ADDR,
+	    ("nand_op_addr: Too many address cycles"));
+	noi->noi_addr[noi->noi_naddr++] = addr;
+}
+
+/*
+ * Adds the address of the start of a page
+ */
+static inline void
+nand_op_page_addr(nand_device_t ndev, struct nand_op *op, off_t page,
+    int with_column)
+{
+	off_t i;
+
+	if (with_column) {
+		/* We always want the start of the page */
+		for (i = 0; i < ndev->ndev_column_cycles; i++)
+			nand_op_addr(op, 0x00);
+	}
+	/* Write the page address */
+	for (i = 0; i < ndev->ndev_row_cycles; i++, page >>= 8)
+		nand_op_addr(op, page & 0xFF);
+}
+
+static inline void
+nand_op_data(struct nand_op *op, int type, size_t len, uint8_t *buf)
+{
+	struct nand_op_instr *noi;
+
+	noi = nand_op_add(op, type);
+	noi->noi_len = len;
+	noi->noi_buf = buf;
+}
+
+static inline void
+nand_op_wait(struct nand_op *op, int wait, uint8_t *status)
+{
+	struct nand_op_instr *noi;
+
+	noi = nand_op_add(op, NAND_OP_WAIT_RDY);
+	noi->noi_wait = wait;
+	noi->noi_buf = status;
+}
+
+/*
+ * Is the page data moved as part of the operation. Without a sequencer
+ * nand_rw_data moves it so DMA can be used and, as the hardware ECC is
+ * collected in strides as the data passes, it is also used with that.
+ */
+static inline int
+nand_op_moves_data(nand_device_t ndev)
+{
+
+	return (ndev->ndev_driver->ndri_exec_op != NULL &&
+	    (ndev->ndev_ecc == NULL ||
+	    ndev->ndev_driver->ndri_calc_ecc == NULL));
+}
+
+static int
+nand_exec_op(nand_device_t ndev, struct nand_op *op)
+{
+	struct nand_op_instr *noi;
+	int err, i, j;
+
+	if (ndev->ndev_driver->ndri_exec_op != NULL) {
+		err = ndev->ndev_driver->ndri_exec_op(ndev, op);
+		if (err != EOPNOTSUPP)
+			return (err);
+	}
+
+	for (i = 0; i < op->no_cnt; i++) {
+		noi = &op->no_instr[i];
+		switch (noi->noi_type) {
+		case NAND_OP_CMD:
+			nand_command(ndev, noi->noi_cmd);
+			break;
+		case NAND_OP_ADDR:
+			for (j = 0; j < noi->noi_naddr; j++)
+				nand_address(ndev, noi->noi_addr[j]);
+			break;
+		case NAND_OP_DATA_IN:
+			nand_read(ndev, noi->noi_len, noi->noi_buf);
+			break;
+		case NAND_OP_DATA_OUT:
+			nand_write(ndev, noi->noi_len, noi->noi_buf);
+			break;
+		case NAND_OP_WAIT_RDY:
+			if (noi->noi_buf != NULL)
+				noi->noi_buf[0] = nand_wait_status(ndev,
+				    noi->noi_wait);
+			else
+				nand_wait_rnb(ndev, noi->noi_wait);
+			break;
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Reads the manufacturer and device ID of the currently selected LUN
+ */
+static int
+nand_readid(nand_device_t ndev, uint8_t *manf_id, uint8_t *dev_id)
+{
+	struct nand_op op;
+	uint8_t id[2];
+	int err;
+
+	nand_op_init(&op);
+	nand_op_cmd(&op, NAND_CMD_READID);
+	nand_op_addr(&op, NAND_READID_MANFID);
+	nand_op_data(&op, NAND_OP_DATA_IN, sizeof(id), id);
+
+	nand_wait_select(ndev, 1);
+	err = nand_exec_op(ndev, &op);
+	nand_wait_select(ndev, 0);
+
+	*manf_id = id[0];
+	*dev_id = id[1];
+	return (err);
+}
+
+/*
+ * Calculates the software ECC of a whole page
+ */
+static void
+nand_calc_page_ecc(nand_device_t ndev, uint8_t *data, uint8_t *calc_ecc)
+{
+	size_t len;
+	u_int pos, ecc_pos;
+
+	len = ndev->ndev_page_size;
+	if (len > ndev->ndev_ecc->ecc_protect)
+		len = ndev->ndev_ecc->ecc_protect;
+	for (pos = 0, ecc_pos = 0; pos < ndev->ndev_page_size;
+	     pos += len, ecc_pos += ndev->ndev_ecc->ecc_stride) {
+		if (len > ndev->ndev_page_size - pos)
+			len = ndev->ndev_page_size - pos;
+		nand_ecc_calc(ndev, &data[pos], len, &calc_ecc[ecc_pos]);
+	}
+}
+
+/*
+ * Moves the data of a page with the controller's DMA engine. The ECC
+ * of a write is calculated while the data is moving, that of a read
+ * once it has landed. The hardware ECC is calculated by the controller
+ * as the data passes so is only used with PIO. Returns EOPNOTSUPP
+ * when the transfer couldn't be started and PIO should be used.
+ */
+static int
+nand_dma_data(nand_device_t ndev, uint8_t *data, uint8_t *calc_ecc,
+    int read)
+{
+	nand_driver_t dri;
+	int err;
+
+	dri = ndev->ndev_driver;
+	if (dri->ndri_dma_read == NULL ||
+	    (calc_ecc != NULL && dri->ndri_calc_ecc != NULL))
+		return (EOPNOTSUPP);
+
+	if (read)
+		err = dri->ndri_dma_read(ndev, ndev->ndev_page_size, data);
+	else
+		err = dri->ndri_dma_write(ndev, ndev->ndev_page_size, data);
+	if (err != 0)
+		return (EOPNOTSUPP);
+	ndev->ndev_stats.ns_dma++;
+
+	if (!read && calc_ecc != NULL)
+		nand_calc_page_ecc(ndev, data, calc_ecc);
+
+	err = dri->ndri_dma_wait(ndev);
+	if (err != 0)
+		return (err);
+
+	if (read && calc_ecc != NULL)
+		nand_calc_page_ecc(ndev, data, calc_ecc);
+
+	return (0);
+}
+
+/*
+ * On read copies the ECC from the OOB into the given slot of the read
+ * ECC buffer. On write fills the OOB with the calculated ECC of the
+ * slot and the FTL tag.
+ */
+static void
+nand_oob_ecc(nand_device_t ndev, int slot, int read)
+{
+	u_int ecc_pos, ecc_off;
+	uint8_t *ecc;
+
+	if (!read)
+		memset(ndev->ndev_oob, 0xFF, ndev->ndev_spare_size);
+
+	if (ndev->ndev_ecc != NULL) {
+		ecc = read ? ndev->ndev_read_ecc : ndev->ndev_calc_ecc;
+		ecc += slot * ndev->ndev_ecc->ecc_size;
+		for (ecc_pos = 0; ecc_pos < ndev->ndev_ecc->ecc_size;
+		     ecc_pos++) {
+			/* The offset in the OOB of this byte of ECC data */
+			ecc_off = ndev->ndev_ecc->ecc_pos[ecc_pos];
+
+			if (read)
+				ecc[ecc_pos] = ndev->ndev_oob[ecc_off];
+			else
+				ndev->ndev_oob[ecc_off] = ecc[ecc_pos];
+		}
+	}
+
+	/* Copy the FTL tag into the OOB */
+	if (!read && ndev->ndev_tag != NULL)
+		memcpy(&ndev->ndev_oob[NAND_TAG_OFFSET], ndev->ndev_tag,
+		    NAND_TAG_SIZE);
+}
+
+/*
+ * Moves a page to or from the chip. On read the calculated ECC and the
+ * ECC read from the OOB are kept in the given slot of the ECC buffers
+ * for nand_fix_page so the page can be checked after the next page has
+ * started moving.
+ */
+static int
+nand_rw_data(nand_device_t ndev, uint8_t *data, int slot, int read)
+{
+	size_t len, ecc_stride, stride;
+	u_int pos, ecc_pos;
+	uint8_t *calc_ecc;
+	int err;
+
+	ecc_stride = 0;
+	stride = ndev->ndev_page_size;
+	calc_ecc = NULL;
+	if (ndev->ndev_ecc != NULL) {
+		if (stride > ndev->ndev_ecc->ecc_protect)
+			stride = ndev->ndev_ecc->ecc_protect;
+		ecc_stride = ndev->ndev_ecc->ecc_stride;
+		calc_ecc = &ndev->ndev_calc_ecc[slot *
+		    ndev->ndev_ecc->ecc_size];
+	}
+	len = stride;
+
+	err = nand_dma_data(ndev, data, calc_ecc, read);
+	if (err == 0)
+		goto oob;
+	if (err != EOPNOTSUPP)
+		return (err);
+
+	/* Read each ECC block */
+	for (pos = 0, ecc_pos = 0; pos < ndev->ndev_page_size;
+	     pos += len, ecc_pos += ecc_stride) {
+		/* Init the ECC for the read */
+		nand_init_ecc(ndev);
+
+		/* Read the page */
+		if (len > ndev->ndev_page_size - pos)
+			len = ndev->ndev_page_size - pos;
+		if (read)
+			nand_read(ndev, len, &data[pos]);
+		else
+			nand_write(ndev, len, &data[pos]);
+
+		/* Calculate the ECC value of the data we just read */
+		if (calc_ecc == NULL)
+			continue;
+		if (ndev->ndev_driver->ndri_calc_ecc != NULL)
+			nand_calc_ecc(ndev, &calc_ecc[ecc_pos]);
+		else
+			nand_ecc_calc(ndev, &data[pos], len,
+			    &calc_ecc[ecc_pos]);
+	}
+
+oob:
+	if (read) {
+		nand_read(ndev, ndev->ndev_spare_size, ndev->ndev_oob);
+		nand_oob_ecc(ndev, slot, 1);
+	} else {
+		nand_oob_ecc(ndev, slot, 0);
+		nand_write(ndev, ndev->ndev_spare_size, ndev->ndev_oob);
+	}
+
+	return (0);
+}
+
+/*
+ * Calculates the ECC of a page moved in one go and moves it between
+ * the ECC buffers and the OOB
+ */
+static void
+nand_page_ecc(nand_device_t ndev, uint8_t *data, int read)
+{
+
+	if (ndev->ndev_ecc != NULL)
+		nand_calc_page_ecc(ndev, data, ndev->ndev_calc_ecc);
+	nand_oob_ecc(ndev, 0, read);
+}
+
+/*
+ * The controller has page operations and, as they move the page in one
+ * go, the ECC is calculated in software
+ */
+static inline int
+nand_page_ops(nand_device_t ndev)
+{
+
+	return (ndev->ndev_driver->ndri_read_page != NULL &&
+	    (ndev->ndev_ecc == NULL ||
+	    ndev->ndev_driver->ndri_calc_ecc == NULL));
+}
+
+/*
+ * Checks and corrects a page read into the given ECC slot
+ */
+static int
+nand_fix_page(nand_device_t ndev, uint8_t *data, int slot)
+{
+	size_t len, ecc_stride, stride;
+	u_int pos, ecc_pos;
+	uint8_t *calc_ecc, *read_ecc;
+	int err;
+
+	if (ndev->ndev_ecc == NULL)
+		return (0);
+
+	stride = ndev->ndev_page_size;
+	if (stride > ndev->ndev_ecc->ecc_protect)
+		stride = ndev->ndev_ecc->ecc_protect;
+	ecc_stride = ndev->ndev_ecc->ecc_stride;
+	calc_ecc = &ndev->ndev_calc_ecc[slot * ndev->ndev_ecc->ecc_size];
+	read_ecc = &ndev->ndev_read_ecc[slot * ndev->ndev_ecc->ecc_size];
+
+	len = stride;
+	for (pos = 0, ecc_pos = 0; pos < ndev->ndev_page_size;
+	     pos += len, ecc_pos += ecc_stride) {
+		if (len > ndev->ndev_page_size - pos)
+			len = ndev->ndev_page_size - pos;
+		err = nand_fix_data(ndev, len, &data[pos], &calc_ecc[ecc_pos],
+		    &read_ecc[ecc_pos]);
+		if (err != 0)
+			return (err);
+	}
+
+	return (0);
+}
+
+/*
+ * Starts reading a page into the chips data register
+ */
+static inline void
+nand_op_start_read(nand_device_t ndev, struct nand_op *op, off_t page)
+{
+	nand_op_cmd(op, NAND_CMD_READ);
+	nand_op_page_addr(ndev, op, page, 1);
+
+	/* XXX: ONFI 1.0 says we need this but some Samsung parts don't */
+	if (ndev->ndev_read_start)
+		nand_op_cmd(op, NAND_CMD_READ_START);
+}
+
+static inline int
+nand_start_read(nand_device_t ndev, off_t page)
+{
+	struct nand_op op;
+
+	nand_op_init(&op);
+	nand_op_start_read(ndev, &op, page);
+	return (nand_exec_op(ndev, &op));
+}
+
+/*
+ * Reads the data including spare if len is large enough from the NAND flash
+ */
+static int
+nand_read_data(nand_device_t ndev, off_t page, uint8_t *data)
+{
+	struct nand_op op;
+	int data_op, err;
+
+	if (nand_page_ops(ndev)) {
+		err = ndev->ndev_driver->ndri_read_page(ndev, page, data,
+		    ndev->ndev_oob);
+		ndev->ndev_stats.ns_reads++;
+		if (err != 0)
+			return (err);
+		nand_page_ecc(ndev, data, 1);
+		return (nand_fix_page(ndev, data, 0));
+	}
+
+	data_op = nand_op_moves_data(ndev);
+	nand_op_init(&op);
+	nand_op_start_read(ndev, &op, page);
+
+	/* Wait for data to be read */
+	nand_op_wait(&op, NAND_WAIT_READ, NULL);
+
+	if (data_op) {
+		nand_op_data(&op, NAND_OP_DATA_IN, ndev->ndev_page_size, data);
+		nand_op_data(&op, NAND_OP_DATA_IN, ndev->ndev_spare_size,
+		    ndev->ndev_oob);
+	}
+
+	err = nand_exec_op(ndev, &op);
+	if (err == 0 && !data_op)
+		err = nand_rw_data(ndev, data, 0, 1);
+	ndev->ndev_stats.ns_reads++;
+	if (err != 0)
+		return (err);
+
+	if (data_op)
+		nand_page_ecc(ndev, data, 1);
+	return (nand_fix_page(ndev, data, 0));
+}
+
+/*
+ * Reads a run of pages within a block using cache read. After the first
+ * page is read into the data register each NAND_CMD_READ_CACHE_SEQ moves
+ * it to the cache register and starts reading the next page so the array
+ * read overlaps the transfer of the current page off the chip. The last
+ * page is moved with NAND_CMD_READ_CACHE_END which starts no new read.
+ *
+ * Each page is checked after the command moving the next page has been
+ * sent, while the chip is busy, so the chip doesn't wait on the ECC.
+ */
+static int
+nand_read_cached(nand_device_t ndev, off_t page, int cnt, uint8_t *data)
+{
+	int err, error, moved, i;
+
+	err = nand_start_read(ndev, page);
+	if (err != 0)
+		return (err);
+	nand_wait_rnb(ndev, NAND_WAIT_READ);
+
+	err = moved = 0;
+	for (i = 0; i < cnt; i++) {
+		if (i < cnt - 1)
+			nand_command(ndev, NAND_CMD_READ_CACHE_SEQ);
+		else
+			nand_command(ndev, NAND_CMD_READ_CACHE_END);
+
+		/* Keep going on error so the chip finishes the sequence */
+		if (i > 0 && moved == 0) {
+			error = nand_fix_page(ndev,
+			    &data[(i - 1) * ndev->ndev_page_size], (i - 1) & 1);
+			if (err == 0)
+				err = error;
+		}
+
+		nand_wait_rnb(ndev, NAND_WAIT_READ);
+		moved = nand_rw_data(ndev, &data[i * ndev->ndev_page_size],
+		    i & 1, 1);
+		ndev->ndev_stats.ns_reads++;
+		if (err == 0)
+			err = moved;
+	}
+
+	if (moved == 0) {
+		error = nand_fix_page(ndev,
+		    &data[(cnt - 1) * ndev->ndev_page_size], (cnt - 1) & 1);
+		if (err == 0)
+			err = error;
+	}
+
+	return (err);
+}
+
+/*
+ * Drops the data loaded for a program when it failed to move
+ */
+static void
+nand_abort_program(nand_device_t ndev)
+{
+	nand_command(ndev, NAND_CMD_RESET);
+	nand_wait_status(ndev, NAND_WAIT_RESET);
+}
+
+/*
+ * Loads the page into the chip. With a sequencer the page is added to
+ * the operation, otherwise the operation so far is run and the page is
+ * moved with nand_rw_data. Either way the operation continues after
+ * the page.
+ */
+static int
+nand_op_load_page(nand_device_t ndev, struct nand_op *op, off_t page,
+    uint8_t *data)
+{
+	int err;
+
+	nand_op_cmd(op, NAND_CMD_PROGRAM);
+	nand_op_page_addr(ndev, op, page, 1);
+
+	if (nand_op_moves_data(ndev)) {
+		nand_page_ecc(ndev, data, 0);
+		nand_op_data(op, NAND_OP_DATA_OUT, ndev->ndev_page_size, data);
+		nand_op_data(op, NAND_OP_DATA_OUT, ndev->ndev_spare_size,
+		    ndev->ndev_oob);
+		return (0);
+	}
+
+	err = nand_exec_op(ndev, op);
+	nand_op_init(op);
+	if (err == 0)
+		err = nand_rw_data(ndev, data, 0, 0);
+	if (err != 0)
+		nand_abort_program(ndev);
+	return (err);
+}
+
+/*
+ * Loads the page into the chip and starts programming it
+ */
+static inline int
+nand_start_program(nand_device_t ndev, off_t page, uint8_t *data)
+{
+	struct nand_op op;
+	int err;
+
+	nand_op_init(&op);
+	err = nand_op_load_page(ndev, &op, page, data);
+	if (err != 0)
+		return (err);
+
+	nand_op_cmd(&op, NAND_CMD_PROGRAM_END);
+	err = nand_exec_op(ndev, &op);
+	if (err != 0)
+		nand_abort_program(ndev);
+	return (err);
+}
+
+/*
+ * Writes data to the disk including the spare area after the sector
+ */
+static int
+nand_write_data(nand_device_t ndev, off_t page, uint8_t *data)
+{
+	struct nand_op op;
+	uint8_t status;
+	int err;
+
+	if (nand_page_ops(ndev)) {
+		nand_page_ecc(ndev, data, 0);
+		err = ndev->ndev_driver->ndri_program_page(ndev, page, data,
+		    ndev->ndev_oob);
+		ndev->ndev_stats.ns_writes++;
+		goto done;
+	}
+
+	nand_op_init(&op);
+	err = nand_op_load_page(ndev, &op, page, data);
+	ndev->ndev_stats.ns_writes++;
+	if (err != 0)
+		return (err);
+
+	nand_op_cmd(&op, NAND_CMD_PROGRAM_END);
+	nand_op_wait(&op, NAND_WAIT_PROGRAM, &status);
+	err = nand_exec_op(ndev, &op);
+	if (err != 0) {
+		nand_abort_program(ndev);
+		return (err);
+	}
+	if ((status & NAND_STATUS_FAIL) == NAND_STATUS_FAIL)
+		err = EIO;
+
+done:
+	if (err == EIO)
+		nand_bbt_mark(ndev, ndev->ndev_lun,
+		    page / ndev->ndev_page_cnt);
+	return (err);
+}
+
+/*
+ * Waits for the LUN programming page and marks the blocks that failed.
+ * After NAND_CMD_PROGRAM_CACHE ready only needs the cache register and
+ * NAND_STATUS_FAILC holds the result of prev, the page before, if any.
+ */
+static int
+nand_program_wait(nand_device_t ndev, off_t page, off_t prev, uint8_t ready)
+{
+	uint8_t status;
+
+	status = nand_wait_status_bits(ndev, NAND_WAIT_PROGRAM, ready);
+	if ((status & (NAND_STATUS_FAIL | NAND_STATUS_FAILC)) == 0)
+		return (0);
+
+	nand_wait_status_bits(ndev, NAND_WAIT_PROGRAM,
+	    NAND_STATUS_RDY | NAND_STATUS_ARDY);
+	if ((status & NAND_STATUS_FAILC) != 0 && prev >= 0)
+		nand_bbt_mark(ndev, ndev->ndev_lun, prev / ndev->ndev_page_cnt);
+	if ((status & NAND_STATUS_FAIL) != 0)
+		nand_bbt_mark(ndev, ndev->ndev_lun, page / ndev->ndev_page_cnt);
+	return (EIO);
+}
+
+/*
+ * Programs a run of pages using cache program. Each page is moved into
+ * the cache register while the one before it is still being programmed
+ * from the data register so we only wait for the bus transfer. The last
+ * page uses NAND_CMD_PROGRAM_END and we wait for the array to finish.
+ */
+static int
+nand_write_cached(nand_device_t ndev, off_t page, int cnt, uint8_t *data)
+{
+	struct nand_op op;
+	int err, i;
+
+	for (i = 0; i < cnt; i++) {
+		nand_op_init(&op);
+		nand_op_cmd(&op, NAND_CMD_PROGRAM);
+		nand_op_page_addr(ndev, &op, page + i, 1);
+		err = nand_exec_op(ndev, &op);
+		if (err == 0)
+			err = nand_rw_data(ndev,
+			    &data[i * ndev->ndev_page_size], 0, 0);
+		ndev->ndev_stats.ns_writes++;
+		if (err != 0) {
+			/* Let the page before finish programming */
+			nand_wait_status_bits(ndev, NAND_WAIT_PROGRAM,
+			    NAND_STATUS_RDY | NAND_STATUS_ARDY);
+			nand_abort_program(ndev);
+			return (err);
+		}
+
+		if (i == cnt - 1) {
+			nand_command(ndev, NAND_CMD_PROGRAM_END);
+			err = nand_program_wait(ndev, page + i,
+			    i > 0 ? page + i - 1 : -1,
+			    NAND_STATUS_RDY | NAND_STATUS_ARDY);
+		} else {
+			nand_command(ndev, NAND_CMD_PROGRAM_CACHE);
+			/* Wait for the cache register to be free */
+			err = nand_program_wait(ndev, page + i,
+			    i > 0 ? page + i - 1 : -1, NAND_STATUS_RDY);
+		}
+		if (err != 0)
+			return (err);
+	}
+
+	return (0);
+}
+
+static inline void
+nand_op_start_erase(nand_device_t ndev, struct nand_op *op, off_t block)
+{
+	nand_op_cmd(op, NAND_CMD_ERASE);
+	/* The address is that of the first page in the block */
+	nand_op_page_addr(ndev, op, block * ndev->ndev_page_cnt, 0);
+	nand_op_cmd(op, NAND_CMD_ERASE_END);
+}
+
+static inline int
+nand_start_erase(nand_device_t ndev, off_t block)
+{
+	struct nand_op op;
+
+	nand_op_init(&op);
+	nand_op_start_erase(ndev, &op, block);
+	return (nand_exec_op(ndev, &op));
+}
+
+static int
+nand_erase_data(nand_device_t ndev, off_t block)
+{
+	struct nand_op op;
+	uint8_t status;
+	int err;
+
+	/* Erasing a factory bad block may clear its marker */
+	if (nand_block_isbad(ndev, ndev->ndev_lun, block))
+		return (EIO);
+
+	if (nand_page_ops(ndev)) {
+		err = ndev->ndev_driver->ndri_erase_block(ndev, block);
+		ndev->ndev_stats.ns_erases++;
+		if (err == EIO)
+			nand_bbt_mark(ndev, ndev->ndev_lun, block);
+		return (err);
+	}
+
+	nand_op_init(&op);
+	nand_op_start_erase(ndev, &op, block);
+	nand_op_wait(&op, NAND_WAIT_ERASE, &status);
+	err = nand_exec_op(ndev, &op);
+	ndev->ndev_stats.ns_erases++;
+	if (err != 0)
+		return (err);
+
+	if ((status & NAND_STATUS_FAIL) == NAND_STATUS_FAIL) {
+		nand_bbt_mark(ndev, ndev->ndev_lun, block);
+		return (EIO);
+	}
+
+	return (0);
+}
+
+/*
+ * Reads a run of disk pages striped across the LUNs. Every LUN is
+ * started before we wait on any of them and each LUN is restarted as
+ * soon as its page has been moved off the chip, so the array read of
+ * one die overlaps the bus transfers of the others. The pages a LUN
+ * holds in one block are read with cache read, which starts the array
+ * read of the next page before the current one is moved. A page is
+ * checked once its LUN is busy with the next one.
+ */
+static int
+nand_read_interleaved(nand_device_t ndev, off_t page, int page_cnt,
+    uint8_t *data)
+{
+	off_t lun_page;
+	uint8_t *buf;
+	int cache, err, error, moved, more, i, lun, lun_cnt, seq;
+
+	lun_cnt = ndev->ndev_lun_cnt;
+	cache = (ndev->ndev_options & NAND_OPT_CACHE_READ) != 0;
+	for (i = 0; i < MIN(page_cnt, lun_cnt); i++) {
+		lun = nand_page_lun(ndev, page + i, &lun_page);
+		nand_select_lun(ndev, lun);
+		err = nand_start_read(ndev, lun_page);
+		if (err != 0)
+			return (err);
+	}
+	ndev->ndev_stats.ns_interleaved += MIN(page_cnt, lun_cnt) - 1;
+
+	/* The LUNs in a cache read, keep going on error to end them */
+	seq = 0;
+	err = 0;
+	for (i = 0; i < page_cnt; i++) {
+		lun = nand_page_lun(ndev, page + i, &lun_page);
+		buf = &data[i * ndev->ndev_page_size];
+		nand_select_lun(ndev, lun);
+
+		/* The ready line is shared so poll the status of each LUN */
+		nand_wait_status(ndev, NAND_WAIT_READ);
+		more = cache && i + lun_cnt < page_cnt &&
+		    (lun_page + 1) % ndev->ndev_page_cnt != 0;
+		if (more || (seq & (1 << lun)) != 0) {
+			nand_command(ndev, more ? NAND_CMD_READ_CACHE_SEQ :
+			    NAND_CMD_READ_CACHE_END);
+			if (more)
+				seq |= 1 << lun;
+			else
+				seq &= ~(1 << lun);
+			nand_wait_status(ndev, NAND_WAIT_READ);
+		}
+
+		/* Move back to reading data after the status */
+		nand_command(ndev, NAND_CMD_READ);
+		moved = nand_rw_data(ndev, buf, 0, 1);
+		ndev->ndev_stats.ns_reads++;
+		error = moved;
+
+		if (!more && i + lun_cnt < page_cnt) {
+			ndev->ndev_stats.ns_interleaved++;
+			error = nand_start_read(ndev, lun_page + 1);
+			if (err == 0)
+				err = error;
+		}
+		if (moved == 0)
+			error = nand_fix_page(ndev, buf, 0);
+		if (err == 0)
+			err = error;
+	}
+
+	return (err);
+}
+
+/*
+ * Programs a run of disk pages striped across the LUNs. Each LUN is
+ * given its next page as soon as it can take it, so tPROG of one die
+ * overlaps the bus transfers to the others. The pages a LUN holds in
+ * one block are programmed with cache program and only wait for the
+ * cache register.
+ */
+static int
+nand_write_interleaved(nand_device_t ndev, off_t page, int page_cnt,
+    uint8_t *data)
+{
+	struct nand_op op;
+	off_t last[NAND_MAX_LUN], prev[NAND_MAX_LUN], lun_page;
+	int bit, busy, cache, err, error, more, i, lun, lun_cnt, seq;
+
+	lun_cnt = ndev->ndev_lun_cnt;
+	cache = (ndev->ndev_options & NAND_OPT_CACHE_PROGRAM) != 0;
+
+	/* The LUNs programming last[], those in a cache program */
+	busy = seq = 0;
+	err = 0;
+	for (i = 0; i < page_cnt; i++) {
+		lun = nand_page_lun(ndev, page + i, &lun_page);
+		bit = 1 << lun;
+		nand_select_lun(ndev, lun);
+
+		if ((busy & bit) != 0) {
+			err = nand_program_wait(ndev, last[lun], prev[lun],
+			    (seq & bit) != 0 ? NAND_STATUS_RDY :
+			    NAND_STATUS_RDY | NAND_STATUS_ARDY);
+			if (err != 0) {
+				busy &= ~bit;
+				break;
+			}
+		}
+
+		more = cache && i + lun_cnt < page_cnt &&
+		    (lun_page + 1) % ndev->ndev_page_cnt != 0;
+		nand_op_init(&op);
+		err = nand_op_load_page(ndev, &op, lun_page,
+		    &data[i * ndev->ndev_page_size]);
+		if (err == 0) {
+			nand_op_cmd(&op, more ? NAND_CMD_PROGRAM_CACHE :
+			    NAND_CMD_PROGRAM_END);
+			err = nand_exec_op(ndev, &op);
+		}
+		ndev->ndev_stats.ns_writes++;
+		if (err != 0) {
+			/* Let the page before finish programming */
+			if ((seq & bit) != 0)
+				nand_wait_status_bits(ndev, NAND_WAIT_PROGRAM,
+				    NAND_STATUS_RDY | NAND_STATUS_ARDY);
+			nand_abort_program(ndev);
+			busy &= ~bit;
+			break;
+		}
+
+		if ((busy & ~bit) != 0)
+			ndev->ndev_stats.ns_interleaved++;
+		prev[lun] = (seq & bit) != 0 ? last[lun] : -1;
+		last[lun] = lun_page;
+		busy |= bit;
+		if (more)
+			seq |= bit;
+		else
+			seq &= ~bit;
+	}
+
+	for (lun = 0; lun < lun_cnt; lun++) {
+		if ((busy & (1 << lun)) == 0)
+			continue;
+		nand_select_lun(ndev, lun);
+		error = nand_program_wait(ndev, last[lun], prev[lun],
+		    NAND_STATUS_RDY | NAND_STATUS_ARDY);
+		if (err == 0)
+			err = error;
+	}
+
+	return (err);
+}
+
+/*
+ * Erases the block with the given index on every LUN. Bad
+ * blocks are skipped but still cause the erase to fail.
+ */
+static int
+nand_erase_interleaved(nand_device_t ndev, off_t block)
+{
+	uint8_t status;
+	int err, error, lun, started;
+
+	if (ndev->ndev_lun_cnt == 1) {
+		nand_select_lun(ndev, 0);
+		return (nand_erase_data(ndev, block));
+	}
+
+	err = 0;
+	if (nand_page_ops(ndev)) {
+		for (lun = 0; lun < ndev->ndev_lun_cnt; lun++) {
+			nand_select_lun(ndev, lun);
+			error = nand_erase_data(ndev, block);
+			if (err == 0)
+				err = error;
+		}
+		return (err);
+	}
+
+	started = 0;
+	for (lun = 0; lun < ndev->ndev_lun_cnt; lun++) {
+		if (nand_block_isbad(ndev, lun, block)) {
+			err = EIO;
+			continue;
+		}
+		nand_select_lun(ndev, lun);
+		error = nand_start_erase(ndev, block);
+		if (error == 0)
+			started |= 1 << lun;
+		else if (err == 0)
+			err = error;
+	}
+	ndev->ndev_stats.ns_interleaved += ndev->ndev_lun_cnt - 1;
+
+	for (lun = 0; lun < ndev->ndev_lun_cnt; lun++) {
+		if ((started & (1 << lun)) == 0)
+			continue;
+		nand_select_lun(ndev, lun);
+		status = nand_wait_status(ndev, NAND_WAIT_ERASE);
+		ndev->ndev_stats.ns_erases++;
+		if ((status & NAND_STATUS_FAIL) == NAND_STATUS_FAIL) {
+			nand_bbt_mark(ndev, lun, block);
+			err = EIO;
+		}
+	}
+
+	return (err);
+}
+
+/*
+ * The read cache keeps recently read pages so hot pages, e.g. file
+ * system metadata, are not read from the chip every time they are used.
+ */
+#define	NAND_CACHE_HASH(ndev, page) \
+    (&(ndev)->ndev_cache_hash[(page) & (ndev)->ndev_cache_mask])
+
+static void
+nand_cache_init(nand_device_t ndev)
+{
+	char tunable[32];
+	int cnt, i;
+
+	cnt = NAND_CACHE_ENTRIES;
+	snprintf(tunable, sizeof(tunable), "hw.nand.%d.cache_entries",
+	    ndev->ndev_unit);
+	TUNABLE_INT_FETCH(tunable, &cnt);
+	if (cnt <= 0) {
+		ndev->ndev_cache_cnt = 0;
+		return;
+	}
+
+	ndev->ndev_cache_zone = uma_zcreate("nand_cache",
+	    ndev->ndev_page_size, NULL, NULL, NULL, NULL, 0, 0);
+	uma_zone_set_max(ndev->ndev_cache_zone, cnt);
+
+	ndev->ndev_cache = malloc(cnt * sizeof(struct nand_cache_entry),
+	    M_NAND, M_WAITOK | M_ZERO);
+	for (i = 0; i < cnt; i++)
+		ndev->ndev_cache[i].nce_page = -1;
+	ndev->ndev_cache_hash = hashinit(cnt, M_NAND, &ndev->ndev_cache_mask);
+	ndev->ndev_cache_hand = 0;
+	ndev->ndev_cache_cnt = cnt;
+}
+
+static void
+nand_cache_fini(nand_device_t ndev)
+{
+	int i;
+
+	if (ndev->ndev_cache == NULL)
+		return;
+
+	for (i = 0; i < ndev->ndev_cache_cnt; i++)
+		if (ndev->ndev_cache[i].nce_data != NULL)
+			uma_zfree(ndev->ndev_cache_zone,
+			    ndev->ndev_cache[i].nce_data);
+	hashdestroy(ndev->ndev_cache_hash, M_NAND, ndev->ndev_cache_mask);
+	free(ndev->ndev_cache, M_NAND);
+	uma_zdestroy(ndev->ndev_cache_zone);
+
+	ndev->ndev_cache = NULL;
+	ndev->ndev_cache_hash = NULL;
+	ndev->ndev_cache_zone = NULL;
+	ndev->ndev_cache_cnt = 0;
+}
+
+static struct nand_cache_entry *
+nand_cache_find(nand_device_t ndev, off_t page)
+{
+	struct nand_cache_entry *nce;
+
+	if (ndev->ndev_cache_cnt == 0)
+		return (NULL);
+
+	LIST_FOREACH(nce, NAND_CACHE_HASH(ndev, page), nce_hash)
+		if (nce->nce_page == page)
+			return (nce);
+
+	return (NULL);
+}
+
+/*
+ * Copies a page out of the read cache.
+ * Returns 0 if the page is not cached.
+ */
+static int
+nand_cache_read(nand_device_t ndev, off_t page, uint8_t *data)
+{
+	struct nand_cache_entry *nce;
+
+	nce = nand_cache_find(ndev, page);
+	if (nce == NULL)
+		return (0);
+
+	nce->nce_ref = 1;
+	memcpy(data, nce->nce_data, ndev->ndev_page_size);
+	ndev->ndev_stats.ns_cache_hits++;
+
+	if ((nce->nce_flags & NAND_CACHE_RA) != 0) {
+		nce->nce_flags &= ~NAND_CACHE_RA;
+		ndev->ndev_stats.ns_ra_hits++;
+		nand_ra_used(ndev);
+	}
+
+	return (1);
+}
+
+/*
+ * Adds a page read from the chip to the cache. New entries start
+ * unreferenced so a large read only displaces pages nobody is using.
+ */
+static void
+nand_cache_insert(nand_device_t ndev, off_t page, uint8_t *data, int flags)
+{
+	struct nand_cache_entry *nce;
+
+	if (ndev->ndev_cache_cnt == 0)
+		return;
+
+	nce = nand_cache_find(ndev, page);
+	if (nce == NULL) {
+		/* Move the hand until it finds an entry not used recently */
+		for (;;) {
+			nce = &ndev->ndev_cache[ndev->ndev_cache_hand];
+			ndev->ndev_cache_hand = (ndev->ndev_cache_hand + 1) %
+			    ndev->ndev_cache_cnt;
+			if (nce->nce_ref == 0)
+				break;
+			nce->nce_ref = 0;
+		}
+
+		if (nce->nce_page != -1) {
+			if ((nce->nce_flags & NAND_CACHE_RA) != 0)
+				nand_ra_wasted(ndev);
+			LIST_REMOVE(nce, nce_hash);
+			nce->nce_page = -1;
+		}
+		if (nce->nce_data == NULL) {
+			nce->nce_data = uma_zalloc(ndev->ndev_cache_zone,
+			    M_NOWAIT);
+			if (nce->nce_data == NULL)
+				return;
+		}
+
+		nce->nce_page = page;
+		nce->nce_flags = flags;
+		LIST_INSERT_HEAD(NAND_CACHE_HASH(ndev, page), nce, nce_hash);
+	}
+
+	memcpy(nce->nce_data, data, ndev->ndev_page_size);
+}
+
+static inline void
+nand_cache_remove(struct nand_cache_entry *nce)
+{
+
+	LIST_REMOVE(nce, nce_hash);
+	nce->nce_page = -1;
+	nce->nce_ref = 0;
+	nce->nce_flags = 0;
+}
+
+/*
+ * Drops cnt pages from the cache after they have been written or erased
+ */
+static void
+nand_cache_invalidate(nand_device_t ndev, off_t page, off_t cnt)
+{
+	struct nand_cache_entry *nce;
+	off_t i;
+
+	if (ndev->ndev_cache_cnt == 0)
+		return;
+
+	if (cnt > ndev->ndev_cache_cnt) {
+		for (i = 0; i < ndev->ndev_cache_cnt; i++) {
+			nce = &ndev->ndev_cache[i];
+			if (nce->nce_page >= page &&
+			    nce->nce_page < page + cnt)
+				nand_cache_remove(nce);
+		}
+		return;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		nce = nand_cache_find(ndev, page + i);
+		if (nce != NULL)
+			nand_cache_remove(nce);
+	}
+}
+
+/*
+ * Reads or writes a run of disk pages using the fastest method
+ * the part supports.
+ */
+static int
+nand_rw_run(nand_device_t ndev, off_t page, int page_cnt, uint8_t *data,
+    int read)
+{
+	off_t lun_page;
+	int cnt, err, lun;
+
+	/*
+	 * Runs over several LUNs keep every LUN busy, each with its
+	 * own cache read or cache program.
+	 */
+	if (!nand_page_ops(ndev) && page_cnt > 1 && ndev->ndev_lun_cnt > 1) {
+		if (read)
+			return (nand_read_interleaved(ndev, page, page_cnt,
+			    data));
+		return (nand_write_interleaved(ndev, page, page_cnt, data));
+	}
+
+	/*
+	 * Sequential writes to a single LUN are pipelined with
+	 * cache program. Like cache read the sequence stays
+	 * within a block.
+	 */
+	if (!nand_page_ops(ndev) && !read && page_cnt > 1 &&
+	    (ndev->ndev_options & NAND_OPT_CACHE_PROGRAM) != 0) {
+		nand_select_lun(ndev, 0);
+		while (page_cnt > 0) {
+			cnt = MIN(page_cnt, ndev->ndev_page_cnt -
+			    (page % ndev->ndev_page_cnt));
+			if (cnt > 1)
+				err = nand_write_cached(ndev, page, cnt, data);
+			else
+				err = nand_write_data(ndev, page, data);
+			if (err != 0)
+				return (err);
+
+			data += cnt * ndev->ndev_page_size;
+			page += cnt;
+			page_cnt -= cnt;
+		}
+		return (0);
+	}
+
+	/*
+	 * Likewise sequential reads use cache read. The
+	 * sequence is not allowed to cross a block boundary.
+	 */
+	if (!nand_page_ops(ndev) && read && page_cnt > 1 &&
+	    (ndev->ndev_options & NAND_OPT_CACHE_READ) != 0) {
+		nand_select_lun(ndev, 0);
+		while (page_cnt > 0) {
+			cnt = MIN(page_cnt, ndev->ndev_page_cnt -
+			    (page % ndev->ndev_page_cnt));
+			if (cnt > 1)
+				err = nand_read_cached(ndev, page, cnt, data);
+			else
+				err = nand_read_data(ndev, page, data);
+			if (err != 0)
+				return (err);
 
-static d_strategy_t nand_strategy;
+			data += cnt * ndev->ndev_page_size;
+			page += cnt;
+			page_cnt -= cnt;
+		}
+		return (0);
+	}
+
+	/* Each page on its own, a single call with page operations */
+	for (; page_cnt > 0; page_cnt--, page++) {
+		lun = nand_page_lun(ndev, page, &lun_page);
+		nand_select_lun(ndev, lun);
+		if (read)
+			err = nand_read_data(ndev, lun_page, data);
+		else
+			err = nand_write_data(ndev, lun_page, data);
+		if (err != 0)
+			return (err);
+		data += ndev->ndev_page_size;
+	}
+
+	return (0);
+}
 
 /*
- * Reads the device ID into the softc
+ * Reads or writes a run of disk pages. The bad block table is not
+ * checked. Reads are timed for the read_latency sysctl.
  */
+int
+nand_rw_pages(nand_device_t ndev, off_t page, int page_cnt, uint8_t *data,
+    int read)
+{
+	struct timespec start, end;
+	int err;
+
+	if (!read)
+		return (nand_rw_run(ndev, page, page_cnt, data, 0));
+
+	nanouptime(&start);
+	err = nand_rw_run(ndev, page, page_cnt, data, 1);
+	nanouptime(&end);
+
+	ndev->ndev_stats.ns_read_pages += page_cnt;
+	ndev->ndev_stats.ns_read_time += (end.tv_sec - start.tv_sec) *
+	    (uint64_t)1000000000 + end.tv_nsec - start.tv_nsec;
+
+	return (err);
+}
+
 static int
-nand_readid(nand_device_t ndev)
+nand_sysctl_read_latency(SYSCTL_HANDLER_ARGS)
 {
-	nand_wait_select(ndev, 1);
-	nand_command(ndev, NAND_CMD_READID);
-	nand_address(ndev, NAND_READID_MANFID);
-	nand_read_8(ndev, &ndev->ndev_manf_id);
-	nand_read_8(ndev, &ndev->ndev_dev_id);
-	nand_wait_select(ndev, 0);
+	nand_device_t ndev;
+	u_int latency;
 
-	return (0);
+	ndev = arg1;
+	latency = 0;
+	if (ndev->ndev_stats.ns_read_pages > 0)
+		latency = ndev->ndev_stats.ns_read_time /
+		    ndev->ndev_stats.ns_read_pages;
+
+	return (sysctl_handle_int(oidp, &latency, 0, req));
 }
 
 /*
- * Writes the address to read/write to the bus
+ * Read ahead. A read starting where the last one ended is taken to be
+ * part of a sequential stream and the pages after it are read into the
+ * cache when the worker is idle. The window doubles once a full window
+ * of pages read ahead have been used and halves each time one is
+ * evicted from the cache unused.
  */
-static inline void
-nand_write_address(nand_device_t ndev, off_t page, int with_column)
+static void
+nand_ra_init(nand_device_t ndev)
 {
-	off_t i;
-
-	if (with_column) {
-		/* We always want the start of the page */
-		for (i = 0; i < ndev->ndev_column_cycles; i++)
-			nand_address(ndev, 0x00);
+	char tunable[32];
+	int max;
+
+	ndev->ndev_ra_last = (off_t)ndev->ndev_lun_cnt *
+	    ndev->ndev_data_blocks * ndev->ndev_page_cnt;
+
+	/* Default to one block from each LUN */
+	max = ndev->ndev_lun_cnt * ndev->ndev_page_cnt;
+	snprintf(tunable, sizeof(tunable), "hw.nand.%d.readahead",
+	    ndev->ndev_unit);
+	TUNABLE_INT_FETCH(tunable, &max);
+
+	/* Leave room in the cache for the pages being used */
+	max = MIN(max, ndev->ndev_cache_cnt / 2);
+	if (max <= 0) {
+		ndev->ndev_ra_max = 0;
+		return;
 	}
-	/* Write the page address */
-	for (i = 0; i < ndev->ndev_row_cycles; i++, page >>= 8)
-		nand_address(ndev, page & 0xFF);
+
+	ndev->ndev_ra_buf = malloc(NAND_RA_CHUNK * ndev->ndev_page_size,
+	    M_NAND, M_WAITOK);
+	ndev->ndev_ra_max = max;
+	ndev->ndev_ra_window = MIN(NAND_RA_MIN, max);
+	ndev->ndev_ra_next = -1;
+	ndev->ndev_ra_seq = 0;
+	ndev->ndev_ra_used = 0;
 }
 
-static inline uint8_t
-nand_wait_status(nand_device_t ndev)
+static void
+nand_ra_fini(nand_device_t ndev)
 {
-	uint8_t status;
 
-	nand_command(ndev, NAND_CMD_READ_STATUS);
-	nand_read_8(ndev, &status);
+	free(ndev->ndev_ra_buf, M_NAND);
+	ndev->ndev_ra_buf = NULL;
+	ndev->ndev_ra_max = 0;
+}
 
-	while ((status & NAND_STATUS_RDY) == 0x00) {
-		DELAY(100);
-		nand_command(ndev, NAND_CMD_READ_STATUS);
-		nand_read_8(ndev, &status);
-	}
-	return status;
+/*
+ * Called for each read request to find sequential streams
+ */
+static void
+nand_ra_access(nand_device_t ndev, off_t page, int cnt)
+{
+
+	if (ndev->ndev_ra_max == 0)
+		return;
+
+	ndev->ndev_ra_seq = (page == ndev->ndev_ra_next);
+	if (!ndev->ndev_ra_seq)
+		ndev->ndev_ra_end = 0;
+	ndev->ndev_ra_next = page + cnt;
+	ndev->ndev_ra_end = MAX(ndev->ndev_ra_end, ndev->ndev_ra_next);
 }
 
-static int
-nand_rw_data(nand_device_t ndev, uint8_t *data, int read)
+static void
+nand_ra_used(nand_device_t ndev)
 {
-	size_t len, ecc_stride, stride;
-	u_int pos, ecc_pos, ecc_off;
-	int err;
 
-	ecc_stride = 0;
-	stride = ndev->ndev_page_size;
-	if (ndev->ndev_ecc != NULL) {
-		if (stride > ndev->ndev_ecc->ecc_protect)
-			stride = ndev->ndev_ecc->ecc_protect;
-		ecc_stride = ndev->ndev_ecc->ecc_stride;
+	if (++ndev->ndev_ra_used >= ndev->ndev_ra_window) {
+		ndev->ndev_ra_window = MIN(ndev->ndev_ra_window * 2,
+		    ndev->ndev_ra_max);
+		ndev->ndev_ra_used = 0;
 	}
-	len = stride;
+}
 
-	/* Read each ECC block */
-	for (pos = 0, ecc_pos = 0; pos < ndev->ndev_page_size;
-	     pos += len, ecc_pos += ecc_stride) {
-		/* Init the ECC for the read */
-		nand_init_ecc(ndev);
+static void
+nand_ra_wasted(nand_device_t ndev)
+{
 
-		/* Read the page */
-		if (len < ndev->ndev_page_size - pos)
-			len = ndev->ndev_page_size - pos;
-		if (read)
-			nand_read(ndev, len, &data[pos]);
-		else
-			nand_write(ndev, len, &data[pos]);
+	ndev->ndev_ra_window = MAX(ndev->ndev_ra_window / 2,
+	    MIN(NAND_RA_MIN, ndev->ndev_ra_max));
+	ndev->ndev_ra_used = 0;
+}
 
-		/* Calculate the ECC value of the data we just read */
-		if (ndev->ndev_calc_ecc != NULL)
-			nand_calc_ecc(ndev, &ndev->ndev_calc_ecc[ecc_pos]);
-	}
+/*
+ * Reads the window after the current stream into the cache. After the
+ * first chunk it gives up if a request has been queued so it isn't
+ * delayed. A reader that queues its next request as soon as the last
+ * completes would otherwise never be read ahead of.
+ */
+static void
+nand_readahead(nand_device_t ndev)
+{
+	off_t end, page;
+	int busy, cnt, i;
+
+	if (ndev->ndev_ra_max == 0 || !ndev->ndev_ra_seq)
+		return;
+
+	end = MIN(ndev->ndev_ra_next + ndev->ndev_ra_window,
+	    ndev->ndev_ra_last);
+	page = ndev->ndev_ra_end;
+	while (page < end) {
+		if (page != ndev->ndev_ra_end) {
+			mtx_lock(&ndev->ndev_mtx);
+			busy = (bioq_first(&ndev->ndev_bioq) != NULL);
+			mtx_unlock(&ndev->ndev_mtx);
+			if (busy)
+				break;
+		}
 
-	if (read)
-		nand_read(ndev, ndev->ndev_spare_size, ndev->ndev_oob);
-	else
-		memset(ndev->ndev_oob, 0xFF, ndev->ndev_spare_size);
+		if (nand_cache_find(ndev, page) != NULL) {
+			page++;
+			continue;
+		}
 
-	/* Copy the ECC to the relevant positions in the OOB */
-	if (ndev->ndev_calc_ecc != NULL) {
-		for (ecc_pos = 0; ecc_pos < ndev->ndev_ecc->ecc_size;
-		     ecc_pos++) {
-			/* The offset in the OOB of this byte of ECC data */
-			ecc_off = ndev->ndev_ecc->ecc_pos[ecc_pos];
+		for (cnt = 1; cnt < MIN(end - page, NAND_RA_CHUNK); cnt++)
+			if (nand_cache_find(ndev, page + cnt) != NULL)
+				break;
 
-			if (read)
-				ndev->ndev_read_ecc[ecc_pos] =
-				    ndev->ndev_oob[ecc_off];
-			else
-				ndev->ndev_oob[ecc_off] =
-				    ndev->ndev_calc_ecc[ecc_pos];
-		}
-
-		if (read) {
-			len = stride;
-			for (pos = 0, ecc_pos = 0; pos < ndev->ndev_page_size;
-			     pos += len, ecc_pos += ecc_stride) {
-				if (len < ndev->ndev_page_size - pos)
-					len = ndev->ndev_page_size - pos;
-				err = nand_fix_data(ndev, len, &data[pos],
-				    &ndev->ndev_calc_ecc[ecc_pos],
-				    &ndev->ndev_read_ecc[ecc_pos]);
-				if (err != 0)
-					return (err);
-			}
+		if (nand_bbt_check(ndev, page, cnt) != 0 ||
+		    nand_rw_pages(ndev, page, cnt, ndev->ndev_ra_buf, 1) != 0) {
+			/* Let the reader find the error */
+			ndev->ndev_ra_seq = 0;
+			break;
 		}
-	}
 
-	if (!read) {
-		/* TODO: Copy any extra data into the OOB */
-		/* Write the OOB */
-		nand_write(ndev, ndev->ndev_spare_size, ndev->ndev_oob);
+		for (i = 0; i < cnt; i++)
+			nand_cache_insert(ndev, page + i,
+			    &ndev->ndev_ra_buf[i * ndev->ndev_page_size],
+			    NAND_CACHE_RA);
+		ndev->ndev_stats.ns_ra_pages += cnt;
+		page += cnt;
 	}
-
-	return (0);
+	ndev->ndev_ra_end = page;
 }
 
 /*
- * Reads the data including spare if len is large enough from the NAND flash
+ * Reads a page and, if tag is not NULL, the FTL tag stored
+ * with it. Pages read without the tag may come from the cache.
  */
-static int
-nand_read_data(nand_device_t ndev, off_t page, uint8_t *data)
+int
+nand_page_read(nand_device_t ndev, off_t page, uint8_t *data, uint8_t *tag)
 {
-	int err = 0;
-
-	nand_command(ndev, NAND_CMD_READ);
-	nand_write_address(ndev, page, 1);
+	int err;
 
-	/* XXX: ONFI 1.0 says we need this but some Samsung parts don't */
-	if (ndev->ndev_read_start)
-		nand_command(ndev, NAND_CMD_READ_START);
+	if (nand_page_isbad(ndev, page))
+		return (EIO);
+	/* Only a lookup that was made can miss */
+	if (tag == NULL && ndev->ndev_cache_cnt != 0) {
+		if (nand_cache_read(ndev, page, data))
+			return (0);
+		ndev->ndev_stats.ns_cache_misses++;
+	}
 
-	/* Wait for data to be read */
-	nand_wait_rnb(ndev);
+	err = nand_rw_pages(ndev, page, 1, data, 1);
+	if (err != 0)
+		return (err);
 
-	err = nand_rw_data(ndev, data, 1);
+	if (tag != NULL)
+		memcpy(tag, &ndev->ndev_oob[NAND_TAG_OFFSET], NAND_TAG_SIZE);
+	if (ndev->ndev_cache_cnt != 0)
+		nand_cache_insert(ndev, page, data, 0);
 
-	return (err);
+	return (0);
 }
 
 /*
- * Writes data to the disk including the spare area after the sector
+ * Programs a page storing tag in the spare area
  */
-static int
-nand_write_data(nand_device_t ndev, off_t page, uint8_t *data)
+int
+nand_page_program(nand_device_t ndev, off_t page, uint8_t *data, uint8_t *tag)
 {
-	uint8_t status;
-
-	nand_command(ndev, NAND_CMD_PROGRAM);
-	nand_write_address(ndev, page, 1);
-
-	nand_rw_data(ndev, data, 0);
-
-	nand_command(ndev, NAND_CMD_PROGRAM_END);
+	int err;
 
-	status = nand_wait_status(ndev);
-	if ((status & NAND_STATUS_FAIL) == NAND_STATUS_FAIL)
+	if (nand_page_isbad(ndev, page))
 		return (EIO);
+	ndev->ndev_tag = tag;
+	err = nand_rw_pages(ndev, page, 1, data, 0);
+	ndev->ndev_tag = NULL;
+	nand_cache_invalidate(ndev, page, 1);
 
-	return (0);
+	return (err);
 }
 
-static int
-nand_erase_data(nand_device_t ndev, off_t block)
+/*
+ * Erases a block on the disk, i.e. the block with this index on each LUN
+ */
+int
+nand_block_erase(nand_device_t ndev, off_t block)
 {
-	int status;
+	off_t page_cnt;
 
-	nand_command(ndev, NAND_CMD_ERASE);
-	nand_write_address(ndev, block, 0);
-	nand_command(ndev, NAND_CMD_PROGRAM_END);
+	page_cnt = ndev->ndev_lun_cnt * ndev->ndev_page_cnt;
+	nand_cache_invalidate(ndev, block * page_cnt, page_cnt);
 
-	status = nand_wait_status(ndev);
-	if ((status & NAND_STATUS_FAIL) == NAND_STATUS_FAIL)
-		return (EIO);
+	return (nand_erase_interleaved(ndev, block));
+}
 
-	return (0);
+static void
+nand_getattr(nand_device_t ndev, struct bio *bp)
+{
+
+	/* TODO: Fill in */
+	if (g_handleattr_int(bp, "NAND::luncount", ndev->ndev_lun_cnt))
+		return;
+	if (g_handleattr_int(bp, "NAND::blocksize",
+	    ndev->ndev_page_size * ndev->ndev_page_cnt))
+		return;
+	if (g_handleattr_int(bp, "NAND::blockcount",
+	    ndev->ndev_data_blocks))
+		return;
+	if (g_handleattr_int(bp, "NAND::pagesize",ndev->ndev_page_size))
+		return;
+	if (g_handleattr_int(bp, "NAND::pagecount",
+	    ndev->ndev_page_size))
+		return;
+	if (g_handleattr_int(bp, "NAND::oobsize",ndev->ndev_spare_size))
+		return;
+	if (g_handleattr_int(bp, "NAND::cellsize",ndev->ndev_cell_size))
+		return;
+
+	biofinish(bp, NULL, ENOIOCTL);
 }
 
+/*
+ * Performs a single request. Called from the worker
+ * thread with the chip selected.
+ */
 static void
-nand_strategy(struct bio *bp)
+nand_io(nand_device_t ndev, struct bio *bp)
 {
 	uint32_t block_size;
-	nand_device_t ndev;
 	off_t block, page;
 	uint8_t *data;
-	int blk_cnt, page_cnt, err;
-
-	ndev = bp->bio_disk->d_drv1;
+	int blk_cnt, cnt, i, page_cnt, err;
 
 	bp->bio_resid = bp->bio_bcount;
+
+	/* The FTL owns the blocks so the raw disk is only for reading */
+	if (ndev->ndev_ftl != NULL &&
+	    (bp->bio_cmd == BIO_WRITE || bp->bio_cmd == BIO_DELETE)) {
+		bp->bio_error = EROFS;
+		bp->bio_flags |= BIO_ERROR;
+		biodone(bp);
+		return;
+	}
+
 	switch(bp->bio_cmd) {
 	case BIO_READ:
-	case BIO_WRITE:
 		page = bp->bio_offset / ndev->ndev_page_size;
 		page_cnt = bp->bio_bcount / ndev->ndev_page_size;
-		data = bp->bio_data;
+		data = (uint8_t *)bp->bio_data;
 
-		nand_wait_select(ndev, 1);
-		while (page_cnt > 0) {
-			if (bp->bio_cmd == BIO_READ)
-				err = nand_read_data(ndev, page, data);
-			else
-				err = nand_write_data(ndev, page, data);
+		err = nand_bbt_check(ndev, page, page_cnt);
+		if (err != 0) {
+			bp->bio_error = err;
+			bp->bio_flags |= BIO_ERROR;
+			break;
+		}
 
+		nand_ra_access(ndev, page, page_cnt);
+		/* Without the cache the pages are read in one go */
+		if (ndev->ndev_cache_cnt == 0) {
+			err = nand_rw_pages(ndev, page, page_cnt, data, 1);
 			if (err != 0) {
 				bp->bio_error = err;
 				bp->bio_flags |= BIO_ERROR;
 				break;
 			}
+			bp->bio_resid = 0;
+			break;
+		}
+		while (page_cnt > 0) {
+			if (nand_cache_read(ndev, page, data)) {
+				cnt = 1;
+			} else {
+				/* Read up to the next cached page */
+				for (cnt = 1; cnt < page_cnt; cnt++)
+					if (nand_cache_find(ndev,
+					    page + cnt) != NULL)
+						break;
+				ndev->ndev_stats.ns_cache_misses += cnt;
+
+				err = nand_rw_pages(ndev, page, cnt, data, 1);
+				if (err != 0) {
+					bp->bio_error = err;
+					bp->bio_flags |= BIO_ERROR;
+					break;
+				}
+
+				for (i = 0; i < cnt; i++)
+					nand_cache_insert(ndev, page + i,
+					    &data[i * ndev->ndev_page_size], 0);
+			}
 
-			bp->bio_resid -= ndev->ndev_page_size;
-			data += ndev->ndev_page_size;
-			page++;
-			page_cnt--;
+			bp->bio_resid -= cnt * ndev->ndev_page_size;
+			data += cnt * ndev->ndev_page_size;
+			page += cnt;
+			page_cnt -= cnt;
 		}
-		nand_wait_select(ndev, 0);
+		break;
+
+	case BIO_WRITE:
+		page = bp->bio_offset / ndev->ndev_page_size;
+		page_cnt = bp->bio_bcount / ndev->ndev_page_size;
+
+		err = nand_bbt_check(ndev, page, page_cnt);
+		if (err != 0) {
+			bp->bio_error = err;
+			bp->bio_flags |= BIO_ERROR;
+			break;
+		}
+
+		err = nand_rw_pages(ndev, page, page_cnt,
+		    (uint8_t *)bp->bio_data, 0);
+		/* A failed write may still have changed some pages */
+		nand_cache_invalidate(ndev, page, page_cnt);
+		if (err != 0) {
+			bp->bio_error = err;
+			bp->bio_flags |= BIO_ERROR;
+			break;
+		}
+		bp->bio_resid = 0;
 		break;
 
 	case BIO_DELETE:
-		block_size = ndev->ndev_page_cnt * ndev->ndev_page_size;
+		/* A block on the disk is made from one block on each LUN */
+		block_size = ndev->ndev_lun_cnt * ndev->ndev_page_cnt *
+		    ndev->ndev_page_size;
 		block = bp->bio_offset / block_size;
 		blk_cnt = bp->bio_bcount / block_size;
 
@@ -318,16 +1861,19 @@ nand_strategy(struct bio *bp)
 		 * Deletes must be on a block boundry
 		 * and be the size of a block
 		 */
-		if (((block % block_size) != 0) ||
+		if (((bp->bio_offset % block_size) != 0) ||
 		    ((bp->bio_bcount % block_size) != 0)) {
 			bp->bio_error = ENOTSUP;
 			bp->bio_flags |= BIO_ERROR;
 			break;
 		}
 
-		nand_wait_select(ndev, 1);
+		nand_cache_invalidate(ndev,
+		    block * ndev->ndev_lun_cnt * ndev->ndev_page_cnt,
+		    blk_cnt * ndev->ndev_lun_cnt * ndev->ndev_page_cnt);
+
 		while (blk_cnt > 0) {
-			err = nand_erase_data(ndev, block);
+			err = nand_erase_interleaved(ndev, block);
 
 			if (err != 0) {
 				bp->bio_error = err;
@@ -339,32 +1885,8 @@ nand_strategy(struct bio *bp)
 			block++;
 			blk_cnt--;
 		}
-		nand_wait_select(ndev, 0);
 		break;
 
-	case BIO_GETATTR:
-		/* TODO: Fill in */
-		if (g_handleattr_int(bp, "NAND::luncount", ndev->ndev_lun_cnt))
-			return;
-		if (g_handleattr_int(bp, "NAND::blocksize",
-		    ndev->ndev_page_size * ndev->ndev_page_cnt))
-			return;
-		if (g_handleattr_int(bp, "NAND::blockcount",
-		    ndev->ndev_block_cnt))
-			return;
-		if (g_handleattr_int(bp, "NAND::pagesize",ndev->ndev_page_size))
-			return;
-		if (g_handleattr_int(bp, "NAND::pagecount",
-		    ndev->ndev_page_size))
-			return;
-		if (g_handleattr_int(bp, "NAND::oobsize",ndev->ndev_spare_size))
-			return;
-		if (g_handleattr_int(bp, "NAND::cellsize",ndev->ndev_cell_size))
-			return;
-
-		bp->bio_error = ENOIOCTL;
-		bp->bio_flags |= BIO_ERROR;
-
 	default:
 		bp->bio_error = ENOTSUP;
 		bp->bio_flags |= BIO_ERROR;
@@ -374,10 +1896,94 @@ nand_strategy(struct bio *bp)
 	biodone(bp);
 }
 
+/*
+ * The per-device worker thread. It takes every request queued since
+ * it last ran and services them as a batch so nand_strategy never
+ * waits on the flash and only one thread touches the bus and the
+ * shared ndev_oob and ECC buffers.
+ */
+static void
+nand_worker(void *arg)
+{
+	struct bio_queue_head queue;
+	nand_device_t ndev;
+	struct bio *bp;
+
+	ndev = arg;
+	bioq_init(&queue);
+
+	mtx_lock(&ndev->ndev_mtx);
+	for (;;) {
+		while (bioq_first(&ndev->ndev_bioq) == NULL) {
+			if ((ndev->ndev_flags & NAND_DEV_DYING) != 0)
+				goto out;
+			msleep(ndev, &ndev->ndev_mtx, PRIBIO, "nandwait", 0);
+		}
+
+		while ((bp = bioq_takefirst(&ndev->ndev_bioq)) != NULL)
+			bioq_insert_tail(&queue, bp);
+		mtx_unlock(&ndev->ndev_mtx);
+
+		sx_xlock(&ndev->ndev_chip_lock);
+		nand_select_lun(ndev, ndev->ndev_lun);
+		while ((bp = bioq_takefirst(&queue)) != NULL) {
+			if (bp->bio_disk == ndev->ndev_ftl_disk)
+				nand_ftl_io(ndev, bp);
+			else
+				nand_io(ndev, bp);
+		}
+		nand_readahead(ndev);
+		nand_bbt_sync(ndev);
+		nand_wait_select(ndev, 0);
+		sx_xunlock(&ndev->ndev_chip_lock);
+
+		mtx_lock(&ndev->ndev_mtx);
+	}
+
+out:
+	ndev->ndev_proc = NULL;
+	wakeup(&ndev->ndev_proc);
+	mtx_unlock(&ndev->ndev_mtx);
+
+	kproc_exit(0);
+}
+
+/*
+ * Queue the request for the worker thread. Only attribute
+ * requests are handled here as they don't touch the flash.
+ */
+static void
+nand_strategy(struct bio *bp)
+{
+	nand_device_t ndev;
+
+	ndev = bp->bio_disk->d_drv1;
+
+	if (bp->bio_cmd == BIO_GETATTR) {
+		/* The FTL disk hides the NAND geometry */
+		if (bp->bio_disk == ndev->ndev_disk)
+			nand_getattr(ndev, bp);
+		else
+			biofinish(bp, NULL, ENOIOCTL);
+		return;
+	}
+
+	mtx_lock(&ndev->ndev_mtx);
+	if ((ndev->ndev_flags & NAND_DEV_DYING) != 0) {
+		mtx_unlock(&ndev->ndev_mtx);
+		biofinish(bp, NULL, ENXIO);
+		return;
+	}
+	bioq_insert_tail(&ndev->ndev_bioq, bp);
+	wakeup(ndev);
+	mtx_unlock(&ndev->ndev_mtx);
+}
+
 int
 nand_probe(nand_device_t ndev)
 {
-	int err, i;
+	uint8_t manf_id, dev_id;
+	int err, i, lun;
 
 	if (ndev->ndev_driver->ndri_command == NULL ||
 	    ndev->ndev_driver->ndri_address == NULL ||
@@ -390,12 +1996,13 @@ nand_probe(nand_device_t ndev)
 	ndev->ndev_cell_size = 8;
 
 	err = nand_command(ndev, NAND_CMD_RESET);
-	nand_wait_rnb(ndev);
+	nand_wait_rnb(ndev, NAND_WAIT_RESET);
 	if (err != 0)
 		return (EIO);
 
 	/* Find which part we have */
-	err = nand_readid(ndev);
+	ndev->ndev_lun = 0;
+	err = nand_readid(ndev, &ndev->ndev_manf_id, &ndev->ndev_dev_id);
 	if (err != 0)
 		return (EIO);
 
@@ -408,52 +2015,186 @@ nand_probe(nand_device_t ndev)
 			break;
 		}
 
-	if (nand_chips[i].ndi_name == NULL) {
+	if (nand_chips[i].ndi_name == NULL &&
+	    (ndev->ndev_driver->ndri_device_info == NULL ||
+	    ndev->ndev_driver->ndri_device_info(ndev, &ndev->ndev_info) != 0)) {
 		printf("nand: manufacturer 0x%x device 0x%x is not supported\n",
 		    ndev->ndev_manf_id, ndev->ndev_dev_id);
 		return (ENODEV);
 	}
 
+	/*
+	 * Look for more of the same part behind the other chip enables.
+	 * Controllers with one chip enable fail to select LUN 1.
+	 */
+	ndev->ndev_lun_cnt = 1;
+	if (ndev->ndev_driver->ndri_select != NULL) {
+		for (lun = 1; lun < NAND_MAX_LUN; lun++) {
+			ndev->ndev_lun = lun;
+			if (ndev->ndev_driver->ndri_select(ndev, 1) != 0)
+				break;
+			err = nand_command(ndev, NAND_CMD_RESET);
+			nand_wait_rnb(ndev, NAND_WAIT_RESET);
+			if (err == 0)
+				err = nand_readid(ndev, &manf_id, &dev_id);
+			if (err != 0 || manf_id != ndev->ndev_manf_id ||
+			    dev_id != ndev->ndev_dev_id)
+				break;
+		}
+		ndev->ndev_lun_cnt = lun;
+		ndev->ndev_lun = 0;
+	}
+
 	return (0);
 }
 
 int
 nand_attach(nand_device_t ndev)
 {
-	int err;
-
-	err = nand_command(ndev, NAND_CMD_RESET);
-	nand_wait_rnb(ndev);
-	if (err != 0)
-		goto out;
+	struct sysctl_oid_list *children;
+	char name[8];
+	int err, lun;
+
+	mtx_init(&ndev->ndev_mtx, "nand", NULL, MTX_DEF);
+	sx_init(&ndev->ndev_chip_lock, "nandchip");
+	bioq_init(&ndev->ndev_bioq);
+	ndev->ndev_flags = 0;
+	ndev->ndev_unit = next_unit++;
+	nand_cache_init(ndev);
+	nand_wait_init(ndev);
+
+	snprintf(name, sizeof(name), "%d", ndev->ndev_unit);
+	sysctl_ctx_init(&ndev->ndev_sysctl_ctx);
+	ndev->ndev_sysctl_tree = SYSCTL_ADD_NODE(&ndev->ndev_sysctl_ctx,
+	    SYSCTL_STATIC_CHILDREN(_hw_nand), OID_AUTO, name, CTLFLAG_RD, 0,
+	    ndev->ndev_name);
+
+	for (lun = 0; lun < ndev->ndev_lun_cnt; lun++) {
+		nand_select_lun(ndev, lun);
+		err = nand_command(ndev, NAND_CMD_RESET);
+		nand_wait_rnb(ndev, NAND_WAIT_RESET);
+		nand_wait_select(ndev, 0);
+		if (err != 0)
+			goto out;
+	}
+	ndev->ndev_lun = 0;
 
 	ndev->ndev_oob = malloc(ndev->ndev_spare_size, M_NAND, M_WAITOK);
 
 	if (ndev->ndev_ecc != NULL) {
-		ndev->ndev_calc_ecc = malloc(ndev->ndev_ecc->ecc_size, M_NAND,
-		    M_WAITOK);
-		ndev->ndev_read_ecc = malloc(ndev->ndev_ecc->ecc_size, M_NAND,
-		    M_WAITOK);
+		/* Two slots so a page can be checked as the next one moves */
+		ndev->ndev_calc_ecc = malloc(2 * ndev->ndev_ecc->ecc_size,
+		    M_NAND, M_WAITOK);
+		ndev->ndev_read_ecc = malloc(2 * ndev->ndev_ecc->ecc_size,
+		    M_NAND, M_WAITOK);
 	}
 
+	err = nand_bbt_attach(ndev);
+	nand_wait_select(ndev, 0);
+	if (err != 0)
+		goto out;
+	nand_ra_init(ndev);
+
+	/* Mount the FTL while nothing else can use the chip */
+	err = nand_ftl_attach(ndev);
+	if (err != 0)
+		goto out;
+
+	err = kproc_create(nand_worker, ndev, &ndev->ndev_proc, 0, 0,
+	    "nand%d", ndev->ndev_unit);
+	if (err != 0)
+		goto out;
+
 	ndev->ndev_disk = disk_alloc();
 	ndev->ndev_disk->d_name = "nand";
-	ndev->ndev_disk->d_unit = next_unit++;
-	ndev->ndev_disk->d_flags = DISKFLAG_CANDELETE;
+	ndev->ndev_disk->d_unit = ndev->ndev_unit;
+	if (ndev->ndev_ftl == NULL)
+		ndev->ndev_disk->d_flags = DISKFLAG_CANDELETE;
 
 	ndev->ndev_disk->d_strategy = nand_strategy;
 
 	ndev->ndev_disk->d_sectorsize = ndev->ndev_page_size;
-	/* Limit to 1 block */
-	ndev->ndev_disk->d_maxsize = ndev->ndev_page_size * ndev->ndev_page_cnt;
+	/* Limit to 1 block from each LUN */
+	ndev->ndev_disk->d_maxsize = ndev->ndev_lun_cnt *
+	    ndev->ndev_page_size * ndev->ndev_page_cnt;
 
-	/* We ignore the spare as it is out of band data */
-	ndev->ndev_disk->d_mediasize = ndev->ndev_lun_cnt *
-	    ndev->ndev_block_cnt * ndev->ndev_page_cnt * ndev->ndev_page_size;
+	/*
+	 * We ignore the spare as it is out of band data.
+	 * The blocks holding the bad block table are hidden.
+	 */
+	ndev->ndev_disk->d_mediasize = (off_t)ndev->ndev_lun_cnt *
+	    ndev->ndev_data_blocks * ndev->ndev_page_cnt * ndev->ndev_page_size;
 
 	ndev->ndev_disk->d_drv1 = ndev;
 	disk_create(ndev->ndev_disk, DISK_VERSION);
 
+	/*
+	 * The FTL disk is rewritable. The raw disk stays for reading
+	 * the flash as it is, nand_io refuses to write to it.
+	 */
+	if (ndev->ndev_ftl != NULL) {
+		ndev->ndev_ftl_disk = disk_alloc();
+		ndev->ndev_ftl_disk->d_name = "nandftl";
+		ndev->ndev_ftl_disk->d_unit = ndev->ndev_unit;
+		ndev->ndev_ftl_disk->d_flags = DISKFLAG_CANDELETE;
+		ndev->ndev_ftl_disk->d_strategy = nand_strategy;
+		ndev->ndev_ftl_disk->d_sectorsize = ndev->ndev_page_size;
+		ndev->ndev_ftl_disk->d_maxsize = ndev->ndev_disk->d_maxsize;
+		ndev->ndev_ftl_disk->d_mediasize = nand_ftl_mediasize(ndev);
+		ndev->ndev_ftl_disk->d_drv1 = ndev;
+		disk_create(ndev->ndev_ftl_disk, DISK_VERSION);
+	}
+
+	children = SYSCTL_CHILDREN(ndev->ndev_sysctl_tree);
+	SYSCTL_ADD_INT(&ndev->ndev_sysctl_ctx, children, OID_AUTO, "luns",
+	    CTLFLAG_RD, NULL, ndev->ndev_lun_cnt, "Number of LUNs");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO, "reads",
+	    CTLFLAG_RD, &ndev->ndev_stats.ns_reads, "Pages read");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO, "writes",
+	    CTLFLAG_RD, &ndev->ndev_stats.ns_writes, "Pages programmed");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO, "erases",
+	    CTLFLAG_RD, &ndev->ndev_stats.ns_erases, "Blocks erased");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "interleaved", CTLFLAG_RD, &ndev->ndev_stats.ns_interleaved,
+	    "Operations started while another LUN was busy");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO, "dma",
+	    CTLFLAG_RD, &ndev->ndev_stats.ns_dma, "Pages moved by DMA");
+	SYSCTL_ADD_PROC(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "read_latency", CTLTYPE_UINT | CTLFLAG_RD, ndev, 0,
+	    nand_sysctl_read_latency, "IU",
+	    "Average nanoseconds to read and check a page");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "ecc_corrected", CTLFLAG_RD, &ndev->ndev_stats.ns_ecc_corrected,
+	    "Bit errors corrected by ECC");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "ecc_failed", CTLFLAG_RD, &ndev->ndev_stats.ns_ecc_failed,
+	    "ECC blocks with too many errors to correct");
+	SYSCTL_ADD_INT(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "bad_blocks", CTLFLAG_RD, &ndev->ndev_bad_blocks, 0,
+	    "Blocks in the bad block table");
+	SYSCTL_ADD_UINT(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "bbt_version", CTLFLAG_RD, &ndev->ndev_bbt_version, 0,
+	    "Version of the bad block table on the chip");
+	SYSCTL_ADD_INT(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "cache_entries", CTLFLAG_RD, NULL, ndev->ndev_cache_cnt,
+	    "Pages held by the read cache");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "cache_hits", CTLFLAG_RD, &ndev->ndev_stats.ns_cache_hits,
+	    "Pages read from the read cache");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "cache_misses", CTLFLAG_RD, &ndev->ndev_stats.ns_cache_misses,
+	    "Pages read from the chip");
+	SYSCTL_ADD_INT(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "readahead", CTLFLAG_RD, &ndev->ndev_ra_window, 0,
+	    "Current read ahead window in pages");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "ra_pages", CTLFLAG_RD, &ndev->ndev_stats.ns_ra_pages,
+	    "Pages read ahead");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "ra_hits", CTLFLAG_RD, &ndev->ndev_stats.ns_ra_hits,
+	    "Pages read ahead that were used");
+	nand_wait_sysctl(ndev, children);
+
 out:
 	if (err != 0) {
 		nand_detach(ndev);
@@ -465,11 +2206,54 @@ int
 nand_detach(nand_device_t ndev)
 {
 	/* TODO */
+	if (ndev->ndev_sysctl_tree != NULL) {
+		sysctl_ctx_free(&ndev->ndev_sysctl_ctx);
+		ndev->ndev_sysctl_tree = NULL;
+	}
+
+	/*
+	 * Let the worker finish any queued requests then wait for it.
+	 * Requests that come in meanwhile fail with ENXIO, so the disks
+	 * go only once nothing can be using the device.
+	 */
+	if (mtx_initialized(&ndev->ndev_mtx)) {
+		mtx_lock(&ndev->ndev_mtx);
+		ndev->ndev_flags |= NAND_DEV_DYING;
+		wakeup(ndev);
+		while (ndev->ndev_proc != NULL)
+			msleep(&ndev->ndev_proc, &ndev->ndev_mtx, PRIBIO,
+			    "nanddet", 0);
+		mtx_unlock(&ndev->ndev_mtx);
+	}
+
+	if (ndev->ndev_ftl_disk != NULL) {
+		disk_destroy(ndev->ndev_ftl_disk);
+		ndev->ndev_ftl_disk = NULL;
+	}
+
 	if (ndev->ndev_disk != NULL) {
 		disk_destroy(ndev->ndev_disk);
 		ndev->ndev_disk = NULL;
 	}
 
+	if (mtx_initialized(&ndev->ndev_mtx)) {
+		/* Stops the collector thread */
+		nand_ftl_detach(ndev);
+
+		/* Write any blocks that went bad since the last request */
+		if (ndev->ndev_bbt != NULL && ndev->ndev_oob != NULL) {
+			nand_bbt_sync(ndev);
+			nand_wait_select(ndev, 0);
+		}
+
+		mtx_destroy(&ndev->ndev_mtx);
+		sx_destroy(&ndev->ndev_chip_lock);
+	}
+
+	nand_ra_fini(ndev);
+	nand_cache_fini(ndev);
+	nand_bbt_detach(ndev);
+
 	free(ndev->ndev_oob, M_NAND);
 	free(ndev->ndev_calc_ecc, M_NAND);
 	free(ndev->ndev_read_ecc, M_NAND);
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2009 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * The bad block table. Factory bad blocks are found by scanning the
+ * markers the manufacturer left in the spare area the first time a
+ * chip is attached. The result, along with any blocks that fail later,
+ * is written to the blocks at the end of the chip so the markers are
+ * only read once. They would be lost when the blocks are erased.
+ *
+ * Each copy starts at the first page of a disk block with a header
+ * followed by the bitmap:
+ *	magic, version, size of the bitmap, CRC32 of the bitmap
+ * Each field is 32 bits little endian. The newest valid copy is used.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/bio.h>
+#include <sys/endian.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mutex.h>
+#include <sys/sx.h>
+
+#include "nandreg.h"
+#include "nandvar.h"
+
+MALLOC_DECLARE(M_NAND);
+
+#define	NAND_BBT_MAGIC		0x5442424E	/* "NBBT" */
+#define	NAND_BBT_HDR_SIZE	16
+
+/* The size of the bitmap in bytes */
+#define	NAND_BBT_SIZE(ndev) \
+    howmany((ndev)->ndev_lun_cnt * (ndev)->ndev_block_cnt, NBBY)
+/* Pages needed for a copy of the table */
+#define	NAND_BBT_PAGES(ndev) \
+    howmany(NAND_BBT_HDR_SIZE + NAND_BBT_SIZE(ndev), (ndev)->ndev_page_size)
+
+/*
+ * Checks the factory marker of a block on a LUN. The marker
+ * is outside the ECC protected data so ECC errors are ignored.
+ */
+static int
+nand_bbt_marker(nand_device_t ndev, int lun, off_t block, uint8_t *buf)
+{
+	off_t page;
+	int i, offset;
+
+	offset = NAND_BBM_SMALL_OFFSET;
+	if (ndev->ndev_page_size > 512)
+		offset = NAND_BBM_LARGE_OFFSET;
+
+	for (i = 0; i < 2; i++) {
+		page = (block * ndev->ndev_page_cnt + i) * ndev->ndev_lun_cnt +
+		    lun;
+		memset(ndev->ndev_oob, 0, ndev->ndev_spare_size);
+		nand_rw_pages(ndev, page, 1, buf, 1);
+		if (ndev->ndev_oob[offset] != 0xFF)
+			return (1);
+	}
+
+	return (0);
+}
+
+static void
+nand_bbt_scan(nand_device_t ndev, uint8_t *buf)
+{
+	off_t block;
+	int lun;
+
+	for (lun = 0; lun < ndev->ndev_lun_cnt; lun++)
+		for (block = 0; block < ndev->ndev_block_cnt; block++)
+			if (nand_bbt_marker(ndev, lun, block, buf))
+				nand_bbt_mark(ndev, lun, block);
+}
+
+/*
+ * Looks for the newest copy of the table. Each copy is read in one go.
+ */
+static int
+nand_bbt_load(nand_device_t ndev, uint8_t *buf)
+{
+	uint32_t size, version;
+	off_t block, ppb;
+	int copies, i;
+
+	ppb = ndev->ndev_lun_cnt * ndev->ndev_page_cnt;
+	size = NAND_BBT_SIZE(ndev);
+	copies = 0;
+	for (block = ndev->ndev_block_cnt - 1;
+	    block >= ndev->ndev_data_blocks; block--) {
+		if (nand_rw_pages(ndev, block * ppb, NAND_BBT_PAGES(ndev), buf,
+		    1) != 0)
+			continue;
+		if (le32dec(&buf[0]) != NAND_BBT_MAGIC ||
+		    le32dec(&buf[8]) != size ||
+		    le32dec(&buf[12]) != crc32(&buf[NAND_BBT_HDR_SIZE], size))
+			continue;
+
+		version = le32dec(&buf[4]);
+		if (copies > 0 && version == ndev->ndev_bbt_version) {
+			copies++;
+			continue;
+		}
+		if (copies > 0 && version < ndev->ndev_bbt_version)
+			continue;
+		memcpy(ndev->ndev_bbt, &buf[NAND_BBT_HDR_SIZE], size);
+		ndev->ndev_bbt_version = version;
+		copies = 1;
+	}
+	if (copies == 0)
+		return (ENOENT);
+
+	/* Rewrite the mirror if it was lost or is out of date */
+	if (copies < NAND_BBT_COPIES)
+		ndev->ndev_bbt_dirty = 1;
+
+	ndev->ndev_bad_blocks = 0;
+	for (i = 0; i < ndev->ndev_lun_cnt * ndev->ndev_block_cnt; i++)
+		if (isset(ndev->ndev_bbt, i))
+			ndev->ndev_bad_blocks++;
+
+	return (0);
+}
+
+/*
+ * Writes a new version of the table to the last good blocks. If writing
+ * one fails the block is marked bad and the next is used. As each copy
+ * is erased and written in turn one of them survives a power failure.
+ */
+static int
+nand_bbt_write(nand_device_t ndev, uint8_t *buf)
+{
+	uint32_t size, version;
+	off_t block, ppb;
+	int copies, err;
+
+	ppb = ndev->ndev_lun_cnt * ndev->ndev_page_cnt;
+	size = NAND_BBT_SIZE(ndev);
+	version = ndev->ndev_bbt_version + 1;
+
+	memset(buf, 0xFF, NAND_BBT_PAGES(ndev) * ndev->ndev_page_size);
+	le32enc(&buf[0], NAND_BBT_MAGIC);
+	le32enc(&buf[4], version);
+	le32enc(&buf[8], size);
+	le32enc(&buf[12], crc32(ndev->ndev_bbt, size));
+	memcpy(&buf[NAND_BBT_HDR_SIZE], ndev->ndev_bbt, size);
+
+	/* Blocks that fail from here on are written by the next sync */
+	ndev->ndev_bbt_dirty = 0;
+	copies = 0;
+	for (block = ndev->ndev_block_cnt - 1;
+	    block >= ndev->ndev_data_blocks && copies < NAND_BBT_COPIES;
+	    block--) {
+		if (nand_bbt_disk_bad(ndev, block))
+			continue;
+
+		err = nand_block_erase(ndev, block);
+		if (err == 0)
+			err = nand_rw_pages(ndev, block * ppb,
+			    NAND_BBT_PAGES(ndev), buf, 0);
+		if (err == 0)
+			copies++;
+	}
+	if (copies == 0) {
+		ndev->ndev_bbt_dirty = 1;
+		return (EIO);
+	}
+	ndev->ndev_bbt_version = version;
+
+	return (0);
+}
+
+/*
+ * Marks a block on a LUN as bad. The table is written by nand_bbt_sync.
+ */
+void
+nand_bbt_mark(nand_device_t ndev, int lun, off_t block)
+{
+
+	if (nand_block_isbad(ndev, lun, block))
+		return;
+
+	setbit(ndev->ndev_bbt, lun * ndev->ndev_block_cnt + block);
+	ndev->ndev_bad_blocks++;
+	ndev->ndev_bbt_dirty = 1;
+	device_printf(ndev->ndev_dev, "LUN %d block %jd is bad\n", lun,
+	    (intmax_t)block);
+}
+
+/*
+ * Writes the table if it has changed. Called with the chip lock held.
+ */
+int
+nand_bbt_sync(nand_device_t ndev)
+{
+	uint8_t *buf;
+	int err;
+
+	if (!ndev->ndev_bbt_dirty)
+		return (0);
+
+	buf = malloc(NAND_BBT_PAGES(ndev) * ndev->ndev_page_size, M_NAND,
+	    M_WAITOK);
+	err = nand_bbt_write(ndev, buf);
+	free(buf, M_NAND);
+
+	return (err);
+}
+
+/*
+ * Returns EIO if any of the disk pages are on a bad block
+ */
+int
+nand_bbt_check(nand_device_t ndev, off_t page, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		if (nand_page_isbad(ndev, page + i))
+			return (EIO);
+
+	return (0);
+}
+
+/*
+ * Is the block on any LUN making up a disk block bad
+ */
+int
+nand_bbt_disk_bad(nand_device_t ndev, off_t block)
+{
+	int lun;
+
+	for (lun = 0; lun < ndev->ndev_lun_cnt; lun++)
+		if (nand_block_isbad(ndev, lun, block))
+			return (1);
+
+	return (0);
+}
+
+/*
+ * Loads the table or, on a new chip, builds it from the factory markers
+ */
+int
+nand_bbt_attach(nand_device_t ndev)
+{
+	uint8_t *buf;
+	int err;
+
+	if (ndev->ndev_block_cnt <= NAND_BBT_BLOCKS)
+		return (ENXIO);
+	ndev->ndev_data_blocks = ndev->ndev_block_cnt - NAND_BBT_BLOCKS;
+
+	ndev->ndev_bbt = malloc(NAND_BBT_SIZE(ndev), M_NAND,
+	    M_WAITOK | M_ZERO);
+	ndev->ndev_bbt_version = 0;
+	ndev->ndev_bad_blocks = 0;
+	ndev->ndev_bbt_dirty = 0;
+
+	buf = malloc(NAND_BBT_PAGES(ndev) * ndev->ndev_page_size, M_NAND,
+	    M_WAITOK);
+	err = nand_bbt_load(ndev, buf);
+	if (err != 0) {
+		device_printf(ndev->ndev_dev,
+		    "No bad block table, scanning the factory markers\n");
+		nand_bbt_scan(ndev, buf);
+		ndev->ndev_bbt_dirty = 1;
+	}
+	if (ndev->ndev_bbt_dirty && nand_bbt_write(ndev, buf) != 0)
+		device_printf(ndev->ndev_dev,
+		    "Unable to write the bad block table\n");
+	free(buf, M_NAND);
+
+	return (0);
+}
+
+void
+nand_bbt_detach(nand_device_t ndev)
+{
+
+	free(ndev->ndev_bbt, M_NAND);
+	ndev->ndev_bbt = NULL;
+}
@@ -0,0 +1,457 @@
+/*
+ * Copyright (C) 2009 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Software BCH codec. The parity is the remainder of the data, taken as
+ * a polynomial over GF(2), times x^deg divided by the generator. The
+ * remainder is computed 32 bits of data at a time using tables of the
+ * remainder of each byte value in each position of a word.
+ *
+ * Decoding recomputes the parity of the data read. When it matches the
+ * parity read with it there are no errors and nothing more is done.
+ * Otherwise the syndromes are found from the difference, the error
+ * locator polynomial from them with Berlekamp-Massey and its roots,
+ * giving the location of each error, with a Chien search.
+ *
+ * The parity is xored with a mask making the parity of an erased block
+ * all ones so erased pages read without errors.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#ifdef _KERNEL
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#else
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#include "nand_bch.h"
+
+#ifdef _KERNEL
+MALLOC_DECLARE(M_NAND);
+#define	BCH_ALLOC(size)	malloc(size, M_NAND, M_WAITOK | M_ZERO)
+#define	BCH_FREE(ptr)	free(ptr, M_NAND)
+#else
+#define	KASSERT(exp, msg) assert(exp)
+#define	BCH_ALLOC(size)	calloc(1, size)
+#define	BCH_FREE(ptr)	free(ptr)
+#endif
+
+#define	BCH_MIN_M	5
+#define	BCH_MAX_M	15
+
+/* Primitive polynomials for GF(2^5) to GF(2^15) */
+static const uint32_t nand_bch_prim[] = {
+	0x25, 0x43, 0x83, 0x11d, 0x211, 0x409, 0x805, 0x1053, 0x201b, 0x402b,
+	0x8003
+};
+
+struct nand_bch {
+	int		nb_m;
+	int		nb_t;		/* Errors corrected per block */
+	int		nb_n;		/* 2^m - 1, the order of the field */
+	int		nb_deg;		/* Parity bits */
+	int		nb_words;	/* 32 bit words of parity */
+	int		nb_bytes;	/* Bytes of parity */
+	int		nb_len;		/* Bytes of data in a block */
+
+	uint16_t	*nb_alog;	/* alpha^i */
+	uint16_t	*nb_log;
+
+	/*
+	 * Polynomials over GF(2) are kept in arrays of words with the
+	 * coefficient of x^(deg - 1) in the top bit of the first word.
+	 */
+	uint32_t	*nb_gen;	/* The generator without x^deg */
+	uint32_t	*nb_tab;	/* 4 * 256 remainders */
+	uint32_t	*nb_rem;
+	uint8_t		*nb_mask;
+
+	/* Used while decoding */
+	int		*nb_syn;	/* S(1) to S(2t) */
+	int		*nb_lambda;	/* The error locator */
+	int		*nb_prev;
+	int		*nb_tmp;
+};
+
+static inline int
+nand_bch_mul(struct nand_bch *nb, int a, int b)
+{
+
+	if (a == 0 || b == 0)
+		return (0);
+	return (nb->nb_alog[(nb->nb_log[a] + nb->nb_log[b]) % nb->nb_n]);
+}
+
+static inline int
+nand_bch_div(struct nand_bch *nb, int a, int b)
+{
+
+	if (a == 0)
+		return (0);
+	return (nb->nb_alog[(nb->nb_log[a] + nb->nb_n - nb->nb_log[b]) %
+	    nb->nb_n]);
+}
+
+/*
+ * Divides one word of data into the remainder a bit at a time. Only
+ * used to build the tables.
+ */
+static void
+nand_bch_encode_slow(struct nand_bch *nb, uint32_t data, uint32_t *rem)
+{
+	uint32_t fb;
+	int bit, i;
+
+	for (bit = 31; bit >= 0; bit--) {
+		fb = (rem[0] >> 31) ^ ((data >> bit) & 1);
+		for (i = 0; i < nb->nb_words - 1; i++)
+			rem[i] = (rem[i] << 1) | (rem[i + 1] >> 31);
+		rem[nb->nb_words - 1] <<= 1;
+		if (fb)
+			for (i = 0; i < nb->nb_words; i++)
+				rem[i] ^= nb->nb_gen[i];
+	}
+}
+
+/*
+ * Builds the generator polynomial, the product of (x - alpha^i) for i
+ * in the cyclotomic cosets of 1, 3, ... 2t - 1. Returns its degree.
+ */
+static int
+nand_bch_genpoly(struct nand_bch *nb)
+{
+	uint8_t *root;
+	int *gen;
+	int deg, i, j, r;
+
+	root = BCH_ALLOC(nb->nb_n);
+	gen = BCH_ALLOC((nb->nb_m * nb->nb_t + 1) * sizeof(int));
+
+	for (i = 1; i < 2 * nb->nb_t; i += 2)
+		for (r = i, j = 0; j < nb->nb_m; j++, r = (r * 2) % nb->nb_n)
+			root[r] = 1;
+
+	gen[0] = 1;
+	deg = 0;
+	for (r = 0; r < nb->nb_n; r++) {
+		if (!root[r])
+			continue;
+		/* gen(x) *= (x + alpha^r) */
+		gen[deg + 1] = 1;
+		for (i = deg; i > 0; i--)
+			gen[i] = gen[i - 1] ^
+			    nand_bch_mul(nb, gen[i], nb->nb_alog[r]);
+		gen[0] = nand_bch_mul(nb, gen[0], nb->nb_alog[r]);
+		deg++;
+	}
+
+	/* The coefficients are 0 or 1, leave out x^deg */
+	for (i = 0; i < deg; i++)
+		if (gen[deg - 1 - i])
+			nb->nb_gen[i / 32] |= 1U << (31 - i % 32);
+
+	BCH_FREE(gen);
+	BCH_FREE(root);
+	return (deg);
+}
+
+/*
+ * Creates a codec for blocks of len bytes, a multiple of 4, over
+ * GF(2^m) correcting t errors. Returns NULL if the code is too long.
+ */
+struct nand_bch *
+nand_bch_init(int m, int t, size_t len)
+{
+	struct nand_bch *nb;
+	uint8_t *ff;
+	uint32_t v;
+	int i, p;
+
+	if (m < BCH_MIN_M || m > BCH_MAX_M || t < 1 || len % 4 != 0 ||
+	    len * NBBY + m * t > (1U << m) - 1)
+		return (NULL);
+
+	nb = BCH_ALLOC(sizeof(*nb));
+	nb->nb_m = m;
+	nb->nb_t = t;
+	nb->nb_n = (1 << m) - 1;
+	nb->nb_len = len;
+	nb->nb_words = howmany(m * t, 32);
+
+	nb->nb_alog = BCH_ALLOC((nb->nb_n + 1) * sizeof(uint16_t));
+	nb->nb_log = BCH_ALLOC((nb->nb_n + 1) * sizeof(uint16_t));
+	for (i = 0, v = 1; i < nb->nb_n; i++) {
+		nb->nb_alog[i] = v;
+		nb->nb_log[v] = i;
+		v <<= 1;
+		if (v & (1 << m))
+			v ^= nand_bch_prim[m - BCH_MIN_M];
+	}
+
+	nb->nb_gen = BCH_ALLOC(nb->nb_words * sizeof(uint32_t));
+	nb->nb_deg = nand_bch_genpoly(nb);
+	nb->nb_bytes = howmany(nb->nb_deg, NBBY);
+
+	nb->nb_rem = BCH_ALLOC(nb->nb_words * sizeof(uint32_t));
+	nb->nb_tab = BCH_ALLOC(4 * 256 * nb->nb_words * sizeof(uint32_t));
+	for (p = 0; p < 4; p++) {
+		for (v = 0; v < 256; v++) {
+			nand_bch_encode_slow(nb, v << (8 * (3 - p)),
+			    &nb->nb_tab[(p * 256 + v) * nb->nb_words]);
+		}
+	}
+
+	nb->nb_syn = BCH_ALLOC((2 * t + 1) * sizeof(int));
+	nb->nb_lambda = BCH_ALLOC((2 * t + 1) * sizeof(int));
+	nb->nb_prev = BCH_ALLOC((2 * t + 1) * sizeof(int));
+	nb->nb_tmp = BCH_ALLOC((2 * t + 1) * sizeof(int));
+
+	/* Make the parity of an erased block all ones */
+	nb->nb_mask = BCH_ALLOC(nb->nb_bytes);
+	ff = BCH_ALLOC(len + nb->nb_bytes);
+	memset(ff, 0xFF, len);
+	nand_bch_encode(nb, ff, &ff[len]);
+	for (i = 0; i < nb->nb_bytes; i++)
+		nb->nb_mask[i] = ~ff[len + i];
+	BCH_FREE(ff);
+
+	return (nb);
+}
+
+void
+nand_bch_free(struct nand_bch *nb)
+{
+
+	if (nb == NULL)
+		return;
+	BCH_FREE(nb->nb_mask);
+	BCH_FREE(nb->nb_tmp);
+	BCH_FREE(nb->nb_prev);
+	BCH_FREE(nb->nb_lambda);
+	BCH_FREE(nb->nb_syn);
+	BCH_FREE(nb->nb_tab);
+	BCH_FREE(nb->nb_rem);
+	BCH_FREE(nb->nb_gen);
+	BCH_FREE(nb->nb_log);
+	BCH_FREE(nb->nb_alog);
+	BCH_FREE(nb);
+}
+
+size_t
+nand_bch_ecc_bytes(struct nand_bch *nb)
+{
+
+	return (nb->nb_bytes);
+}
+
+/*
+ * Calculates the parity of a block. Each word of data is added to the
+ * top of the remainder which is then shifted up a word, the part moved
+ * past x^deg being reduced with one table lookup for each byte.
+ */
+void
+nand_bch_encode(struct nand_bch *nb, const uint8_t *data, uint8_t *ecc)
+{
+	const uint32_t *t0, *t1, *t2, *t3;
+	uint32_t *rem;
+	uint32_t w;
+	int i, pos, words;
+
+	rem = nb->nb_rem;
+	words = nb->nb_words;
+	memset(rem, 0, words * sizeof(uint32_t));
+
+	for (pos = 0; pos < nb->nb_len; pos += 4) {
+		w = ((uint32_t)data[pos] << 24) | (data[pos + 1] << 16) |
+		    (data[pos + 2] << 8) | data[pos + 3];
+		w ^= rem[0];
+
+		t0 = &nb->nb_tab[(0 * 256 + (w >> 24)) * words];
+		t1 = &nb->nb_tab[(1 * 256 + ((w >> 16) & 0xFF)) * words];
+		t2 = &nb->nb_tab[(2 * 256 + ((w >> 8) & 0xFF)) * words];
+		t3 = &nb->nb_tab[(3 * 256 + (w & 0xFF)) * words];
+		for (i = 0; i < words - 1; i++)
+			rem[i] = rem[i + 1] ^ t0[i] ^ t1[i] ^ t2[i] ^ t3[i];
+		rem[i] = t0[i] ^ t1[i] ^ t2[i] ^ t3[i];
+	}
+
+	for (i = 0; i < nb->nb_bytes; i++)
+		ecc[i] = (rem[i / 4] >> (24 - 8 * (i % 4))) & 0xFF;
+	/* Before the mask is made it is all zeros */
+	for (i = 0; i < nb->nb_bytes; i++)
+		ecc[i] ^= nb->nb_mask[i];
+}
+
+/*
+ * Finds the error locator from the syndromes with Berlekamp-Massey.
+ * Returns its degree, the number of errors.
+ */
+static int
+nand_bch_locator(struct nand_bch *nb)
+{
+	int *lambda, *prev, *tmp, *syn;
+	int b, d, i, l, r, shift, size;
+
+	syn = nb->nb_syn;
+	lambda = nb->nb_lambda;
+	prev = nb->nb_prev;
+	tmp = nb->nb_tmp;
+	size = (2 * nb->nb_t + 1) * sizeof(int);
+	memset(lambda, 0, size);
+	memset(prev, 0, size);
+	lambda[0] = prev[0] = 1;
+	l = 0;
+	shift = 1;
+	b = 1;
+
+	for (r = 0; r < 2 * nb->nb_t; r++) {
+		/* The discrepancy */
+		d = syn[r + 1];
+		for (i = 1; i <= l; i++)
+			d ^= nand_bch_mul(nb, lambda[i], syn[r + 1 - i]);
+		if (d == 0) {
+			shift++;
+			continue;
+		}
+
+		/* lambda(x) -= d / b * x^shift * prev(x) */
+		memcpy(tmp, lambda, size);
+		for (i = 0; i + shift <= 2 * nb->nb_t; i++)
+			lambda[i + shift] ^= nand_bch_mul(nb,
+			    nand_bch_div(nb, d, b), prev[i]);
+		if (2 * l <= r) {
+			l = r + 1 - l;
+			memcpy(prev, tmp, size);
+			b = d;
+			shift = 1;
+		} else
+			shift++;
+	}
+
+	return (l);
+}
+
+/*
+ * Corrects up to t errors in a block. The parity read with the block
+ * and the parity calculated from it by nand_bch_encode are both needed.
+ * Returns the number of errors corrected or -1 if there are too many.
+ */
+int
+nand_bch_decode(struct nand_bch *nb, uint8_t *data, const uint8_t *calc,
+    const uint8_t *read)
+{
+	uint32_t *diff;
+	uint8_t last;
+	int bit, errs, found, i, j, k, n, pos, sum;
+	int *exp;
+
+	n = nb->nb_n;
+	diff = nb->nb_rem;
+	memset(diff, 0, nb->nb_words * sizeof(uint32_t));
+	last = 0;
+	for (i = 0; i < nb->nb_bytes; i++) {
+		diff[i / 4] |= (uint32_t)(calc[i] ^ read[i]) <<
+		    (24 - 8 * (i % 4));
+		last |= calc[i] ^ read[i];
+	}
+	/* Ignore the bits past the end of the parity */
+	if (nb->nb_deg % 32 != 0)
+		diff[nb->nb_deg / 32] &= ~0U << (32 - nb->nb_deg % 32);
+	if (last == 0)
+		return (0);
+
+	/*
+	 * The syndromes are the difference evaluated at alpha^i. Those
+	 * for even i are the squares of earlier ones.
+	 */
+	for (i = 1; i <= 2 * nb->nb_t; i += 2) {
+		sum = 0;
+		for (j = 0; j < nb->nb_deg; j++)
+			if (diff[j / 32] & (1U << (31 - j % 32)))
+				sum ^= nb->nb_alog[((nb->nb_deg - 1 - j) * i) %
+				    n];
+		nb->nb_syn[i] = sum;
+	}
+	for (i = 2; i <= 2 * nb->nb_t; i += 2)
+		nb->nb_syn[i] = nand_bch_mul(nb, nb->nb_syn[i / 2],
+		    nb->nb_syn[i / 2]);
+	for (i = 1; i <= 2 * nb->nb_t; i++)
+		if (nb->nb_syn[i] != 0)
+			break;
+	/* Only bits past the end of the parity differ */
+	if (i > 2 * nb->nb_t)
+		return (0);
+
+	errs = nand_bch_locator(nb);
+	if (errs > nb->nb_t)
+		return (-1);
+
+	/*
+	 * Chien search. An error at x^pos makes alpha^-pos a root of the
+	 * locator. exp[k] holds the log of lambda[k] * alpha^(-pos * k).
+	 * The data is only changed once every root has been found.
+	 */
+	exp = nb->nb_tmp;
+	for (k = 1; k <= errs; k++)
+		exp[k] = nb->nb_lambda[k] ? nb->nb_log[nb->nb_lambda[k]] : -1;
+	found = 0;
+	for (pos = 0; pos < nb->nb_len * NBBY + nb->nb_deg && found < errs;
+	    pos++) {
+		sum = 1;
+		for (k = 1; k <= errs; k++) {
+			if (exp[k] < 0)
+				continue;
+			sum ^= nb->nb_alog[exp[k]];
+			exp[k] -= k;
+			if (exp[k] < 0)
+				exp[k] += n;
+		}
+		if (sum != 0)
+			continue;
+
+		nb->nb_prev[found++] = pos;
+	}
+	if (found != errs)
+		return (-1);
+
+	for (i = 0; i < found; i++) {
+		/* Errors in the parity need no correction */
+		if (nb->nb_prev[i] < nb->nb_deg)
+			continue;
+		bit = nb->nb_len * NBBY - 1 - (nb->nb_prev[i] - nb->nb_deg);
+		data[bit / NBBY] ^= 0x80 >> (bit % NBBY);
+	}
+
+	return (errs);
+}
@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2009 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Software ECC for controllers without an ECC engine, or with one too
+ * weak for the part. Either a Hamming code or, for parts needing more
+ * than one bit corrected, the BCH code in nand_bch.c is used.
+ *
+ * The Hamming code corrects one bit and detects two bits of
+ * error in up to 512 bytes. The 3 byte code has the same layout as the
+ * code generated by the S3C2410 NAND controller so one decoder is used
+ * for both:
+ *	byte 0	LP07 LP06 LP05 LP04 LP03 LP02 LP01 LP00
+ *	byte 1	LP15 LP14 LP13 LP12 LP11 LP10 LP09 LP08
+ *	byte 2	CP5  CP4  CP3  CP2  CP1  CP0  LP17 LP16
+ * LP(2k + 1) is the parity of the bytes with bit k of their offset set
+ * and LP(2k) of those with it clear. The column parities are the same
+ * for the bits within each byte. The code is stored inverted so an
+ * erased page has a valid code.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/bio.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mutex.h>
+#include <sys/sx.h>
+
+#include "nandreg.h"
+#include "nandvar.h"
+#include "nand_bch.h"
+
+MALLOC_DECLARE(M_NAND);
+
+/*
+ * Column parities CP0 to CP5 of each byte value in bits 0 to 5
+ * and the parity of the whole byte in bit 6
+ */
+static const uint8_t nand_ecc_parity[256] = {
+	0x00, 0x55, 0x56, 0x03, 0x59, 0x0c, 0x0f, 0x5a,
+	0x5a, 0x0f, 0x0c, 0x59, 0x03, 0x56, 0x55, 0x00,
+	0x65, 0x30, 0x33, 0x66, 0x3c, 0x69, 0x6a, 0x3f,
+	0x3f, 0x6a, 0x69, 0x3c, 0x66, 0x33, 0x30, 0x65,
+	0x66, 0x33, 0x30, 0x65, 0x3f, 0x6a, 0x69, 0x3c,
+	0x3c, 0x69, 0x6a, 0x3f, 0x65, 0x30, 0x33, 0x66,
+	0x03, 0x56, 0x55, 0x00, 0x5a, 0x0f, 0x0c, 0x59,
+	0x59, 0x0c, 0x0f, 0x5a, 0x00, 0x55, 0x56, 0x03,
+	0x69, 0x3c, 0x3f, 0x6a, 0x30, 0x65, 0x66, 0x33,
+	0x33, 0x66, 0x65, 0x30, 0x6a, 0x3f, 0x3c, 0x69,
+	0x0c, 0x59, 0x5a, 0x0f, 0x55, 0x00, 0x03, 0x56,
+	0x56, 0x03, 0x00, 0x55, 0x0f, 0x5a, 0x59, 0x0c,
+	0x0f, 0x5a, 0x59, 0x0c, 0x56, 0x03, 0x00, 0x55,
+	0x55, 0x00, 0x03, 0x56, 0x0c, 0x59, 0x5a, 0x0f,
+	0x6a, 0x3f, 0x3c, 0x69, 0x33, 0x66, 0x65, 0x30,
+	0x30, 0x65, 0x66, 0x33, 0x69, 0x3c, 0x3f, 0x6a,
+	0x6a, 0x3f, 0x3c, 0x69, 0x33, 0x66, 0x65, 0x30,
+	0x30, 0x65, 0x66, 0x33, 0x69, 0x3c, 0x3f, 0x6a,
+	0x0f, 0x5a, 0x59, 0x0c, 0x56, 0x03, 0x00, 0x55,
+	0x55, 0x00, 0x03, 0x56, 0x0c, 0x59, 0x5a, 0x0f,
+	0x0c, 0x59, 0x5a, 0x0f, 0x55, 0x00, 0x03, 0x56,
+	0x56, 0x03, 0x00, 0x55, 0x0f, 0x5a, 0x59, 0x0c,
+	0x69, 0x3c, 0x3f, 0x6a, 0x30, 0x65, 0x66, 0x33,
+	0x33, 0x66, 0x65, 0x30, 0x6a, 0x3f, 0x3c, 0x69,
+	0x03, 0x56, 0x55, 0x00, 0x5a, 0x0f, 0x0c, 0x59,
+	0x59, 0x0c, 0x0f, 0x5a, 0x00, 0x55, 0x56, 0x03,
+	0x66, 0x33, 0x30, 0x65, 0x3f, 0x6a, 0x69, 0x3c,
+	0x3c, 0x69, 0x6a, 0x3f, 0x65, 0x30, 0x33, 0x66,
+	0x65, 0x30, 0x33, 0x66, 0x3c, 0x69, 0x6a, 0x3f,
+	0x3f, 0x6a, 0x69, 0x3c, 0x66, 0x33, 0x30, 0x65,
+	0x00, 0x55, 0x56, 0x03, 0x59, 0x0c, 0x0f, 0x5a,
+	0x5a, 0x0f, 0x0c, 0x59, 0x03, 0x56, 0x55, 0x00,
+};
+
+/* Every pair of bits in the difference is 01 or 10 */
+#define	NAND_ECC_PAIRS	0x555555
+
+/* BCH codes over GF(2^13) protecting 512 bytes each */
+#define	NAND_BCH_M		13
+#define	NAND_BCH_PROTECT	512
+
+/* Hamming layouts for parts attached to controllers without ECC */
+static struct nand_ecc_data nand_ecc_small = {
+	.ecc_size = 3,
+	.ecc_stride = 3,
+	.ecc_protect = 512,
+	.ecc_pos = { 0, 1, 2 },
+};
+
+static struct nand_ecc_data nand_ecc_large = {
+	.ecc_size = 12,
+	.ecc_stride = 3,
+	.ecc_protect = 512,
+	.ecc_pos = { 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51 },
+};
+
+/*
+ * Builds a layout for a BCH code correcting strength bits in each 512
+ * bytes. The code is put at the end of the spare area.
+ */
+static struct nand_ecc_data *
+nand_ecc_bch_layout(nand_device_t ndev, int strength)
+{
+	struct nand_ecc_data *ecc;
+	struct nand_bch *nb;
+	size_t size;
+	int marker, pos, i;
+
+	if (ndev->ndev_page_size % NAND_BCH_PROTECT != 0)
+		return (NULL);
+	nb = nand_bch_init(NAND_BCH_M, strength, NAND_BCH_PROTECT);
+	if (nb == NULL)
+		return (NULL);
+
+	marker = NAND_BBM_SMALL_OFFSET;
+	if (ndev->ndev_page_size > 512)
+		marker = NAND_BBM_LARGE_OFFSET;
+
+	size = nand_bch_ecc_bytes(nb) *
+	    (ndev->ndev_page_size / NAND_BCH_PROTECT);
+	ecc = malloc(sizeof(*ecc) + size * sizeof(ecc->ecc_pos[0]), M_NAND,
+	    M_WAITOK | M_ZERO);
+	ecc->ecc_size = size;
+	ecc->ecc_stride = nand_bch_ecc_bytes(nb);
+	ecc->ecc_protect = NAND_BCH_PROTECT;
+	ecc->ecc_strength = strength;
+	ecc->ecc_priv = nb;
+
+	/* Skip the marker, the byte after it and the FTL tag */
+	i = size;
+	for (pos = ndev->ndev_spare_size - 1; pos >= 0 && i > 0; pos--) {
+		if (pos == marker || pos == marker + 1 ||
+		    (pos >= NAND_TAG_OFFSET &&
+		    pos < NAND_TAG_OFFSET + NAND_TAG_SIZE))
+			continue;
+		ecc->ecc_pos[--i] = pos;
+	}
+	if (i > 0) {
+		nand_ecc_layout_free(ecc);
+		return (NULL);
+	}
+
+	return (ecc);
+}
+
+/*
+ * Returns the layout to use with the software ECC correcting strength
+ * bits in each 512 bytes, or NULL if it doesn't fit in the part's spare
+ * area. A strength of 1 uses the Hamming code. Each layout keeps clear
+ * of the bad block marker and the FTL tag.
+ */
+struct nand_ecc_data *
+nand_ecc_layout(nand_device_t ndev, int strength)
+{
+
+	if (strength > 1)
+		return (nand_ecc_bch_layout(ndev, strength));
+	if (ndev->ndev_page_size == 512 && ndev->ndev_spare_size >= 16)
+		return (&nand_ecc_small);
+	if (ndev->ndev_page_size == 2048 && ndev->ndev_spare_size >= 64)
+		return (&nand_ecc_large);
+	return (NULL);
+}
+
+void
+nand_ecc_layout_free(struct nand_ecc_data *ecc)
+{
+
+	if (ecc == NULL || ecc->ecc_strength <= 1)
+		return;
+	nand_bch_free(ecc->ecc_priv);
+	free(ecc, M_NAND);
+}
+
+/*
+ * Calculates the code for len bytes of data. Only one table lookup is
+ * needed for each byte. The offsets of the bytes with odd parity are
+ * xored together giving the odd line parities. The even line parities
+ * are these xored with the parity of all the data.
+ */
+static void
+nand_ecc_hamming_calc(const uint8_t *data, size_t len, uint8_t *ecc)
+{
+	uint32_t code, cp, lp_even, lp_odd;
+	size_t i;
+	int k;
+
+	KASSERT(len <= 512, ("nand_ecc_hamming_calc: Too much data"));
+
+	cp = 0;
+	lp_odd = 0;
+	for (i = 0; i < len; i++) {
+		cp ^= nand_ecc_parity[data[i]];
+		lp_odd ^= i & -(uint32_t)((nand_ecc_parity[data[i]] >> 6) & 1);
+	}
+	lp_even = lp_odd ^ (((cp >> 6) & 1) ? 0x1FF : 0);
+
+	code = (cp & 0x3F) << 18;
+	for (k = 0; k < 9; k++)
+		code |= (((lp_even >> k) & 1) << (2 * k)) |
+		    (((lp_odd >> k) & 1) << (2 * k + 1));
+	code = ~code;
+
+	ecc[0] = code & 0xFF;
+	ecc[1] = (code >> 8) & 0xFF;
+	ecc[2] = (code >> 16) & 0xFF;
+}
+
+/*
+ * Checks len bytes of data against the code read with it. A single bit
+ * error in the data flips one bit of every pair of parities and the odd
+ * ones give its location. A single bit error in the code flips only one
+ * bit. Anything else is more than we can correct. An erased page has a
+ * valid code so a bit flipped in one is corrected the same way.
+ */
+static int
+nand_ecc_hamming_fix(nand_device_t ndev, size_t len, uint8_t *data,
+    uint8_t *calc_ecc, uint8_t *read_ecc)
+{
+	uint32_t diff, bit, byte;
+	int k;
+
+	diff = (calc_ecc[0] ^ read_ecc[0]) |
+	    ((calc_ecc[1] ^ read_ecc[1]) << 8) |
+	    ((calc_ecc[2] ^ read_ecc[2]) << 16);
+
+	/* The two ECC's are the same so are correct */
+	if (diff == 0)
+		return (0);
+
+	if (((diff ^ (diff >> 1)) & NAND_ECC_PAIRS) == NAND_ECC_PAIRS) {
+		byte = 0;
+		for (k = 0; k < 9; k++)
+			byte |= ((diff >> (2 * k + 1)) & 1) << k;
+		bit = ((diff >> 19) & 1) | ((diff >> 20) & 2) |
+		    ((diff >> 21) & 4);
+		if (byte < len) {
+			data[byte] ^= 1 << bit;
+			ndev->ndev_stats.ns_ecc_corrected++;
+			return (0);
+		}
+	} else if (bitcount32(diff) == 1) {
+		ndev->ndev_stats.ns_ecc_corrected++;
+		return (0);
+	}
+
+	/* There may be no ECC, ignore this case */
+	if (read_ecc[0] == 0xFF && read_ecc[1] == 0xFF && read_ecc[2] == 0xFF)
+		return (0);
+
+	ndev->ndev_stats.ns_ecc_failed++;
+	device_printf(ndev->ndev_dev, "Bad ECC: %X %X %X != %X %X %X\n",
+	    calc_ecc[0], calc_ecc[1], calc_ecc[2],
+	    read_ecc[0], read_ecc[1], read_ecc[2]);
+	return (EIO);
+}
+
+/*
+ * Calculates the ECC of the len bytes of data in one ECC block
+ */
+void
+nand_ecc_calc(nand_device_t ndev, const uint8_t *data, size_t len,
+    uint8_t *ecc)
+{
+
+	if (ndev->ndev_ecc->ecc_strength > 1) {
+		KASSERT(len == NAND_BCH_PROTECT,
+		    ("nand_ecc_calc: Partial BCH block"));
+		nand_bch_encode(ndev->ndev_ecc->ecc_priv, data, ecc);
+	} else
+		nand_ecc_hamming_calc(data, len, ecc);
+}
+
+/*
+ * Corrects the data in an ECC block. Used as ndri_fix_data.
+ */
+int
+nand_ecc_fix(nand_device_t ndev, size_t len, uint8_t *data,
+    uint8_t *calc_ecc, uint8_t *read_ecc)
+{
+	int errs;
+
+	if (ndev->ndev_ecc->ecc_strength <= 1)
+		return (nand_ecc_hamming_fix(ndev, len, data, calc_ecc,
+		    read_ecc));
+
+	errs = nand_bch_decode(ndev->ndev_ecc->ecc_priv, data, calc_ecc,
+	    read_ecc);
+	if (errs < 0) {
+		ndev->ndev_stats.ns_ecc_failed++;
+		device_printf(ndev->ndev_dev,
+		    "Too many bit errors to correct\n");
+		return (EIO);
+	}
+	ndev->ndev_stats.ns_ecc_corrected += errs;
+
+	return (0);
+}
@@ -0,0 +1,921 @@
+/*
+ * Copyright (C) 2009 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * A page mapped flash translation layer. Logical pages are never
+ * rewritten in place, each write goes to the next free page of the
+ * open block and the old copy is left to be reclaimed by garbage
+ * collection. The logical page and the sequence number of its block
+ * are kept in the spare area so the map can be rebuilt at attach.
+ * The tag of the first page of a block holds the sequence number of
+ * the block and those of the pages after it its erase count, so every
+ * page holds data. A block erased but not yet written to has no count
+ * on the chip and is given the average at attach.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/bio.h>
+#include <sys/endian.h>
+#include <sys/kernel.h>
+#include <sys/kthread.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mutex.h>
+#include <sys/proc.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+
+#include <geom/geom.h>
+#include <geom/geom_disk.h>
+
+#include "nandreg.h"
+#include "nandvar.h"
+
+MALLOC_DECLARE(M_NANDFTL);
+MALLOC_DEFINE(M_NANDFTL, "NAND FTL", "Memory for the NAND FTL");
+
+/* An unmapped page or the logical page in an erased tag */
+#define	NAND_FTL_NONE		0xFFFFFFFF
+
+/* The percentage of blocks hidden from the user and the least to hide */
+#define	NAND_FTL_SPARE		5
+#define	NAND_FTL_MIN_SPARE	4
+
+/* Free blocks only garbage collection may write to */
+#define	NAND_FTL_GC_RESERVE	1
+
+/* How many blocks to try when a program fails */
+#define	NAND_FTL_RETRIES	3
+
+/* Pages the collector thread moves each time it takes the chip */
+#define	NAND_FTL_GC_BATCH	4
+
+/* Default spread of erase counts that starts static wear leveling */
+#define	NAND_FTL_WL_THRESHOLD	64
+
+/* Rows in the erase count histogram */
+#define	NAND_FTL_WEAR_BUCKETS	16
+
+/* Garbage collection policies */
+#define	NAND_FTL_GC_GREEDY	0	/* Fewest valid pages */
+#define	NAND_FTL_GC_COST_BENEFIT 1	/* Weighs free space by age */
+
+struct nand_ftl_block {
+	uint32_t	nfb_seq;	/* When the block was opened */
+	uint32_t	nfb_valid;	/* Pages still mapped */
+	uint32_t	nfb_erases;	/* Times the block has been erased */
+	int		nfb_state;
+#define	NAND_FTL_FREE	0	/* Unused, erased before it is opened */
+#define	NAND_FTL_ERASED	1	/* Unused and already erased */
+#define	NAND_FTL_OPEN	2	/* Being written to */
+#define	NAND_FTL_FULL	3
+#define	NAND_FTL_BAD	4	/* In the bad block table or failed to erase */
+};
+
+/*
+ * Except for nf_mtx and the fields it protects everything is
+ * protected by ndev_chip_lock as it is used along with the chip.
+ */
+struct nand_ftl {
+	nand_device_t	nf_ndev;
+
+	uint32_t	*nf_l2p;	/* Logical to physical page */
+	uint32_t	*nf_p2l;	/* Physical to logical page */
+	struct nand_ftl_block *nf_blocks;
+
+	uint32_t	nf_block_cnt;
+	uint32_t	nf_ppb;		/* Pages per block */
+	uint32_t	nf_lpn_cnt;	/* Logical pages */
+	int		nf_free;	/* Free or erased blocks */
+	uint32_t	nf_seq;		/* The last sequence number used */
+	int		nf_open;	/* The open block or -1 */
+	uint32_t	nf_next;	/* The next page to write in nf_open */
+	int		nf_hint;	/* Where to look for a free block */
+
+	int		nf_victim;	/* The block being collected or -1 */
+	uint32_t	nf_victim_page;	/* The next page to look at in it */
+	int		nf_gc_policy;
+	int		nf_gc_low;	/* Collect even when busy below this */
+	int		nf_gc_high;	/* Collect when idle below this */
+
+	uint32_t	nf_max_erases;	/* The most worn block */
+	int		nf_wl_block;	/* Cold block to collect next or -1 */
+	int		nf_wl_threshold; /* Erase count spread to allow */
+
+	/* The collector thread */
+	struct mtx	nf_mtx;
+	struct proc	*nf_gc_proc;
+	int		nf_flags;	/* Protected by nf_mtx */
+#define	NAND_FTL_DYING	0x0001	/* The collector should exit */
+
+	uint8_t		*nf_buf;	/* Used to copy pages */
+	uint8_t		nf_tag[NAND_TAG_SIZE];
+
+	u_long		nf_writes;	/* Pages written to the disk */
+	u_long		nf_copies;	/* Pages moved by garbage collection */
+	u_long		nf_reclaimed;	/* Blocks freed by garbage collection */
+	u_long		nf_stalls;	/* Writes that had to collect first */
+	u_long		nf_wl_moves;	/* Blocks collected to level wear */
+};
+
+static int nand_ftl_gc_step(struct nand_ftl *, int);
+
+static inline void
+nand_ftl_tag_enc(uint8_t *tag, uint32_t lpn, uint32_t aux)
+{
+
+	le32enc(&tag[0], lpn);
+	le32enc(&tag[4], aux);
+}
+
+static inline void
+nand_ftl_tag_dec(const uint8_t *tag, uint32_t *lpn, uint32_t *aux)
+{
+
+	*lpn = le32dec(&tag[0]);
+	*aux = le32dec(&tag[4]);
+}
+
+/*
+ * Drops the mapping of a logical page
+ */
+static void
+nand_ftl_unmap(struct nand_ftl *nf, uint32_t lpn)
+{
+	uint32_t ppn;
+
+	ppn = nf->nf_l2p[lpn];
+	if (ppn == NAND_FTL_NONE)
+		return;
+
+	nf->nf_blocks[ppn / nf->nf_ppb].nfb_valid--;
+	nf->nf_p2l[ppn] = NAND_FTL_NONE;
+	nf->nf_l2p[lpn] = NAND_FTL_NONE;
+}
+
+static void
+nand_ftl_map(struct nand_ftl *nf, uint32_t lpn, uint32_t ppn)
+{
+
+	nand_ftl_unmap(nf, lpn);
+	nf->nf_l2p[lpn] = ppn;
+	nf->nf_p2l[ppn] = lpn;
+	nf->nf_blocks[ppn / nf->nf_ppb].nfb_valid++;
+}
+
+/*
+ * Finds the least worn free block, preferring one already erased.
+ * Starting from nf_hint spreads the erases between equally worn blocks.
+ */
+static int
+nand_ftl_find_free(struct nand_ftl *nf)
+{
+	struct nand_ftl_block *nfb, *best;
+	int blk, free, i;
+
+	free = -1;
+	best = NULL;
+	for (i = 0; i < nf->nf_block_cnt; i++) {
+		blk = (nf->nf_hint + i) % nf->nf_block_cnt;
+		nfb = &nf->nf_blocks[blk];
+		if (nfb->nfb_state != NAND_FTL_ERASED &&
+		    nfb->nfb_state != NAND_FTL_FREE)
+			continue;
+		if (best == NULL || nfb->nfb_erases < best->nfb_erases ||
+		    (nfb->nfb_erases == best->nfb_erases &&
+		    nfb->nfb_state == NAND_FTL_ERASED &&
+		    best->nfb_state != NAND_FTL_ERASED)) {
+			best = nfb;
+			free = blk;
+		}
+	}
+
+	return (free);
+}
+
+/*
+ * Static wear leveling. Blocks holding data that is never rewritten
+ * are not erased so once a full block is nf_wl_threshold erases behind
+ * the most worn block it is collected to put it back into use.
+ */
+static void
+nand_ftl_wear_check(struct nand_ftl *nf)
+{
+	struct nand_ftl_block *nfb;
+	int blk, cold;
+
+	if (nf->nf_wl_block != -1 || nf->nf_wl_threshold <= 0)
+		return;
+
+	cold = -1;
+	for (blk = 0; blk < nf->nf_block_cnt; blk++) {
+		nfb = &nf->nf_blocks[blk];
+		if (nfb->nfb_state != NAND_FTL_FULL || blk == nf->nf_victim)
+			continue;
+		if (cold == -1 ||
+		    nfb->nfb_erases < nf->nf_blocks[cold].nfb_erases)
+			cold = blk;
+	}
+
+	if (cold != -1 && nf->nf_max_erases -
+	    nf->nf_blocks[cold].nfb_erases > nf->nf_wl_threshold)
+		nf->nf_wl_block = cold;
+}
+
+/*
+ * Erases a block and counts the erase
+ */
+static int
+nand_ftl_erase(struct nand_ftl *nf, int blk)
+{
+	struct nand_ftl_block *nfb;
+	int err;
+
+	nfb = &nf->nf_blocks[blk];
+	err = nand_block_erase(nf->nf_ndev, blk);
+	if (err != 0) {
+		device_printf(nf->nf_ndev->ndev_dev,
+		    "FTL: Failed to erase block %d\n", blk);
+		nfb->nfb_state = NAND_FTL_BAD;
+		return (err);
+	}
+
+	nfb->nfb_erases++;
+	nf->nf_max_erases = MAX(nf->nf_max_erases, nfb->nfb_erases);
+	nand_ftl_wear_check(nf);
+
+	return (0);
+}
+
+/*
+ * Makes a free block the open block, erasing it if needed. Unless
+ * called from garbage collection enough blocks are reclaimed first
+ * to leave NAND_FTL_GC_RESERVE free for garbage collection to use.
+ */
+static int
+nand_ftl_alloc_block(struct nand_ftl *nf, int gc)
+{
+	struct nand_ftl_block *nfb;
+	int blk, err;
+
+	while (!gc && nf->nf_free <= NAND_FTL_GC_RESERVE) {
+		/* The collector thread has fallen behind */
+		nf->nf_stalls++;
+		err = nand_ftl_gc_step(nf, nf->nf_ppb);
+		if (err != 0)
+			return (err);
+		/* Garbage collection may have left a block open */
+		if (nf->nf_open != -1)
+			return (0);
+	}
+
+	for (;;) {
+		if (nf->nf_free == 0)
+			return (ENOSPC);
+
+		blk = nand_ftl_find_free(nf);
+		KASSERT(blk != -1, ("nand_ftl_alloc_block: No free block"));
+		nf->nf_hint = (blk + 1) % nf->nf_block_cnt;
+
+		nfb = &nf->nf_blocks[blk];
+		nf->nf_free--;
+		if (nfb->nfb_state == NAND_FTL_ERASED ||
+		    nand_ftl_erase(nf, blk) == 0)
+			break;
+	}
+
+	nfb->nfb_state = NAND_FTL_OPEN;
+	nfb->nfb_seq = ++nf->nf_seq;
+	nfb->nfb_valid = 0;
+	nf->nf_open = blk;
+	nf->nf_next = 0;
+
+	return (0);
+}
+
+/*
+ * Writes a logical page to the next free page and remaps it
+ */
+static int
+nand_ftl_write(struct nand_ftl *nf, uint32_t lpn, uint8_t *data, int gc)
+{
+	struct nand_ftl_block *nfb;
+	uint32_t aux, ppn;
+	int err, tries;
+
+	/*
+	 * The collector has opened a block with the reserve, the pages
+	 * left in the victim have to be moved before it is filled.
+	 */
+	while (!gc && nf->nf_free < NAND_FTL_GC_RESERVE &&
+	    nf->nf_victim != -1) {
+		nf->nf_stalls++;
+		err = nand_ftl_gc_step(nf, nf->nf_ppb);
+		if (err != 0)
+			return (err);
+	}
+
+	for (tries = 0;; tries++) {
+		if (nf->nf_open == -1) {
+			err = nand_ftl_alloc_block(nf, gc);
+			if (err != 0)
+				return (err);
+		}
+
+		nfb = &nf->nf_blocks[nf->nf_open];
+		ppn = nf->nf_open * nf->nf_ppb + nf->nf_next;
+		/* The first page holds the sequence number */
+		if (nf->nf_next == 0)
+			aux = nfb->nfb_seq;
+		else
+			aux = nfb->nfb_erases;
+		nand_ftl_tag_enc(nf->nf_tag, lpn, aux);
+
+		err = nand_page_program(nf->nf_ndev, ppn, data, nf->nf_tag);
+
+		/* Close the block when it is full or on error */
+		if (++nf->nf_next == nf->nf_ppb || err != 0) {
+			nfb->nfb_state = NAND_FTL_FULL;
+			nf->nf_open = -1;
+		}
+		if (err == 0)
+			break;
+		if (tries == NAND_FTL_RETRIES)
+			return (err);
+	}
+
+	nand_ftl_map(nf, lpn, ppn);
+
+	return (0);
+}
+
+/*
+ * Picks the next block to collect using the current policy
+ */
+static int
+nand_ftl_gc_victim(struct nand_ftl *nf)
+{
+	struct nand_ftl_block *nfb;
+	uint64_t best, score;
+	uint32_t age;
+	int blk, victim;
+
+	victim = -1;
+	best = 0;
+	for (blk = 0; blk < nf->nf_block_cnt; blk++) {
+		nfb = &nf->nf_blocks[blk];
+		if (nfb->nfb_state != NAND_FTL_FULL ||
+		    nfb->nfb_valid == nf->nf_ppb)
+			continue;
+
+		switch (nf->nf_gc_policy) {
+		case NAND_FTL_GC_COST_BENEFIT:
+			/*
+			 * (1 - u) * age / (1 + u) where u is the fraction
+			 * of the block that is valid and the age is how
+			 * many blocks have been opened since this one.
+			 * Old blocks are left alone by new writes so are
+			 * worth collecting with more valid pages.
+			 */
+			age = nf->nf_seq - nfb->nfb_seq + 1;
+			score = (uint64_t)(nf->nf_ppb - nfb->nfb_valid) * age *
+			    1024 / (nf->nf_ppb + nfb->nfb_valid);
+			break;
+		default:
+			score = nf->nf_ppb - nfb->nfb_valid;
+			break;
+		}
+
+		if (victim == -1 || score > best) {
+			victim = blk;
+			best = score;
+		}
+	}
+
+	return (victim);
+}
+
+/*
+ * Moves up to max valid pages from the block being collected to the
+ * open block, picking a new victim if there isn't one. Once the victim
+ * holds no valid pages it is erased so it can be allocated quickly.
+ * Returns ENOSPC when there is nothing to collect.
+ */
+static int
+nand_ftl_gc_step(struct nand_ftl *nf, int max)
+{
+	struct nand_ftl_block *nfb;
+	uint32_t lpn, ppn;
+	int blk, err, moved;
+
+	if (nf->nf_victim == -1) {
+		/* Only level wear when there are blocks to spare */
+		if (nf->nf_wl_block != -1 &&
+		    nf->nf_blocks[nf->nf_wl_block].nfb_state ==
+		    NAND_FTL_FULL && nf->nf_free > nf->nf_gc_low) {
+			nf->nf_victim = nf->nf_wl_block;
+			nf->nf_wl_moves++;
+		} else
+			nf->nf_victim = nand_ftl_gc_victim(nf);
+		nf->nf_wl_block = -1;
+		nf->nf_victim_page = 0;
+		if (nf->nf_victim == -1)
+			return (ENOSPC);
+	}
+
+	blk = nf->nf_victim;
+	nfb = &nf->nf_blocks[blk];
+	for (moved = 0; nfb->nfb_valid > 0 && moved < max;
+	    nf->nf_victim_page++) {
+		KASSERT(nf->nf_victim_page < nf->nf_ppb,
+		    ("nand_ftl_gc_step: Valid count is wrong"));
+		ppn = blk * nf->nf_ppb + nf->nf_victim_page;
+		lpn = nf->nf_p2l[ppn];
+		if (lpn == NAND_FTL_NONE)
+			continue;
+
+		err = nand_page_read(nf->nf_ndev, ppn, nf->nf_buf, NULL);
+		if (err != 0) {
+			/* The data is lost, don't stop collecting */
+			device_printf(nf->nf_ndev->ndev_dev,
+			    "FTL: Lost logical page %u\n", lpn);
+			nand_ftl_unmap(nf, lpn);
+			continue;
+		}
+		err = nand_ftl_write(nf, lpn, nf->nf_buf, 1);
+		if (err != 0)
+			return (err);
+		nf->nf_copies++;
+		moved++;
+	}
+	if (nfb->nfb_valid > 0)
+		return (0);
+
+	nf->nf_victim = -1;
+	if (nand_ftl_erase(nf, blk) != 0)
+		return (0);
+	nfb->nfb_state = NAND_FTL_ERASED;
+	nf->nf_free++;
+	nf->nf_reclaimed++;
+
+	return (0);
+}
+
+static int
+nand_ftl_busy(nand_device_t ndev)
+{
+	int busy;
+
+	mtx_lock(&ndev->ndev_mtx);
+	busy = (bioq_first(&ndev->ndev_bioq) != NULL);
+	mtx_unlock(&ndev->ndev_mtx);
+
+	return (busy);
+}
+
+/*
+ * The collector thread. It is woken when the free blocks drop below
+ * nf_gc_high and collects until they are back above it. While there
+ * are requests queued it only runs once there are fewer than nf_gc_low
+ * free blocks, otherwise it waits for the worker to catch up.
+ */
+static void
+nand_ftl_gc_thread(void *arg)
+{
+	nand_device_t ndev;
+	struct nand_ftl *nf;
+	int err;
+
+	nf = arg;
+	ndev = nf->nf_ndev;
+
+	mtx_lock(&nf->nf_mtx);
+	for (;;) {
+		while ((nf->nf_flags & NAND_FTL_DYING) == 0 &&
+		    nf->nf_free >= nf->nf_gc_high && nf->nf_victim == -1 &&
+		    nf->nf_wl_block == -1)
+			msleep(nf, &nf->nf_mtx, PRIBIO, "ftlgc", 0);
+		if ((nf->nf_flags & NAND_FTL_DYING) != 0)
+			break;
+		mtx_unlock(&nf->nf_mtx);
+
+		if (nf->nf_free >= nf->nf_gc_low && nand_ftl_busy(ndev)) {
+			pause("ftlbsy", MAX(hz / 100, 1));
+			mtx_lock(&nf->nf_mtx);
+			continue;
+		}
+
+		sx_xlock(&ndev->ndev_chip_lock);
+		err = nand_ftl_gc_step(nf, NAND_FTL_GC_BATCH);
+		nand_bbt_sync(ndev);
+		nand_wait_select(ndev, 0);
+		sx_xunlock(&ndev->ndev_chip_lock);
+
+		mtx_lock(&nf->nf_mtx);
+		/* Nothing to collect until more pages are overwritten */
+		if (err != 0 && (nf->nf_flags & NAND_FTL_DYING) == 0)
+			msleep(nf, &nf->nf_mtx, PRIBIO, "ftlgc", 0);
+	}
+
+	nf->nf_gc_proc = NULL;
+	wakeup(&nf->nf_gc_proc);
+	mtx_unlock(&nf->nf_mtx);
+
+	kproc_exit(0);
+}
+
+/*
+ * Reports how many blocks have been erased how many times, split into
+ * NAND_FTL_WEAR_BUCKETS ranges from zero to the most worn block.
+ */
+static int
+nand_ftl_sysctl_wear(SYSCTL_HANDLER_ARGS)
+{
+	u_int count[NAND_FTL_WEAR_BUCKETS];
+	struct nand_ftl *nf;
+	uint32_t width;
+	size_t len;
+	char *buf;
+	int blk, err, i;
+
+	nf = arg1;
+	memset(count, 0, sizeof(count));
+
+	sx_xlock(&nf->nf_ndev->ndev_chip_lock);
+	width = howmany(nf->nf_max_erases + 1, NAND_FTL_WEAR_BUCKETS);
+	for (blk = 0; blk < nf->nf_block_cnt; blk++)
+		if (nf->nf_blocks[blk].nfb_state != NAND_FTL_BAD)
+			count[nf->nf_blocks[blk].nfb_erases / width]++;
+	sx_xunlock(&nf->nf_ndev->ndev_chip_lock);
+
+	len = NAND_FTL_WEAR_BUCKETS * 32;
+	buf = malloc(len, M_NANDFTL, M_WAITOK);
+	buf[0] = '\0';
+	for (i = 0; i < NAND_FTL_WEAR_BUCKETS; i++)
+		snprintf(buf + strlen(buf), len - strlen(buf), "\n%u-%u: %u",
+		    i * width, (i + 1) * width - 1, count[i]);
+
+	err = sysctl_handle_string(oidp, buf, len, req);
+	free(buf, M_NANDFTL);
+
+	return (err);
+}
+
+static int
+nand_ftl_sysctl_wa(SYSCTL_HANDLER_ARGS)
+{
+	struct nand_ftl *nf;
+	u_int wa;
+
+	nf = arg1;
+	wa = 100;
+	if (nf->nf_writes > 0)
+		wa = (nf->nf_writes + nf->nf_copies) * 100 / nf->nf_writes;
+
+	return (sysctl_handle_int(oidp, &wa, 0, req));
+}
+
+/*
+ * Rebuilds the map from the tags. Blocks are written in order so the
+ * first page with an erased tag ends the block. When a logical page is
+ * found more than once the copy in the newest block wins, or the later
+ * page when both are in the same block. Partially written blocks are
+ * not written to again as the next page may be damaged. Blocks with
+ * no page after the first have no erase count and are given the
+ * average. Blocks in the bad block table are never read.
+ */
+static int
+nand_ftl_scan(struct nand_ftl *nf)
+{
+	struct nand_ftl_block *nfb, *old_nfb;
+	uint32_t aux, i, lpn, old, ppn;
+	uint64_t erases;
+	int blk, counted, err;
+
+	for (lpn = 0; lpn < nf->nf_lpn_cnt; lpn++)
+		nf->nf_l2p[lpn] = NAND_FTL_NONE;
+	for (ppn = 0; ppn < nf->nf_block_cnt * nf->nf_ppb; ppn++)
+		nf->nf_p2l[ppn] = NAND_FTL_NONE;
+
+	nf->nf_free = 0;
+	nf->nf_seq = 0;
+	for (blk = 0; blk < nf->nf_block_cnt; blk++) {
+		nfb = &nf->nf_blocks[blk];
+		nfb->nfb_seq = 0;
+		nfb->nfb_valid = 0;
+		nfb->nfb_erases = NAND_FTL_NONE;
+		if (nand_bbt_disk_bad(nf->nf_ndev, blk)) {
+			nfb->nfb_state = NAND_FTL_BAD;
+			continue;
+		}
+
+		for (i = 0; i < nf->nf_ppb; i++) {
+			ppn = blk * nf->nf_ppb + i;
+			err = nand_page_read(nf->nf_ndev, ppn, nf->nf_buf,
+			    nf->nf_tag);
+			if (err != 0) {
+				/* Skip the page, there may be more after it */
+				device_printf(nf->nf_ndev->ndev_dev,
+				    "FTL: Unable to read page %u\n", ppn);
+				continue;
+			}
+
+			nand_ftl_tag_dec(nf->nf_tag, &lpn, &aux);
+			if (lpn == NAND_FTL_NONE)
+				break;
+			if (i == 0)
+				nfb->nfb_seq = aux;
+			else
+				nfb->nfb_erases = aux;
+			if (lpn >= nf->nf_lpn_cnt)
+				continue;
+
+			old = nf->nf_l2p[lpn];
+			if (old != NAND_FTL_NONE) {
+				old_nfb = &nf->nf_blocks[old / nf->nf_ppb];
+				if (old_nfb->nfb_seq > nfb->nfb_seq ||
+				    (old_nfb != nfb &&
+				    old_nfb->nfb_seq == nfb->nfb_seq))
+					continue;
+			}
+			nand_ftl_map(nf, lpn, ppn);
+		}
+
+		if (i == 0) {
+			nfb->nfb_state = NAND_FTL_FREE;
+			nf->nf_free++;
+		} else
+			nfb->nfb_state = NAND_FTL_FULL;
+		nf->nf_seq = MAX(nf->nf_seq, nfb->nfb_seq);
+	}
+
+	erases = 0;
+	counted = 0;
+	for (blk = 0; blk < nf->nf_block_cnt; blk++) {
+		if (nf->nf_blocks[blk].nfb_erases != NAND_FTL_NONE) {
+			erases += nf->nf_blocks[blk].nfb_erases;
+			counted++;
+		}
+	}
+	if (counted > 0)
+		erases /= counted;
+	nf->nf_max_erases = 0;
+	for (blk = 0; blk < nf->nf_block_cnt; blk++) {
+		nfb = &nf->nf_blocks[blk];
+		if (nfb->nfb_erases == NAND_FTL_NONE)
+			nfb->nfb_erases = erases;
+		nf->nf_max_erases = MAX(nf->nf_max_erases, nfb->nfb_erases);
+	}
+
+	nf->nf_open = -1;
+	nf->nf_victim = -1;
+	nf->nf_wl_block = -1;
+
+	return (0);
+}
+
+static int
+nand_ftl_read(struct nand_ftl *nf, uint32_t lpn, uint8_t *data)
+{
+	uint32_t ppn;
+
+	ppn = nf->nf_l2p[lpn];
+	if (ppn == NAND_FTL_NONE) {
+		/* Never written, return it as if erased */
+		memset(data, 0xFF, nf->nf_ndev->ndev_page_size);
+		return (0);
+	}
+
+	return (nand_page_read(nf->nf_ndev, ppn, data, NULL));
+}
+
+/*
+ * Performs a request on the FTL disk. Called from the worker thread.
+ */
+void
+nand_ftl_io(nand_device_t ndev, struct bio *bp)
+{
+	struct nand_ftl *nf;
+	uint32_t cnt, lpn;
+	uint8_t *data;
+	int err;
+
+	nf = ndev->ndev_ftl;
+	lpn = bp->bio_offset / ndev->ndev_page_size;
+	cnt = bp->bio_bcount / ndev->ndev_page_size;
+	data = (uint8_t *)bp->bio_data;
+
+	bp->bio_resid = bp->bio_bcount;
+	err = 0;
+	for (; cnt > 0 && err == 0; cnt--, lpn++) {
+		switch (bp->bio_cmd) {
+		case BIO_READ:
+			err = nand_ftl_read(nf, lpn, data);
+			break;
+		case BIO_WRITE:
+			err = nand_ftl_write(nf, lpn, data, 0);
+			nf->nf_writes++;
+			break;
+		case BIO_DELETE:
+			nand_ftl_unmap(nf, lpn);
+			break;
+		default:
+			err = ENOTSUP;
+			break;
+		}
+
+		if (err == 0) {
+			bp->bio_resid -= ndev->ndev_page_size;
+			data += ndev->ndev_page_size;
+		}
+	}
+
+	if (err != 0) {
+		bp->bio_error = err;
+		bp->bio_flags |= BIO_ERROR;
+	}
+	biodone(bp);
+
+	if (nf->nf_free < nf->nf_gc_high || nf->nf_wl_block != -1) {
+		mtx_lock(&nf->nf_mtx);
+		wakeup(nf);
+		mtx_unlock(&nf->nf_mtx);
+	}
+}
+
+off_t
+nand_ftl_mediasize(nand_device_t ndev)
+{
+
+	return ((off_t)ndev->ndev_ftl->nf_lpn_cnt * ndev->ndev_page_size);
+}
+
+/*
+ * Sets up the FTL when hw.nand.<unit>.ftl is set. Must be called
+ * before the worker thread is started as it reads the whole chip.
+ * The free block watermarks and the collection policy are set with
+ * the hw.nand.<unit>.ftl.gc_low, gc_high and gc_policy tunables.
+ */
+int
+nand_ftl_attach(nand_device_t ndev)
+{
+	struct sysctl_oid_list *children;
+	struct sysctl_oid *tree;
+	struct nand_ftl *nf;
+	char tunable[32];
+	uint32_t spare;
+	int enable, err;
+
+	enable = 0;
+	snprintf(tunable, sizeof(tunable), "hw.nand.%d.ftl", ndev->ndev_unit);
+	TUNABLE_INT_FETCH(tunable, &enable);
+	if (!enable)
+		return (0);
+
+	nf = malloc(sizeof(*nf), M_NANDFTL, M_WAITOK | M_ZERO);
+	nf->nf_ndev = ndev;
+	nf->nf_block_cnt = ndev->ndev_data_blocks;
+	nf->nf_ppb = ndev->ndev_lun_cnt * ndev->ndev_page_cnt;
+
+	spare = MAX(NAND_FTL_MIN_SPARE,
+	    nf->nf_block_cnt * NAND_FTL_SPARE / 100);
+	if (spare >= nf->nf_block_cnt) {
+		free(nf, M_NANDFTL);
+		return (ENOSPC);
+	}
+	nf->nf_lpn_cnt = (nf->nf_block_cnt - spare) * nf->nf_ppb;
+
+	nf->nf_l2p = malloc(nf->nf_lpn_cnt * sizeof(uint32_t), M_NANDFTL,
+	    M_WAITOK);
+	nf->nf_p2l = malloc(nf->nf_block_cnt * nf->nf_ppb * sizeof(uint32_t),
+	    M_NANDFTL, M_WAITOK);
+	nf->nf_blocks = malloc(nf->nf_block_cnt *
+	    sizeof(struct nand_ftl_block), M_NANDFTL, M_WAITOK | M_ZERO);
+	nf->nf_buf = malloc(ndev->ndev_page_size, M_NANDFTL, M_WAITOK);
+	mtx_init(&nf->nf_mtx, "nandftl", NULL, MTX_DEF);
+	ndev->ndev_ftl = nf;
+
+	nf->nf_gc_policy = NAND_FTL_GC_GREEDY;
+	nf->nf_wl_threshold = NAND_FTL_WL_THRESHOLD;
+	nf->nf_gc_high = MAX(spare / 2, NAND_FTL_GC_RESERVE + 2);
+	nf->nf_gc_low = MAX(spare / 8, NAND_FTL_GC_RESERVE + 1);
+	snprintf(tunable, sizeof(tunable), "hw.nand.%d.ftl.gc_policy",
+	    ndev->ndev_unit);
+	TUNABLE_INT_FETCH(tunable, &nf->nf_gc_policy);
+	snprintf(tunable, sizeof(tunable), "hw.nand.%d.ftl.gc_high",
+	    ndev->ndev_unit);
+	TUNABLE_INT_FETCH(tunable, &nf->nf_gc_high);
+	snprintf(tunable, sizeof(tunable), "hw.nand.%d.ftl.gc_low",
+	    ndev->ndev_unit);
+	TUNABLE_INT_FETCH(tunable, &nf->nf_gc_low);
+	snprintf(tunable, sizeof(tunable), "hw.nand.%d.ftl.wl_threshold",
+	    ndev->ndev_unit);
+	TUNABLE_INT_FETCH(tunable, &nf->nf_wl_threshold);
+
+	err = nand_ftl_scan(nf);
+	nand_wait_select(ndev, 0);
+	if (err == 0)
+		err = kproc_create(nand_ftl_gc_thread, nf, &nf->nf_gc_proc,
+		    0, 0, "nand%dgc", ndev->ndev_unit);
+	if (err != 0) {
+		nand_ftl_detach(ndev);
+		return (err);
+	}
+
+	tree = SYSCTL_ADD_NODE(&ndev->ndev_sysctl_ctx,
+	    SYSCTL_CHILDREN(ndev->ndev_sysctl_tree), OID_AUTO, "ftl",
+	    CTLFLAG_RD, 0, "Flash translation layer");
+	children = SYSCTL_CHILDREN(tree);
+	SYSCTL_ADD_INT(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "free_blocks", CTLFLAG_RD, &nf->nf_free, 0, "Free blocks");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "writes", CTLFLAG_RD, &nf->nf_writes, "Pages written");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "gc_copies", CTLFLAG_RD, &nf->nf_copies,
+	    "Pages copied by garbage collection");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "gc_blocks", CTLFLAG_RD, &nf->nf_reclaimed,
+	    "Blocks reclaimed by garbage collection");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "gc_stalls", CTLFLAG_RD, &nf->nf_stalls,
+	    "Writes that waited for garbage collection");
+	SYSCTL_ADD_PROC(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "write_amp", CTLTYPE_UINT | CTLFLAG_RD, nf, 0,
+	    nand_ftl_sysctl_wa, "IU", "Write amplification in hundredths");
+	SYSCTL_ADD_INT(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "gc_policy", CTLFLAG_RW, &nf->nf_gc_policy, 0,
+	    "Victim selection, 0 greedy or 1 cost-benefit");
+	SYSCTL_ADD_INT(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "gc_low", CTLFLAG_RW, &nf->nf_gc_low, 0,
+	    "Collect even when busy below this many free blocks");
+	SYSCTL_ADD_INT(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "gc_high", CTLFLAG_RW, &nf->nf_gc_high, 0,
+	    "Collect when idle below this many free blocks");
+	SYSCTL_ADD_INT(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "wl_threshold", CTLFLAG_RW, &nf->nf_wl_threshold, 0,
+	    "Erase count spread before moving cold data, 0 to disable");
+	SYSCTL_ADD_ULONG(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "wl_moves", CTLFLAG_RD, &nf->nf_wl_moves,
+	    "Blocks collected to level wear");
+	SYSCTL_ADD_UINT(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "max_erases", CTLFLAG_RD, &nf->nf_max_erases, 0,
+	    "Erase count of the most worn block");
+	SYSCTL_ADD_PROC(&ndev->ndev_sysctl_ctx, children, OID_AUTO,
+	    "wear", CTLTYPE_STRING | CTLFLAG_RD, nf, 0,
+	    nand_ftl_sysctl_wear, "A", "Histogram of block erase counts");
+
+	return (0);
+}
+
+void
+nand_ftl_detach(nand_device_t ndev)
+{
+	struct nand_ftl *nf;
+
+	nf = ndev->ndev_ftl;
+	if (nf == NULL)
+		return;
+
+	mtx_lock(&nf->nf_mtx);
+	nf->nf_flags |= NAND_FTL_DYING;
+	wakeup(nf);
+	while (nf->nf_gc_proc != NULL)
+		msleep(&nf->nf_gc_proc, &nf->nf_mtx, PRIBIO, "ftldet", 0);
+	mtx_unlock(&nf->nf_mtx);
+	mtx_destroy(&nf->nf_mtx);
+
+	free(nf->nf_l2p, M_NANDFTL);
+	free(nf->nf_p2l, M_NANDFTL);
+	free(nf->nf_blocks, M_NANDFTL);
+	free(nf->nf_buf, M_NANDFTL);
+	free(nf, M_NANDFTL);
+	ndev->ndev_ftl = NULL;
+}
@@ -30,6 +30,8 @@
 
 #define NAND_CMD_READ		0x00
 #define  NAND_CMD_READ_START	0x30
+#define  NAND_CMD_READ_CACHE_SEQ 0x31
+#define  NAND_CMD_READ_CACHE_END 0x3F
 
 #define NAND_CMD_ERASE		0x60
 #define  NAND_CMD_ERASE_END	0xD0
@@ -43,6 +45,7 @@
 
 #define NAND_CMD_PROGRAM	0x80
 #define  NAND_CMD_PROGRAM_END	0x10
+#define  NAND_CMD_PROGRAM_CACHE	0x15
 
 #define NAND_CMD_READID		0x90
 #define  NAND_READID_MANFID	0x00
@@ -50,6 +53,13 @@
 
 #define NAND_CMD_RESET	0xFF
 
+/*
+ * Factory bad blocks have a byte other than 0xFF at this
+ * offset in the spare area of their first or second page
+ */
+#define NAND_BBM_SMALL_OFFSET	5	/* 512 byte pages */
+#define NAND_BBM_LARGE_OFFSET	0
+
 /* Device identification */
 #define NAND_MANF_SAMSUNG	0xEC
 #define  NAND_DEV_SAMSUNG_256MB	0xAA /* 256MiB 8bit 1.8v */
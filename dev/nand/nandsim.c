@@ -30,9 +30,20 @@ __FBSDID("$FreeBSD$");
 
 #include <sys/param.h>
 #include <sys/systm.h>
+#include <sys/bio.h>
+#include <sys/callout.h>
+#include <sys/fcntl.h>
 #include <sys/kernel.h>
+#include <sys/kthread.h>
+#include <sys/lock.h>
 #include <sys/malloc.h>
 #include <sys/module.h>
+#include <sys/mutex.h>
+#include <sys/namei.h>
+#include <sys/proc.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/vnode.h>
 
 #include <geom/geom.h>
 #include <geom/geom_disk.h>
@@ -41,55 +52,73 @@ __FBSDID("$FreeBSD$");
 #include "nandreg.h"
 #include "nandvar.h"
 
-#define CHECK_STATE()						\
+#define CHECK_STATE(chip)					\
 do {								\
-	KASSERT(nand_chip.incmd != 0xFF, 			\
+	KASSERT((chip)->incmd != 0xFF, 				\
 	    ("NANDSIM: Command state was not cleared"));	\
-	KASSERT(nand_chip.inaddr != 0xFF,			\
+	KASSERT((chip)->inaddr != 0xFF,				\
 	    ("NANDSIM: Address state was not cleared"));	\
-	KASSERT(nand_chip.inread != 0xFF, 			\
+	KASSERT((chip)->inread != 0xFF, 			\
 	    ("NANSIM: Read state was not cleared"));		\
-	KASSERT(nand_chip.inwrite != 0xFF,			\
+	KASSERT((chip)->inwrite != 0xFF,			\
 	    ("NANDSIM: Write state was not cleated"));		\
 } while(0)
 
-#define RESET_STATE()			\
+#define RESET_STATE(chip)		\
 do {					\
-	nand_chip.startcmd = 1;		\
-	nand_chip.incmd = 0;		\
-	nand_chip.inaddr = 0;		\
-	nand_chip.inread = 0;		\
-	nand_chip.inwrite = 0;		\
-	nand_chip.read_status = 0;	\
+	(chip)->startcmd = 1;		\
+	(chip)->incmd = 0;		\
+	(chip)->inaddr = 0;		\
+	(chip)->inread = 0;		\
+	(chip)->inwrite = 0;		\
+	(chip)->read_status = 0;	\
 					\
-	nand_chip.cmd_len = 0;		\
-	nand_chip.address = 0;		\
-	nand_chip.address_len = 0;	\
-	nand_chip.data_pos = 0;		\
+	(chip)->cmd_len = 0;		\
+	(chip)->address = 0;		\
+	(chip)->address_len = 0;	\
+	(chip)->data_pos = 0;		\
 } while (0)
 
-#define CLEAR_IN_STATE()		\
+#define CLEAR_IN_STATE(chip)		\
 do {					\
-	nand_chip.incmd = 0xFF;		\
-	nand_chip.inaddr = 0xFF;	\
-	nand_chip.inread = 0xFF;	\
-	nand_chip.inwrite = 0xFF;	\
+	(chip)->incmd = 0xFF;		\
+	(chip)->inaddr = 0xFF;		\
+	(chip)->inread = 0xFF;		\
+	(chip)->inwrite = 0xFF;		\
 } while (0)
 
-#define GET_OFFSET(dest_addr, len)			\
-do {							\
-	dest_addr = nand_chip.address +			\
-	    ((nand_chip.address / 256) * 16);		\
-							\
-	if (dest_addr + len > nand_chip.size) {	\
-		printf("NANDSIM: %s: Attempt to access past end of data\n", \
-		    __func__);				\
-		RESET_STATE();				\
-		return (EIO);				\
-	}						\
+#define NANDSIM_TRACE(sim, ...)		\
+do {					\
+	if ((sim)->debug)		\
+		printf(__VA_ARGS__);	\
 } while (0)
 
-static struct {
+/* The size of a page including the spare area */
+#define PAGE_REG_SIZE(ndev) ((ndev)->ndev_page_size + (ndev)->ndev_spare_size)
+
+/* The parts we are able to emulate */
+static const struct nandsim_part {
+	uint8_t		manuf;
+	uint8_t		device;
+	uint32_t	page_size;
+	uint16_t	spare_size;
+	uint32_t	page_cnt;
+	uint32_t	block_cnt;
+	int		read_start;
+} nandsim_parts[] = {
+	/* Samsung 64MiB chip, eg. K9F1208U0B */
+	{ NAND_MANF_SAMSUNG, NAND_DEV_SAMSUNG_64MB, 512, 16, 32, 4096, 0 },
+	/* Samsung 256MiB chip, eg. K9F2G08R0A */
+	{ NAND_MANF_SAMSUNG, NAND_DEV_SAMSUNG_256MB, 2048, 64, 64, 2048, 1 },
+	{ 0, 0, 0, 0, 0, 0, 0 }
+};
+
+/*
+ * The state of a single LUN. Each LUN sits behind its own chip enable.
+ */
+struct nandsim_chip {
+	struct nandsim	*sim;
+
 	int		startcmd;	/* Can we start a new command */
 
 	/* These tell us what to expect next */
@@ -101,193 +130,1069 @@ static struct {
 	int		read_status;	/* Are we in NAND_CMD_READ_STATUS */
 
 	int		read_start;	/* Expect a NAND_CMD_READ_START */
+	int		cache_cmds;	/* Accept the cache commands */
 
 	int		cmd_len;
 	uint8_t		cmd[2];
 
 	int		address_len;
-	uint32_t	address;
+	uint64_t	address;
 
 	size_t		data_len;
-	uint8_t		*data;
+
+	/*
+	 * The array is kept a block at a time. Memory for a block is
+	 * allocated when it is first programmed and freed when it is
+	 * erased, until then it reads as all ones or from the image.
+	 */
+	uint8_t		**blocks;
+	size_t		block_size;	/* Bytes in a block with the spare */
+	uint8_t		*erased;	/* Blocks no longer in the image */
+	off_t		image_offset;	/* Where the array is in the image */
+	uint8_t		*image_buf;	/* A block to write the image from */
 
 	off_t		data_pos;	/* The offset for nand_read_8 */
 
+	/*
+	 * Data moves between the bus and the cache register and
+	 * between the data register and the array. Parts without
+	 * cache commands behave as if the two were the same.
+	 */
+	uint8_t		*cache_reg;
+	uint8_t		*data_reg;
+	int		reg_valid;	/* cache_reg holds a page from the array */
+	size_t		col;		/* Next byte of cache_reg to transfer */
+	off_t		data_offset;	/* Array offset of data_reg or -1 */
+
 	uint8_t		manuf;
 	uint8_t		device;
 
 	size_t		size;
-} nand_chip;
 
+	/*
+	 * The array is busy until nandsim_now() reaches ready_at and the
+	 * cache register until cache_ready_at. The ready/busy line and
+	 * NAND_STATUS_RDY follow the cache register, NAND_STATUS_ARDY
+	 * the array.
+	 */
+	uint64_t	ready_at;
+	uint64_t	cache_ready_at;
+	int		polled;		/* Status seen with only RDY */
+	struct callout	busy_callout;	/* Raises the ready interrupt */
+};
+
+/*
+ * The timing model. Array operations keep the LUN busy for the time
+ * given, give or take up to jitter percent, and each byte over the bus
+ * costs bus_ns. The cache commands only keep the cache register busy
+ * for t_rcbsy once the array is done with the page before. Times are
+ * from nandsim_now(), the uptime or with virtual set a clock of each
+ * instance only moved on by bus transfers and by waiting for the
+ * device, so a benchmark can see the device's own throughput.
+ */
+struct nandsim_timing {
+	int		t_read;		/* tR, microseconds */
+	int		t_prog;		/* tPROG, microseconds */
+	int		t_erase;	/* tBERS, microseconds */
+	int		t_rcbsy;	/* tRCBSY and tCBSY, microseconds */
+	int		jitter;		/* Percent */
+	int		bus_ns;		/* Nanoseconds per byte */
+	int		virtual;
+};
+
+/*
+ * The software DMA engine. A transfer is handed to nandsim_dma_proc
+ * which moves the data and wakes up anyone in nandsim_dma_wait.
+ */
+#define	NANDSIM_DMA_IDLE	0
+#define	NANDSIM_DMA_QUEUED	1
+#define	NANDSIM_DMA_DONE	2
+#define	NANDSIM_DMA_EXIT	3
+
+struct nandsim_dma {
+	int		state;
+	int		read;
+	size_t		len;
+	uint8_t		*data;
+	int		error;
+	struct proc	*proc;
+};
+
+/*
+ * An instance of the simulator, a controller with the LUNs behind it
+ * attached as a NAND device of its own. Instances share nothing so
+ * run in parallel.
+ */
+struct nandsim {
+	struct nand_device dev;		/* First, see NANDSIM() */
+	struct nand_driver dri;
+	int		unit;
+	int		attached;
+
+	/* The part as the chips describe it, see nandsim_device_info() */
+	struct nand_device_info info;
+	char		name[32];
+
+	struct nandsim_chip chips[NAND_MAX_LUN];
+	int		luns;
+	int		lun;		/* LUN with chip enable asserted */
+	u_int		reads;		/* Counts to bitflips */
+
+	/* Tunables, see nandsim_tunables() */
+	struct nandsim_timing timing;
+	int		ecc;		/* Bits of software ECC per 512 bytes */
+	int		bitflips;	/* Reads per bitflip_bits flipped */
+	int		bitflip_bits;
+	int		bad_blocks;	/* Factory bad blocks on each LUN */
+	int		debug;
+
+	struct mtx	mtx;		/* Protects the clock and the DMA */
+	uint64_t	clock;		/* The virtual clock, nanoseconds */
+	uint64_t	bus_owed;	/* Bus time not yet spent */
+	struct nandsim_dma dma;
+
+	uint64_t	capacity;	/* Bytes in the arrays */
+	uint64_t	resident;	/* Bytes of memory behind them */
+
+	char		image[MAXPATHLEN];
+	int		image_mode;
+	struct vnode	*image_vp;
+	int		image_flags;
+
+	struct sysctl_ctx_list sysctl_ctx;
+};
+
+#define	NANDSIM(ndev)	((struct nandsim *)(ndev))
+
+/*
+ * The instances. Each has tunables hw.nandsim.<unit>.<name> for its
+ * part, timing and features, which default to hw.nandsim.<name>.
+ * Setting a geometry makes a part of its own with an ID the core
+ * doesn't know.
+ */
+#define	NANDSIM_MAX		8
+#define	NANDSIM_MANF_CUSTOM	0x00
+#define	NANDSIM_DEV_CUSTOM	0x00
+
+static struct nandsim *nandsim_sims[NANDSIM_MAX];
+static int nandsim_count;
+static struct sx nandsim_lock;	/* Protects nandsim_sims */
+SX_SYSINIT(nandsim_lock, &nandsim_lock, "nandsim");
+
+static int nandsim_instances = 1;
+TUNABLE_INT("hw.nandsim.instances", &nandsim_instances);
+static int nandsim_luns = 1;
+TUNABLE_INT("hw.nandsim.luns", &nandsim_luns);
+static int nandsim_device = NAND_DEV_SAMSUNG_64MB;
+TUNABLE_INT("hw.nandsim.device", &nandsim_device);
+/* The geometry, 0 to use the part's own */
+static int nandsim_page_size = 0;
+TUNABLE_INT("hw.nandsim.page_size", &nandsim_page_size);
+static int nandsim_spare_size = 0;
+TUNABLE_INT("hw.nandsim.spare_size", &nandsim_spare_size);
+static int nandsim_pages = 0;
+TUNABLE_INT("hw.nandsim.pages", &nandsim_pages);
+static int nandsim_blocks = 0;
+TUNABLE_INT("hw.nandsim.blocks", &nandsim_blocks);
+static int nandsim_debug = 0;
+TUNABLE_INT("hw.nandsim.debug", &nandsim_debug);
+/* Factory bad blocks to mark on each LUN */
+static int nandsim_bad_blocks = 0;
+TUNABLE_INT("hw.nandsim.bad_blocks", &nandsim_bad_blocks);
+/* Bits of software ECC per 512 bytes, 1 for Hamming or more for BCH */
+static int nandsim_ecc = 1;
+TUNABLE_INT("hw.nandsim.ecc", &nandsim_ecc);
+/* Flip nandsim_bitflip_bits bits in one of every nandsim_bitflips reads */
+static int nandsim_bitflips = 0;
+TUNABLE_INT("hw.nandsim.bitflips", &nandsim_bitflips);
+static int nandsim_bitflip_bits = 1;
+TUNABLE_INT("hw.nandsim.bitflip_bits", &nandsim_bitflip_bits);
+/* Microseconds the array is busy for after each operation */
+static int nandsim_busy = 0;
+TUNABLE_INT("hw.nandsim.busy", &nandsim_busy);
+/* Array times default to busy, t_rcbsy to 3 or less */
+static struct nandsim_timing nandsim_timing = {
+	.t_read = -1,
+	.t_prog = -1,
+	.t_erase = -1,
+	.t_rcbsy = -1,
+};
+TUNABLE_INT("hw.nandsim.t_read", &nandsim_timing.t_read);
+TUNABLE_INT("hw.nandsim.t_prog", &nandsim_timing.t_prog);
+TUNABLE_INT("hw.nandsim.t_erase", &nandsim_timing.t_erase);
+TUNABLE_INT("hw.nandsim.t_rcbsy", &nandsim_timing.t_rcbsy);
+TUNABLE_INT("hw.nandsim.jitter", &nandsim_timing.jitter);
+TUNABLE_INT("hw.nandsim.bus_ns", &nandsim_timing.bus_ns);
+TUNABLE_INT("hw.nandsim.virtual_clock", &nandsim_timing.virtual);
+/* Move page data with the software DMA engine */
+static int nandsim_dma_enable = 0;
+TUNABLE_INT("hw.nandsim.dma", &nandsim_dma_enable);
+/* Give the core whole page operations rather than the byte protocol */
+static int nandsim_page_ops = 0;
+TUNABLE_INT("hw.nandsim.page_ops", &nandsim_page_ops);
+/* Run operations from the core as a sequencer would */
+static int nandsim_exec_ops = 0;
+TUNABLE_INT("hw.nandsim.exec_op", &nandsim_exec_ops);
+
+/*
+ * A raw image of the LUNs one after another, each page with its spare
+ * area, to start the arrays from. Blocks are read from the image when
+ * used. Changes are kept in memory or with NANDSIM_IMAGE_WRITE go
+ * straight to the image.
+ */
+#define	NANDSIM_IMAGE_COPY	0
+#define	NANDSIM_IMAGE_WRITE	1
+
+static char nandsim_image[MAXPATHLEN];
+TUNABLE_STR("hw.nandsim.image", nandsim_image, sizeof(nandsim_image));
+static int nandsim_image_mode = NANDSIM_IMAGE_COPY;
+TUNABLE_INT("hw.nandsim.image_mode", &nandsim_image_mode);
+
+static int nandsim_clock_sysctl(SYSCTL_HANDLER_ARGS);
+static int nandsim_instances_sysctl(SYSCTL_HANDLER_ARGS);
+
+SYSCTL_NODE(_hw, OID_AUTO, nandsim, CTLFLAG_RD, 0, "NAND flash simulator");
+SYSCTL_PROC(_hw_nandsim, OID_AUTO, instances, CTLTYPE_INT | CTLFLAG_RW,
+    NULL, 0, nandsim_instances_sysctl, "I", "Number of simulated devices");
+
+static int nandsim_select(nand_device_t, int);
 static int nandsim_command(nand_device_t, uint8_t);
 static int nandsim_address(nand_device_t, uint8_t);
 static int nandsim_read(nand_device_t, size_t, uint8_t *);
 static int nandsim_read_8(nand_device_t, uint8_t *);
 static int nandsim_write(nand_device_t, size_t, uint8_t *);
-
-static struct nand_driver nandsim_dri = {
+static int nandsim_read_rnb(nand_device_t);
+static int nandsim_wait_ready(nand_device_t, int);
+static int nandsim_dma_read(nand_device_t, size_t, uint8_t *);
+static int nandsim_dma_write(nand_device_t, size_t, uint8_t *);
+static int nandsim_dma_wait(nand_device_t);
+static int nandsim_page_read(nand_device_t, off_t, uint8_t *, uint8_t *);
+static int nandsim_page_program(nand_device_t, off_t, uint8_t *, uint8_t *);
+static int nandsim_block_erase(nand_device_t, off_t);
+static int nandsim_exec_op(nand_device_t, struct nand_op *);
+
+static int nandsim_device_info(nand_device_t, struct nand_device_info *);
+
+static const struct nand_driver nandsim_dri = {
+	.ndri_select = nandsim_select,
 	.ndri_command = nandsim_command,
 	.ndri_address = nandsim_address,
 	.ndri_read = nandsim_read,
 	.ndri_read_8 = nandsim_read_8,
 	.ndri_write = nandsim_write,
-};
-
-static struct nand_device nandsim_dev = {
-	.ndev_driver = &nandsim_dri,
+	.ndri_read_rnb = nandsim_read_rnb,
+	.ndri_wait_ready = nandsim_wait_ready,
+	.ndri_device_info = nandsim_device_info,
 };
 
 MALLOC_DEFINE(M_NANDSIM, "nandsimdisk", "nandsim virtual disk buffers");
 
+static uint64_t
+nandsim_now(struct nandsim *sim)
+{
+	struct timespec ts;
+
+	mtx_assert(&sim->mtx, MA_OWNED);
+
+	if (sim->timing.virtual)
+		return (sim->clock);
+	nanouptime(&ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static int
+nandsim_clock_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct nandsim *sim;
+	uint64_t now;
+
+	sim = arg1;
+	mtx_lock(&sim->mtx);
+	now = nandsim_now(sim);
+	mtx_unlock(&sim->mtx);
+	return (sysctl_handle_64(oidp, &now, 0, req));
+}
+
+/*
+ * Is the cache register busy, as seen on the ready/busy line. Asking
+ * the virtual clock is taken as waiting so it moves on to when the
+ * register is free.
+ */
+static int
+nandsim_cache_busy(struct nandsim_chip *chip)
+{
+
+	mtx_assert(&chip->sim->mtx, MA_OWNED);
+
+	if (nandsim_now(chip->sim) >= chip->cache_ready_at)
+		return (0);
+	if (!chip->sim->timing.virtual)
+		return (1);
+	chip->sim->clock = chip->cache_ready_at;
+	return (0);
+}
+
+/*
+ * The ready bits of the status. With the virtual clock a read waits
+ * for the cache register, and a second read finding it free but the
+ * array busy waits for the array, so polling for NAND_STATUS_ARDY
+ * gets there without a single read giving away the overlap.
+ */
+static uint8_t
+nandsim_ready_status(struct nandsim_chip *chip)
+{
+	uint8_t status;
+	uint64_t now;
+
+	mtx_assert(&chip->sim->mtx, MA_OWNED);
+
+	now = nandsim_now(chip->sim);
+	if (chip->sim->timing.virtual) {
+		if (now < chip->cache_ready_at)
+			now = chip->cache_ready_at;
+		else if (now < chip->ready_at && chip->polled)
+			now = chip->ready_at;
+		chip->sim->clock = now;
+	}
+
+	status = 0;
+	if (now >= chip->cache_ready_at)
+		status |= NAND_STATUS_RDY;
+	if (now >= chip->ready_at)
+		status |= NAND_STATUS_ARDY;
+	chip->polled = (status == NAND_STATUS_RDY);
+	return (status);
+}
+
+/*
+ * Run from a callout standing in for the interrupt a
+ * controller raises when the ready/busy line goes high
+ */
+static void
+nandsim_ready(void *arg)
+{
+	struct nandsim_chip *chip;
+
+	chip = arg;
+	mtx_assert(&chip->sim->mtx, MA_OWNED);
+
+	wakeup(chip);
+}
+
+/*
+ * Marks the array busy for usec microseconds from when it finishes
+ * what it is doing, eg. the previous cache program. The cache register
+ * is busy for the first cache_usec of that, or for all of it when
+ * cache_usec is negative.
+ */
+static void
+nandsim_start_busy(struct nandsim_chip *chip, int usec, int cache_usec)
+{
+	struct nandsim *sim;
+	uint64_t start;
+	int64_t ns;
+	int jitter;
+
+	sim = chip->sim;
+	ns = (int64_t)MAX(usec, 0) * 1000;
+	jitter = MIN(sim->timing.jitter, 100);
+	if (jitter > 0)
+		ns += ns * ((int)(random() % (2 * jitter + 1)) - jitter) / 100;
+
+	mtx_lock(&sim->mtx);
+	chip->polled = 0;
+	start = MAX(chip->ready_at, nandsim_now(sim));
+	chip->ready_at = start + ns;
+	if (cache_usec < 0)
+		chip->cache_ready_at = chip->ready_at;
+	else
+		chip->cache_ready_at = MIN(chip->ready_at,
+		    start + (uint64_t)cache_usec * 1000);
+	if (!sim->timing.virtual && chip->cache_ready_at > nandsim_now(sim))
+		callout_reset(&chip->busy_callout,
+		    howmany(chip->cache_ready_at - nandsim_now(sim),
+		    tick * 1000), nandsim_ready, chip);
+	mtx_unlock(&sim->mtx);
+}
+
+/*
+ * Spends the time moving len bytes over the bus takes. Real time is
+ * spent once it adds up to a microsecond.
+ */
+static void
+nandsim_bus(struct nandsim *sim, size_t len)
+{
+	u_int usec;
+
+	if (sim->timing.bus_ns <= 0)
+		return;
+
+	mtx_lock(&sim->mtx);
+	if (sim->timing.virtual) {
+		sim->clock += (uint64_t)len * sim->timing.bus_ns;
+		mtx_unlock(&sim->mtx);
+		return;
+	}
+	sim->bus_owed += (uint64_t)len * sim->timing.bus_ns;
+	usec = sim->bus_owed / 1000;
+	sim->bus_owed %= 1000;
+	mtx_unlock(&sim->mtx);
+
+	if (usec > 0)
+		DELAY(usec);
+}
+
+/*
+ * Returns the number of address cycles the current command takes
+ */
+static int
+nandsim_addr_cycles(nand_device_t ndev, struct nandsim_chip *chip)
+{
+	switch (chip->cmd[0]) {
+	case NAND_CMD_READID:
+		return (1);
+	case NAND_CMD_ERASE:
+		return (ndev->ndev_row_cycles);
+	default:
+		return (ndev->ndev_column_cycles + ndev->ndev_row_cycles);
+	}
+}
+
+/*
+ * Splits the address into the page and the column within it.
+ * Returns the offset of the page in the chip data or -1 if
+ * the page is past the end of the chip.
+ */
+static off_t
+nandsim_page_offset(nand_device_t ndev, struct nandsim_chip *chip,
+    size_t *col)
+{
+	uint64_t page;
+	off_t offset;
+
+	*col = chip->address & ((1 << (8 * ndev->ndev_column_cycles)) - 1);
+	page = chip->address >> (8 * ndev->ndev_column_cycles);
+
+	offset = page * PAGE_REG_SIZE(ndev);
+	if (offset + PAGE_REG_SIZE(ndev) > chip->size) {
+		printf("NANDSIM: Attempt to access past end of data\n");
+		return (-1);
+	}
+	return (offset);
+}
+
+static int
+nandsim_image_pad(struct nandsim *sim, struct vnode *vp, off_t offset,
+    struct thread *td)
+{
+	uint8_t *buf;
+	size_t len;
+	int err;
+
+	buf = malloc(MAXBSIZE, M_NANDSIM, M_WAITOK);
+	memset(buf, 0xFF, MAXBSIZE);
+	for (err = 0; err == 0 && offset < sim->capacity; offset += len) {
+		len = MIN(MAXBSIZE, sim->capacity - offset);
+		err = vn_rdwr(UIO_WRITE, vp, buf, len, offset, UIO_SYSSPACE,
+		    IO_NODELOCKED, td->td_ucred, NOCRED, NULL, td);
+	}
+	free(buf, M_NANDSIM);
+	return (err);
+}
+
+static int
+nandsim_image_open(struct nandsim *sim)
+{
+	struct thread *td;
+	struct nameidata nd;
+	struct vattr vattr;
+	int err, flags;
+
+	td = curthread;
+	flags = FREAD;
+	if (sim->image_mode == NANDSIM_IMAGE_WRITE)
+		flags |= FWRITE;
+	NDINIT(&nd, LOOKUP, FOLLOW, UIO_SYSSPACE, sim->image, td);
+	err = vn_open(&nd, &flags, 0, NULL);
+	if (err != 0)
+		return (err);
+	NDFREE(&nd, NDF_ONLY_PNBUF);
+
+	if (nd.ni_vp->v_type != VREG)
+		err = EINVAL;
+	else
+		err = VOP_GETATTR(nd.ni_vp, &vattr, td->td_ucred);
+	/* Anything past the arrays would never be seen */
+	if (err == 0 && vattr.va_size > sim->capacity)
+		err = EFBIG;
+	/* Holes read as zeros so a writable image is filled out erased */
+	if (err == 0 && (flags & FWRITE) != 0 &&
+	    vattr.va_size < sim->capacity)
+		err = nandsim_image_pad(sim, nd.ni_vp, vattr.va_size, td);
+	VOP_UNLOCK(nd.ni_vp, 0);
+	if (err != 0) {
+		vn_close(nd.ni_vp, flags, td->td_ucred, td);
+		return (err);
+	}
+
+	sim->image_vp = nd.ni_vp;
+	sim->image_flags = flags;
+	return (0);
+}
+
+static void
+nandsim_image_close(struct nandsim *sim)
+{
+	struct thread *td;
+
+	if (sim->image_vp == NULL)
+		return;
+	td = curthread;
+	vn_close(sim->image_vp, sim->image_flags, td->td_ucred, td);
+	sim->image_vp = NULL;
+}
+
+/*
+ * Reads or writes the image. A short image reads as erased past its end.
+ */
+static int
+nandsim_image_io(struct nandsim *sim, enum uio_rw rw, off_t offset,
+    uint8_t *buf, size_t len)
+{
+	struct thread *td;
+	int err, resid;
+
+	td = curthread;
+	err = vn_rdwr(rw, sim->image_vp, buf, len, offset, UIO_SYSSPACE,
+	    0, td->td_ucred, NOCRED, &resid, td);
+	if (err != 0) {
+		printf("NANDSIM: Image %s failed at %jd: %d\n",
+		    rw == UIO_READ ? "read" : "write", (intmax_t)offset, err);
+		return (EIO);
+	}
+	if (rw == UIO_READ && resid > 0)
+		memset(&buf[len - resid], 0xFF, resid);
+	return (0);
+}
+
+/*
+ * Is the block as it is in the image
+ */
+static inline int
+nandsim_in_image(struct nandsim_chip *chip, off_t block)
+{
+
+	return (chip->sim->image_vp != NULL && chip->blocks[block] == NULL &&
+	    !isset(chip->erased, block));
+}
+
+/*
+ * Copies len bytes of the array at offset, all within one block
+ */
+static int
+nandsim_array_read(struct nandsim_chip *chip, off_t offset, uint8_t *buf,
+    size_t len)
+{
+	uint8_t *block;
+
+	if (nandsim_in_image(chip, offset / chip->block_size))
+		return (nandsim_image_io(chip->sim, UIO_READ,
+		    chip->image_offset + offset, buf, len));
+
+	block = chip->blocks[offset / chip->block_size];
+	if (block == NULL)
+		memset(buf, 0xFF, len);
+	else
+		memcpy(buf, &block[offset % chip->block_size], len);
+	return (0);
+}
+
+/*
+ * ANDs len bytes of src into dst a word at a time once dst is aligned,
+ * as programming does to the cells.
+ */
+static void
+nandsim_and(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint64_t word;
+
+	for (; len > 0 && ((uintptr_t)dst & (sizeof(word) - 1)) != 0; len--)
+		*dst++ &= *src++;
+	for (; len >= sizeof(word); len -= sizeof(word)) {
+		memcpy(&word, src, sizeof(word));
+		*(uint64_t *)dst &= word;
+		dst += sizeof(word);
+		src += sizeof(word);
+	}
+	for (; len > 0; len--)
+		*dst++ &= *src++;
+}
+
+/*
+ * Programs len bytes at offset, all within one block. Programming only
+ * moves bits from 1 -> 0 so all ones leaves a block as it is.
+ */
+static int
+nandsim_array_program(struct nandsim_chip *chip, off_t offset,
+    const uint8_t *buf, size_t len)
+{
+	struct nandsim *sim;
+	uint8_t **block, *p;
+	size_t i;
+	int err;
+
+	sim = chip->sim;
+	block = &chip->blocks[offset / chip->block_size];
+	if (*block == NULL) {
+		for (i = 0; i < len && buf[i] == 0xFF; i++)
+			continue;
+		if (i == len)
+			return (0);
+
+		if (sim->image_mode == NANDSIM_IMAGE_WRITE &&
+		    sim->image_vp != NULL) {
+			err = nandsim_image_io(sim, UIO_READ,
+			    chip->image_offset + offset, chip->image_buf, len);
+			if (err != 0)
+				return (err);
+			nandsim_and(chip->image_buf, buf, len);
+			return (nandsim_image_io(sim, UIO_WRITE,
+			    chip->image_offset + offset, chip->image_buf,
+			    len));
+		}
+
+		/* Start from the erased or image copy of the block */
+		p = malloc(chip->block_size, M_NANDSIM, M_WAITOK);
+		err = nandsim_array_read(chip,
+		    offset - offset % chip->block_size, p, chip->block_size);
+		if (err != 0) {
+			free(p, M_NANDSIM);
+			return (err);
+		}
+		*block = p;
+		sim->resident += chip->block_size;
+	}
+
+	nandsim_and(&(*block)[offset % chip->block_size], buf, len);
+	return (0);
+}
+
+static void
+nandsim_array_free(struct nandsim_chip *chip, off_t block)
+{
+
+	if (chip->blocks[block] == NULL)
+		return;
+	free(chip->blocks[block], M_NANDSIM);
+	chip->blocks[block] = NULL;
+	chip->sim->resident -= chip->block_size;
+}
+
+static int
+nandsim_array_erase(struct nandsim_chip *chip, off_t block)
+{
+	struct nandsim *sim;
+
+	sim = chip->sim;
+	if (sim->image_mode == NANDSIM_IMAGE_WRITE && sim->image_vp != NULL) {
+		memset(chip->image_buf, 0xFF, chip->block_size);
+		return (nandsim_image_io(sim, UIO_WRITE,
+		    chip->image_offset + block * chip->block_size,
+		    chip->image_buf, chip->block_size));
+	}
+
+	nandsim_array_free(chip, block);
+	if (chip->erased != NULL)
+		setbit(chip->erased, block);
+	return (0);
+}
+
+/*
+ * Simulates read disturb. Bits of the page are flipped as it is read
+ * into the data register, all within the same 512 bytes so the ECC
+ * sees them together. The copy in the array is left alone.
+ */
+static void
+nandsim_disturb(nand_device_t ndev, uint8_t *reg)
+{
+	struct nandsim *sim;
+	u_int base, bit, i, pos, size;
+
+	sim = NANDSIM(ndev);
+	if (sim->bitflips <= 0 || ++sim->reads % sim->bitflips != 0)
+		return;
+
+	size = MIN(ndev->ndev_page_size, 512) * NBBY;
+	base = (random() % (ndev->ndev_page_size * NBBY)) / size * size;
+	bit = random() % size;
+	for (i = 0; i < sim->bitflip_bits; i++) {
+		pos = base + bit;
+		NANDSIM_TRACE(sim,
+		    "NANDSIM: nandsim_disturb: Flipping bit %u\n", pos);
+		reg[pos / NBBY] ^= 1 << (pos % NBBY);
+		/* Any step coprime with size reaches a different bit */
+		bit = (bit + 1031) % size;
+	}
+}
+
+/*
+ * Moves a page from the array through the data
+ * register to the cache register
+ */
+static int
+nandsim_load_page(nand_device_t ndev, struct nandsim_chip *chip)
+{
+	off_t offset;
+	int err;
+
+	offset = nandsim_page_offset(ndev, chip, &chip->col);
+	if (offset < 0)
+		return (EIO);
+
+	NANDSIM_TRACE(chip->sim,
+	    "NANDSIM: nandsim_load_page: Reading offset %X\n",
+	    (unsigned int)offset);
+	err = nandsim_array_read(chip, offset, chip->data_reg,
+	    PAGE_REG_SIZE(ndev));
+	if (err != 0)
+		return (err);
+	nandsim_disturb(ndev, chip->data_reg);
+	memcpy(chip->cache_reg, chip->data_reg, PAGE_REG_SIZE(ndev));
+	chip->data_offset = offset;
+	chip->reg_valid = 1;
+	nandsim_start_busy(chip, chip->sim->timing.t_read, -1);
+
+	return (0);
+}
+
+/*
+ * Handles NAND_CMD_READ_CACHE_SEQ and NAND_CMD_READ_CACHE_END. The page
+ * in the data register moves to the cache register to be read out and
+ * for NAND_CMD_READ_CACHE_SEQ the next page is read into the data register.
+ */
+static int
+nandsim_read_cache(nand_device_t ndev, struct nandsim_chip *chip, uint8_t cmd)
+{
+	off_t offset;
+	int err;
+
+	if (!chip->cache_cmds || chip->data_offset < 0) {
+		printf("NANDSIM: nandsim_read_cache: "
+		    "Cache read when there is no page to read\n");
+		RESET_STATE(chip);
+		return (EIO);
+	}
+
+	memcpy(chip->cache_reg, chip->data_reg, PAGE_REG_SIZE(ndev));
+	chip->col = 0;
+	chip->reg_valid = 1;
+
+	offset = chip->data_offset + PAGE_REG_SIZE(ndev);
+	if (cmd == NAND_CMD_READ_CACHE_SEQ && offset < chip->size) {
+		NANDSIM_TRACE(chip->sim, "NANDSIM: nandsim_read_cache: "
+		    "Reading offset %X\n", (unsigned int)offset);
+		err = nandsim_array_read(chip, offset, chip->data_reg,
+		    PAGE_REG_SIZE(ndev));
+		if (err != 0) {
+			chip->data_offset = -1;
+			RESET_STATE(chip);
+			return (err);
+		}
+		nandsim_disturb(ndev, chip->data_reg);
+		chip->data_offset = offset;
+		/* The next page is read while this one is moved out */
+		nandsim_start_busy(chip, chip->sim->timing.t_read,
+		    chip->sim->timing.t_rcbsy);
+	} else {
+		chip->data_offset = -1;
+		nandsim_start_busy(chip, chip->sim->timing.t_rcbsy, -1);
+	}
+
+	/* The cache register can now be read */
+	RESET_STATE(chip);
+	chip->cmd[0] = NAND_CMD_READ;
+	chip->incmd = 1;
+	chip->inread = 1;
+
+	CHECK_STATE(chip);
+
+	return (0);
+}
+
+/*
+ * Moves the cache register to the data register and programs it into
+ * the array. With NAND_CMD_PROGRAM_CACHE the cache register is free for
+ * the next page as soon as it has been copied.
+ */
+static int
+nandsim_program_page(nand_device_t ndev, struct nandsim_chip *chip,
+    int cache)
+{
+	off_t offset;
+	size_t col;
+	int err;
+
+	offset = nandsim_page_offset(ndev, chip, &col);
+	if (offset < 0)
+		return (EIO);
+
+	NANDSIM_TRACE(chip->sim, "NANDSIM: nandsim_program_page: "
+	    "Programming offset %X\n", (unsigned int)offset);
+
+	memcpy(chip->data_reg, chip->cache_reg, PAGE_REG_SIZE(ndev));
+	err = nandsim_array_program(chip, offset, chip->data_reg,
+	    PAGE_REG_SIZE(ndev));
+	nandsim_start_busy(chip, chip->sim->timing.t_prog,
+	    cache ? chip->sim->timing.t_rcbsy : -1);
+
+	return (err);
+}
+
+/*
+ * Sets every bit in the block containing the addressed page
+ */
+static int
+nandsim_erase_block(nand_device_t ndev, struct nandsim_chip *chip)
+{
+	off_t offset, size;
+	uint64_t block;
+	int err;
+
+	/* Erase only sends the row address */
+	block = chip->address / ndev->ndev_page_cnt;
+	size = ndev->ndev_page_cnt * PAGE_REG_SIZE(ndev);
+	offset = block * size;
+	if (offset + size > chip->size) {
+		printf("NANDSIM: Attempt to erase past end of data\n");
+		return (EIO);
+	}
+
+	NANDSIM_TRACE(chip->sim, "NANDSIM: nandsim_erase_block: "
+	    "Erasing offset %X\n", (unsigned int)offset);
+
+	err = nandsim_array_erase(chip, block);
+	/* The data register may have held a page from the block */
+	chip->data_offset = -1;
+	nandsim_start_busy(chip, chip->sim->timing.t_erase, -1);
+
+	return (err);
+}
+
+static int
+nandsim_select(nand_device_t ndev, int enable)
+{
+	struct nandsim *sim;
+
+	sim = NANDSIM(ndev);
+	if (ndev->ndev_lun >= sim->luns)
+		return (ENXIO);
+
+	if (enable)
+		sim->lun = ndev->ndev_lun;
+
+	return (0);
+}
+
 /* TODO: Set the in* state correctly before returning from the functions */
 static int
 nandsim_command(nand_device_t ndev, uint8_t cmd)
 {
+	struct nandsim *sim;
+	struct nandsim_chip *chip;
+	int err;
+
+	sim = NANDSIM(ndev);
+	chip = &sim->chips[sim->lun];
+	nandsim_bus(sim, 1);
+
 	/* Some commands may be sent with the LUN in any state */
 	switch(cmd) {
 	case NAND_CMD_RESET:
-		printf("NANDSIM: nandsim_command: Reset chip\n");
-		RESET_STATE();
+		NANDSIM_TRACE(sim, "NANDSIM: nandsim_command: Reset chip\n");
+		mtx_lock(&sim->mtx);
+		callout_stop(&chip->busy_callout);
+		chip->ready_at = chip->cache_ready_at = 0;
+		mtx_unlock(&sim->mtx);
+		RESET_STATE(chip);
+		chip->reg_valid = 0;
+		chip->data_offset = -1;
 		return (0);
 
 	case NAND_CMD_READ_STATUS:
-		printf("NANDSIM: nandsim_command: Called read_status\n");
-		nand_chip.read_status = 1;
+		NANDSIM_TRACE(sim,
+		    "NANDSIM: nandsim_command: Called read_status\n");
+		chip->read_status = 1;
 		return (0);
 
+	case NAND_CMD_READ_CACHE_SEQ:
+	case NAND_CMD_READ_CACHE_END:
+		return (nandsim_read_cache(ndev, chip, cmd));
+
 	default:
 		break;
 	}
 
-	if (nand_chip.startcmd != 0) {
+	if (chip->startcmd != 0) {
 		/*
-		 * New command, we have already called RESET_STATE()
-		 * as that is the only way to get here
+		 * New command, the data register
+		 * is left alone for a later read
 		 */
-		nand_chip.startcmd = 0;
-		nand_chip.incmd = 1;
+		RESET_STATE(chip);
+		chip->startcmd = 0;
+		chip->incmd = 1;
 	}
 
 	/* Check if we are not able to handle a command */
-	if (nand_chip.incmd == 0) {
+	if (chip->incmd == 0) {
 		printf("NANDSIM: nandsim_command: "
 		    "Got a command when we were not expecting it: 0x%X\n", cmd);
-		RESET_STATE();
+		RESET_STATE(chip);
 		return (EIO);
 	}
 
 	/* Store the commnad */
-	switch(nand_chip.cmd_len) {
+	switch(chip->cmd_len) {
 	case 0:
 	case 1:
-		nand_chip.cmd[nand_chip.cmd_len] = cmd;
-		nand_chip.cmd_len++;
+		chip->cmd[chip->cmd_len] = cmd;
+		chip->cmd_len++;
 		break;
 	default:
 		printf("NANDSIM: nandsim_command: "
 		    "Attempting to write too many commands\n");
-		RESET_STATE();
+		RESET_STATE(chip);
 		return (EIO);
 	}
 
-	CLEAR_IN_STATE();
+	CLEAR_IN_STATE(chip);
 
 	/* Which command are we in */
-	switch (nand_chip.cmd[0]) {
+	switch (chip->cmd[0]) {
 	case NAND_CMD_PROGRAM:
-		switch (nand_chip.cmd_len) {
+		switch (chip->cmd_len) {
 		case 1:
 			/* We can send the address now */
-			nand_chip.incmd = 0;
-			nand_chip.inaddr = 1;
-			nand_chip.inread = 0;
-			nand_chip.inwrite = 0;
+			chip->incmd = 0;
+			chip->inaddr = 1;
+			chip->inread = 0;
+			chip->inwrite = 0;
 			break;
 		case 2:
 			/* We have finished the program sysle */
-			RESET_STATE();
-			if (nand_chip.cmd[1] != NAND_CMD_PROGRAM_END) {
+			if (chip->cmd[1] != NAND_CMD_PROGRAM_END &&
+			    (chip->cmd[1] != NAND_CMD_PROGRAM_CACHE ||
+			    !chip->cache_cmds)) {
 				printf("NANDSIM: nandsim_command: "
 				    "Unknown command after NAND_CMD_PROGRAM\n");
+				RESET_STATE(chip);
 				return (EIO);
 			}
+			err = nandsim_program_page(ndev, chip,
+			    chip->cmd[1] == NAND_CMD_PROGRAM_CACHE);
+			RESET_STATE(chip);
+			if (err != 0)
+				return (err);
 			break;
 		}
 		break;
 
 	case NAND_CMD_READ:
-		switch (nand_chip.cmd_len) {
+		switch (chip->cmd_len) {
 		case 1:
-			/* We can send the address now */
-			nand_chip.incmd = 0;
-			nand_chip.inaddr = 1;
-			nand_chip.inread = 0;
-			nand_chip.inwrite = 0;
+			/*
+			 * We can send the address now. If there is a
+			 * page in the cache register we may also go back
+			 * to reading it, eg. after reading the status,
+			 * and then start a new command.
+			 */
+			chip->startcmd = chip->reg_valid;
+			chip->incmd = 0;
+			chip->inaddr = 1;
+			chip->inread = chip->reg_valid;
+			chip->inwrite = 0;
 			break;
 		case 2:
-			if (nand_chip.cmd[1] != NAND_CMD_READ_START) {
+			if (chip->cmd[1] != NAND_CMD_READ_START) {
 				printf("NANDSIM: nandsim_command: "
 				    "Unknown command after NAND_CMD_READ\n");
-				RESET_STATE();
+				RESET_STATE(chip);
 				return (EIO);
 			}
-			if (!nand_chip.read_start) {
+			if (!chip->read_start ||
+			    chip->address_len != nandsim_addr_cycles(ndev, chip)) {
 				printf("NANDSIM: nandsim_command: "
 				    "Received NAND_CMD_READ_START when we "
 				    "didn't expect it\n");
-				RESET_STATE();
+				RESET_STATE(chip);
 				return (EIO);
 			}
-			nand_chip.incmd = 0;
-			nand_chip.inaddr = 0;
-			nand_chip.inread = 1;
-			nand_chip.inwrite = 0;
+			err = nandsim_load_page(ndev, chip);
+			if (err != 0) {
+				RESET_STATE(chip);
+				return (err);
+			}
+			chip->startcmd = 1;
+			chip->incmd = 1;
+			chip->inaddr = 0;
+			chip->inread = 1;
+			chip->inwrite = 0;
 			break;
 		}
 		break;
 
 	case NAND_CMD_ERASE:
-		switch (nand_chip.cmd_len) {
+		switch (chip->cmd_len) {
 		case 1:
 			/* We can send the address now */
-			nand_chip.incmd = 0;
-			nand_chip.inaddr = 1;
-			nand_chip.inread = 0;
-			nand_chip.inwrite = 0;
+			chip->incmd = 0;
+			chip->inaddr = 1;
+			chip->inread = 0;
+			chip->inwrite = 0;
 			break;
 		case 2:
-			RESET_STATE();
-			if (nand_chip.cmd[1] != NAND_CMD_ERASE_END) {
+			if (chip->cmd[1] != NAND_CMD_ERASE_END) {
 				printf("NANDSIM: nandsim_command: "
 				    "Unknown command after NAND_CMD_ERASE\n");
+				RESET_STATE(chip);
 				return (EIO);
 			}
+			if (chip->address_len !=
+			    nandsim_addr_cycles(ndev, chip)) {
+				printf("NANDSIM: nandsim_command: "
+				    "NAND_CMD_ERASE_END before the address\n");
+				RESET_STATE(chip);
+				return (EIO);
+			}
+			err = nandsim_erase_block(ndev, chip);
+			RESET_STATE(chip);
+			if (err != 0)
+				return (err);
 			break;
 		}
 		break;
 
 	case NAND_CMD_READID:
 		/* If we are reading the manifest ID we can move to read */
-		if (nand_chip.cmd_len > 1) {
+		if (chip->cmd_len > 1) {
 			printf("NANDSIM: nandsim_command: "
 			    "NAND_CMD_READID only supports 1 command\n");
-			RESET_STATE();
+			RESET_STATE(chip);
 			return (EIO);
 		}
-		nand_chip.incmd = 0;
-		nand_chip.inaddr = 1;
-		nand_chip.inread = 0;
-		nand_chip.inwrite = 0;
+		chip->incmd = 0;
+		chip->inaddr = 1;
+		chip->inread = 0;
+		chip->inwrite = 0;
 		break;
 
 	default:
 		printf("NANDSIM: nandsim_command: "
 		    "Unknown or unimplemented command\n");
-		RESET_STATE();
+		RESET_STATE(chip);
 		return (EIO);
 	}
 
-	CHECK_STATE();
+	CHECK_STATE(chip);
 
 	return (0);
 }
@@ -295,56 +1200,113 @@ nandsim_command(nand_device_t ndev, uint8_t cmd)
 static int
 nandsim_address(nand_device_t ndev, uint8_t address)
 {
-	if (nand_chip.inaddr == 0) {
+	struct nandsim *sim;
+	struct nandsim_chip *chip;
+	int cycles, err;
+
+	sim = NANDSIM(ndev);
+	chip = &sim->chips[sim->lun];
+	nandsim_bus(sim, 1);
+
+	if (chip->inaddr == 0) {
 		printf("NANDSIM: nandsim_address: "
 		    "Got an address when we were not expecting it\n");
-		RESET_STATE();
+		RESET_STATE(chip);
 		return (EIO);
 	}
 
-	CLEAR_IN_STATE();
+	CLEAR_IN_STATE(chip);
+	chip->startcmd = 0;
 
 	/* The address is too long */
-	if (nand_chip.address_len == 4) {
+	cycles = nandsim_addr_cycles(ndev, chip);
+	if (chip->address_len == cycles) {
 		printf("NANDSIM: nandsim_address: Address too long\n");
-		RESET_STATE();
+		RESET_STATE(chip);
 		return (EIO);
 	}
 
-	switch (nand_chip.cmd[0]) {
+	chip->address |= (uint64_t)address << (8 * chip->address_len);
+	chip->address_len++;
+
+	switch (chip->cmd[0]) {
 	case NAND_CMD_READID:
-		nand_chip.incmd = 0;
-		nand_chip.inaddr = 0;
-		nand_chip.inread = 1;
-		nand_chip.inwrite = 0;
+		chip->incmd = 0;
+		chip->inaddr = 0;
+		chip->inread = 1;
+		chip->inwrite = 0;
 		break;
 
 	case NAND_CMD_READ:
-		nand_chip.incmd = 0;
-		nand_chip.inaddr = 1;
-		nand_chip.inread = 1;
-		nand_chip.inwrite = 0;
+		chip->incmd = 0;
+		chip->inaddr = 1;
+		chip->inread = 0;
+		chip->inwrite = 0;
+		if (chip->address_len < cycles)
+			break;
+
+		chip->inaddr = 0;
+		if (chip->read_start) {
+			/* Wait for NAND_CMD_READ_START */
+			chip->incmd = 1;
+			break;
+		}
+
+		/* Small page devices start the read with the last cycle */
+		err = nandsim_load_page(ndev, chip);
+		if (err != 0) {
+			RESET_STATE(chip);
+			return (err);
+		}
+		chip->startcmd = 1;
+		chip->incmd = 1;
+		chip->inread = 1;
 		break;
 
 	case NAND_CMD_PROGRAM:
+		chip->incmd = 0;
+		chip->inaddr = 1;
+		chip->inread = 0;
+		chip->inwrite = 0;
+		if (chip->address_len < cycles)
+			break;
+
+		/* Clear the data register ready for the data */
+		if (nandsim_page_offset(ndev, chip, &chip->col) < 0) {
+			RESET_STATE(chip);
+			return (EIO);
+		}
+		memset(chip->cache_reg, 0xFF, PAGE_REG_SIZE(ndev));
+		chip->reg_valid = 0;
+		chip->data_offset = -1;
+
 		/* We can enter the end command */
-		nand_chip.incmd = 1;
-		nand_chip.inaddr = 1;
-		nand_chip.inread = 0;
-		nand_chip.inwrite = 1;
+		chip->incmd = 1;
+		chip->inaddr = 0;
+		chip->inwrite = 1;
+		break;
+
+	case NAND_CMD_ERASE:
+		chip->incmd = 0;
+		chip->inaddr = 1;
+		chip->inread = 0;
+		chip->inwrite = 0;
+		if (chip->address_len < cycles)
+			break;
+
+		/* Wait for NAND_CMD_ERASE_END */
+		chip->incmd = 1;
+		chip->inaddr = 0;
 		break;
 
 	default:
 		printf("NANDSIM: nandsim_address: "
 		    "Invalid command when writing the address\n");
-		RESET_STATE();
+		RESET_STATE(chip);
 		return (EIO);
 	}
 
-	nand_chip.address |= address << (8 * nand_chip.address_len);
-	nand_chip.address_len++;
-
-	CHECK_STATE();
+	CHECK_STATE(chip);
 
 	return (0);
 }
@@ -352,66 +1314,70 @@ nandsim_address(nand_device_t ndev, uint8_t address)
 static int
 nandsim_read(nand_device_t ndev, size_t len, uint8_t *data)
 {
-	off_t real_address;
+	struct nandsim *sim;
+	struct nandsim_chip *chip;
 	int i;
 
+	sim = NANDSIM(ndev);
+	chip = &sim->chips[sim->lun];
+	nandsim_bus(sim, len * ndev->ndev_cell_size / NBBY);
+
 	/*
 	 * We are attempring to read the status,
 	 * don't touch the state except on failure
 	 */
-	if (nand_chip.read_status != 0) {
+	if (chip->read_status != 0) {
 		if (len != 1) {
-			RESET_STATE();
+			RESET_STATE(chip);
 			return (EIO);
 		}
 
-		nand_chip.read_status = 0;
-		data[0] = NAND_STATUS_WP;
-		if (nand_chip.incmd == 0 && nand_chip.inaddr == 0 &&
-		    nand_chip.inread == 0 && nand_chip.inwrite == 0)
-			data[0] |= NAND_STATUS_RDY | NAND_STATUS_ARDY;
+		chip->read_status = 0;
+		mtx_lock(&sim->mtx);
+		data[0] = NAND_STATUS_WP | nandsim_ready_status(chip);
+		mtx_unlock(&sim->mtx);
 
 		return (0);
 	}
 
-	if (nand_chip.inread == 0) {
+	if (chip->inread == 0) {
 		printf("NANDSIM: nandsim_read: "
 		    "Attempting to read when we can't read\n");
-		RESET_STATE();
+		RESET_STATE(chip);
 		return (EIO);
 	}
 
-	CLEAR_IN_STATE();
-
-	switch(nand_chip.cmd[0]) {
+	switch(chip->cmd[0]) {
 	case NAND_CMD_READID:
-		switch(nand_chip.address) {
+		CLEAR_IN_STATE(chip);
+		switch(chip->address) {
 		case NAND_READID_MANFID:
 			/* Read the Manufacturer ID */
-			if (nand_chip.data_pos > 1) {
+			if (chip->data_pos > 1) {
 				printf("NANDSIM: nandsim_read: "
 				    "Too much data have already been read\n");
-				RESET_STATE();
+				RESET_STATE(chip);
 				return (EIO);
 			} else if (len > 0) {
-				if (nand_chip.data_pos == 0) {
-					data[0] = nand_chip.manuf;
+				if (chip->data_pos == 0) {
+					data[0] = chip->manuf;
 					if (len > 1)
-						data[1] = nand_chip.device;
-				} else if (nand_chip.data_pos == 1)
-					data[0] = nand_chip.device;
+						data[1] = chip->device;
+				} else if (chip->data_pos == 1)
+					data[0] = chip->device;
 
-				printf("NANDSIM: nandsim_read: Read chip ID (");
+				NANDSIM_TRACE(sim, "NANDSIM: nandsim_read: "
+				    "Read chip ID (");
 				for (i = 0; i < len; i++) {
-					printf("%.2X", data[i]);
+					NANDSIM_TRACE(sim, "%.2X", data[i]);
 					if (i != len - 1)
-						printf(" ");
+						NANDSIM_TRACE(sim, " ");
 				}
-				printf(")\n");
+				NANDSIM_TRACE(sim, ")\n");
 			} else {
 				printf("NANDSIM: nandsim_read: "
 				    "Read chip ID length too short\n");
-				RESET_STATE();
+				RESET_STATE(chip);
 				return (EIO);
 			}
 			break;
@@ -419,51 +1385,52 @@ nandsim_read(nand_device_t ndev, size_t len, uint8_t *data)
 		default:
 			printf("NANDSIM: nandsim_read: "
 			    "Unknown or unimplemented address %X "
-			    "after NAND_READID_MANFID\n", nand_chip.address);
-			RESET_STATE();
+			    "after NAND_READID_MANFID\n",
+			    (unsigned int)chip->address);
+			RESET_STATE(chip);
 			return (EIO);
 		}
-		RESET_STATE();
-		nand_chip.inread = 1;
+		RESET_STATE(chip);
+		chip->inread = 1;
+		chip->data_pos += len;
 		break;
 
 	case NAND_CMD_READ:
 		switch(ndev->ndev_cell_size) {
 		case 8:
 		case 16:
-			printf("NANDSIM: nandsim_read: Read page %X\n",
-			    nand_chip.address);
-
-			/* Copy the data to NAND */
-			GET_OFFSET(real_address, len);
-			printf("NANDSIM: nandsim_read: Reading offset %X\n",
-			    (unsigned int)real_address);
-
 			/* The length is in terms of ndev->ndi_cell_size bits */
 			len = len * ndev->ndev_cell_size / 8;
-			memcpy(data, &nand_chip.data[real_address], len);
+			if (!chip->reg_valid ||
+			    chip->col + len > PAGE_REG_SIZE(ndev)) {
+				printf("NANDSIM: nandsim_read: "
+				    "Attempt to read past the end of the page\n");
+				RESET_STATE(chip);
+				return (EIO);
+			}
+
+			/* Copy the data from the cache register */
+			memcpy(data, &chip->cache_reg[chip->col], len);
+			chip->col += len;
 			break;
 		default:
 			printf("NANDSIM: nandsim_read: Unknown bus width %d\n",
 			    ndev->ndev_cell_size);
-			RESET_STATE();
+			RESET_STATE(chip);
 			return (EIO);
 		}
-
-		RESET_STATE();
 		break;
 
 	default:
 		printf("NANDSIM: nandsim_read: Unknown command:");
-		for (i = 0; i < nand_chip.cmd_len; i++)
-			printf(" %.2X", nand_chip.cmd[i]);
+		for (i = 0; i < chip->cmd_len; i++)
+			printf(" %.2X", chip->cmd[i]);
 		printf("\n");
-		RESET_STATE();
+		RESET_STATE(chip);
 		return (EIO);
 	}
-	nand_chip.data_pos += len;
 
-	CHECK_STATE();
+	CHECK_STATE(chip);
 
 	return (0);
 }
@@ -480,112 +1447,904 @@ nandsim_read_8(nand_device_t ndev, uint8_t *data)
 static int
 nandsim_write(nand_device_t ndev, size_t len, uint8_t *data)
 {
-	off_t real_address;
+	struct nandsim *sim;
+	struct nandsim_chip *chip;
 	int i;
 
-	CLEAR_IN_STATE();
+	sim = NANDSIM(ndev);
+	chip = &sim->chips[sim->lun];
+	nandsim_bus(sim, len * ndev->ndev_cell_size / NBBY);
 
-	if (nand_chip.inwrite == 0) {
-		printf("NANDSIM: nandsim_read: "
+	if (chip->inwrite == 0) {
+		printf("NANDSIM: nandsim_write: "
 		    "Attempting to write when we can't write\n");
-		RESET_STATE();
+		RESET_STATE(chip);
 		return (EIO);
 	}
 
-	switch (nand_chip.cmd[0]) {
+	switch (chip->cmd[0]) {
 	case NAND_CMD_PROGRAM:
 		switch(ndev->ndev_cell_size) {
 		case 8:
 		case 16:
-			GET_OFFSET(real_address, len);
-			printf("NANDSIM: nandsim_write: "
-			    "Programming offset %X\n",
-			    (unsigned int)real_address);
-
 			/*
 			 * The length is in terms of ndev->ndev_width bits.
 			 * Adjust the length to be in terms of 8 bits.
 			 */
 			len = len * ndev->ndev_cell_size / 8;
-
-			/*
-			 * Iterate through each byte anding in the new
-			 * data to ensure we only move from 1 -> 0
-			 */
-			for (i = 0; i < len; i++) {
-				nand_chip.data[real_address + i] &= data[i];
+			if (chip->col + len > PAGE_REG_SIZE(ndev)) {
+				printf("NANDSIM: nandsim_write: "
+				    "Attempt to write past the end of the "
+				    "page\n");
+				RESET_STATE(chip);
+				return (EIO);
 			}
-			RESET_STATE();
+
+			/* The array is programmed by NAND_CMD_PROGRAM_END */
+			memcpy(&chip->cache_reg[chip->col], data, len);
+			chip->col += len;
 			break;
 		default:
 			printf("NANDSIM: nandsim_write: "
 			    "Write of unknown bus width %d\n",
 			    ndev->ndev_cell_size);
-			RESET_STATE();
+			RESET_STATE(chip);
 			return (EIO);
 		}
 		break;
 
 	default:
 		printf("NANDSIM: nandsim_write: Unknown command:");
-		for (i = 0; i < nand_chip.cmd_len; i++)
-			printf(" %.2X", nand_chip.cmd[i]);
+		for (i = 0; i < chip->cmd_len; i++)
+			printf(" %.2X", chip->cmd[i]);
 		printf("\n");
-		RESET_STATE();
+		RESET_STATE(chip);
 		return (EIO);
 	}
 
-	CHECK_STATE();
+	CHECK_STATE(chip);
 
 	return (0);
 }
 
 static int
-nandsim_probe(void)
+nandsim_read_rnb(nand_device_t ndev)
 {
-	return nand_probe(&nandsim_dev);
+	struct nandsim *sim;
+	int ready;
+
+	sim = NANDSIM(ndev);
+	mtx_lock(&sim->mtx);
+	ready = !nandsim_cache_busy(&sim->chips[sim->lun]);
+	mtx_unlock(&sim->mtx);
+
+	return (ready);
 }
 
+/*
+ * Sleeps until the interrupt. The callout only runs on a tick so
+ * the last part of the wait is spun to keep shorter times accurate.
+ */
 static int
-nandsim_attach(void)
+nandsim_wait_ready(nand_device_t ndev, int timo)
 {
-	return nand_attach(&nandsim_dev);
+	struct nandsim *sim;
+	struct nandsim_chip *chip;
+	uint64_t left;
+	int err;
+
+	sim = NANDSIM(ndev);
+	chip = &sim->chips[sim->lun];
+	err = 0;
+	mtx_lock(&sim->mtx);
+	while (err == 0 && nandsim_cache_busy(chip)) {
+		left = chip->cache_ready_at - nandsim_now(sim);
+		if (left >= (uint64_t)tick * 1000) {
+			err = msleep(chip, &sim->mtx, PRIBIO, "simrdy", timo);
+			continue;
+		}
+		mtx_unlock(&sim->mtx);
+		DELAY(howmany(left, 1000));
+		mtx_lock(&sim->mtx);
+	}
+	mtx_unlock(&sim->mtx);
+
+	return (err);
+}
+
+static void
+nandsim_dma_proc(void *arg)
+{
+	struct nandsim *sim;
+	struct nandsim_dma *dma;
+	int err;
+
+	sim = arg;
+	dma = &sim->dma;
+	mtx_lock(&sim->mtx);
+	for (;;) {
+		while (dma->state == NANDSIM_DMA_IDLE ||
+		    dma->state == NANDSIM_DMA_DONE)
+			msleep(dma, &sim->mtx, PRIBIO, "simdma", 0);
+		if (dma->state == NANDSIM_DMA_EXIT)
+			break;
+		mtx_unlock(&sim->mtx);
+
+		if (dma->read)
+			err = nandsim_read(&sim->dev, dma->len, dma->data);
+		else
+			err = nandsim_write(&sim->dev, dma->len, dma->data);
+
+		mtx_lock(&sim->mtx);
+		dma->error = err;
+		dma->state = NANDSIM_DMA_DONE;
+		wakeup(dma);
+	}
+
+	dma->proc = NULL;
+	wakeup(&dma->proc);
+	mtx_unlock(&sim->mtx);
+
+	kproc_exit(0);
 }
 
 static int
-nandsim_detach(void)
+nandsim_dma_start(struct nandsim *sim, size_t len, uint8_t *data, int read)
 {
-	return nand_detach(&nandsim_dev);
+	struct nandsim_dma *dma;
+
+	dma = &sim->dma;
+	mtx_lock(&sim->mtx);
+	if (dma->state != NANDSIM_DMA_IDLE) {
+		mtx_unlock(&sim->mtx);
+		return (EBUSY);
+	}
+	dma->read = read;
+	dma->len = len;
+	dma->data = data;
+	dma->state = NANDSIM_DMA_QUEUED;
+	wakeup(dma);
+	mtx_unlock(&sim->mtx);
+
+	return (0);
 }
 
 static int
-nandsim_load(module_t mod, int what, void *arg)
+nandsim_dma_read(nand_device_t ndev, size_t len, uint8_t *data)
 {
-	switch (what) {
-	case MOD_LOAD:
-		/* Samsung 64MiB chip, eg. K9F1208U0B */
-		nand_chip.manuf = 0xEC;
-		nand_chip.device = 0x76;
-		nand_chip.read_start = 0;
-
-		nand_chip.size = (512 + 16) * 32 * 4096;
-		nand_chip.data = malloc(nand_chip.size, M_NANDSIM, M_WAITOK);
-		/* Erase the NAND chip */
-		memset(nand_chip.data, 0xFF, nand_chip.size);
-
-		if (nandsim_probe() != 0) {
-			printf("nandsim: Error in nandsim_probe()\n");
-			return (ENXIO);
+
+	return (nandsim_dma_start(NANDSIM(ndev), len, data, 1));
+}
+
+static int
+nandsim_dma_write(nand_device_t ndev, size_t len, uint8_t *data)
+{
+
+	return (nandsim_dma_start(NANDSIM(ndev), len, data, 0));
+}
+
+static int
+nandsim_dma_wait(nand_device_t ndev)
+{
+	struct nandsim *sim;
+	struct nandsim_dma *dma;
+	int err;
+
+	sim = NANDSIM(ndev);
+	dma = &sim->dma;
+	mtx_lock(&sim->mtx);
+	while (dma->state == NANDSIM_DMA_QUEUED)
+		msleep(dma, &sim->mtx, PRIBIO, "simdmaw", 0);
+	err = dma->error;
+	dma->state = NANDSIM_DMA_IDLE;
+	mtx_unlock(&sim->mtx);
+
+	return (err);
+}
+
+static int
+nandsim_dma_init(struct nandsim *sim)
+{
+	int err;
+
+	sim->dma.state = NANDSIM_DMA_IDLE;
+	err = kproc_create(nandsim_dma_proc, sim, &sim->dma.proc, 0, 0,
+	    "nandsimdma%d", sim->unit);
+	if (err != 0)
+		return (err);
+
+	sim->dri.ndri_dma_read = nandsim_dma_read;
+	sim->dri.ndri_dma_write = nandsim_dma_write;
+	sim->dri.ndri_dma_wait = nandsim_dma_wait;
+
+	return (0);
+}
+
+static void
+nandsim_dma_stop(struct nandsim *sim)
+{
+
+	sim->dri.ndri_dma_read = NULL;
+	sim->dri.ndri_dma_write = NULL;
+	sim->dri.ndri_dma_wait = NULL;
+
+	mtx_lock(&sim->mtx);
+	if (sim->dma.proc != NULL) {
+		sim->dma.state = NANDSIM_DMA_EXIT;
+		wakeup(&sim->dma);
+		while (sim->dma.proc != NULL)
+			msleep(&sim->dma.proc, &sim->mtx, PRIBIO,
+			    "simdmax", 0);
+	}
+	mtx_unlock(&sim->mtx);
+}
+
+/*
+ * The page operations work on the array directly, like a controller
+ * running the whole command sequence itself.
+ */
+static off_t
+nandsim_op_offset(nand_device_t ndev, struct nandsim_chip *chip, off_t page,
+    off_t size)
+{
+	off_t offset;
+
+	offset = page * PAGE_REG_SIZE(ndev);
+	if (page < 0 || offset + size > chip->size) {
+		printf("NANDSIM: Attempt to access past end of data\n");
+		return (-1);
+	}
+	return (offset);
+}
+
+/*
+ * Keeps the chip busy for usec and waits it out. With no time to spend
+ * there is nothing to wait for as the operations before waited too.
+ */
+static void
+nandsim_page_busy(nand_device_t ndev, struct nandsim_chip *chip, int usec)
+{
+
+	if (usec == 0)
+		return;
+	nandsim_start_busy(chip, usec, -1);
+	nandsim_wait_ready(ndev, 0);
+}
+
+static int
+nandsim_page_read(nand_device_t ndev, off_t page, uint8_t *data,
+    uint8_t *oob)
+{
+	struct nandsim *sim;
+	struct nandsim_chip *chip;
+	off_t offset;
+	int err;
+
+	sim = NANDSIM(ndev);
+	chip = &sim->chips[sim->lun];
+	offset = nandsim_op_offset(ndev, chip, page, PAGE_REG_SIZE(ndev));
+	if (offset < 0)
+		return (EIO);
+
+	/* The page and its spare area come out of the array together */
+	err = nandsim_array_read(chip, offset, chip->data_reg,
+	    PAGE_REG_SIZE(ndev));
+	if (err != 0)
+		return (err);
+	nandsim_disturb(ndev, chip->data_reg);
+	chip->data_offset = offset;
+	nandsim_page_busy(ndev, chip, chip->sim->timing.t_read);
+
+	nandsim_bus(sim, PAGE_REG_SIZE(ndev));
+	memcpy(data, chip->data_reg, ndev->ndev_page_size);
+	memcpy(oob, chip->data_reg + ndev->ndev_page_size,
+	    ndev->ndev_spare_size);
+
+	return (0);
+}
+
+static int
+nandsim_page_program(nand_device_t ndev, off_t page, uint8_t *data,
+    uint8_t *oob)
+{
+	struct nandsim *sim;
+	struct nandsim_chip *chip;
+	off_t offset;
+	int err;
+
+	sim = NANDSIM(ndev);
+	chip = &sim->chips[sim->lun];
+	offset = nandsim_op_offset(ndev, chip, page, PAGE_REG_SIZE(ndev));
+	if (offset < 0)
+		return (EIO);
+
+	nandsim_bus(sim, PAGE_REG_SIZE(ndev));
+	memcpy(chip->data_reg, data, ndev->ndev_page_size);
+	memcpy(chip->data_reg + ndev->ndev_page_size, oob,
+	    ndev->ndev_spare_size);
+	chip->data_offset = -1;
+	err = nandsim_array_program(chip, offset, chip->data_reg,
+	    PAGE_REG_SIZE(ndev));
+	nandsim_page_busy(ndev, chip, chip->sim->timing.t_prog);
+
+	return (err);
+}
+
+static int
+nandsim_block_erase(nand_device_t ndev, off_t block)
+{
+	struct nandsim *sim;
+	struct nandsim_chip *chip;
+	int err;
+
+	sim = NANDSIM(ndev);
+	chip = &sim->chips[sim->lun];
+	if (nandsim_op_offset(ndev, chip, block * ndev->ndev_page_cnt,
+	    chip->block_size) < 0)
+		return (EIO);
+
+	err = nandsim_array_erase(chip, block);
+	/* The data register may have held a page from the block */
+	chip->data_offset = -1;
+	nandsim_page_busy(ndev, chip, chip->sim->timing.t_erase);
+
+	return (err);
+}
+
+/*
+ * Runs each instruction straight into the chip emulation, as a
+ * sequencer would without going back to the core between them
+ */
+static int
+nandsim_exec_op(nand_device_t ndev, struct nand_op *op)
+{
+	struct nand_op_instr *noi;
+	int err, i, j;
+
+	err = 0;
+	for (i = 0; i < op->no_cnt && err == 0; i++) {
+		noi = &op->no_instr[i];
+		switch (noi->noi_type) {
+		case NAND_OP_CMD:
+			err = nandsim_command(ndev, noi->noi_cmd);
+			break;
+		case NAND_OP_ADDR:
+			for (j = 0; j < noi->noi_naddr && err == 0; j++)
+				err = nandsim_address(ndev, noi->noi_addr[j]);
+			break;
+		case NAND_OP_DATA_IN:
+			err = nandsim_read(ndev, noi->noi_len, noi->noi_buf);
+			break;
+		case NAND_OP_DATA_OUT:
+			err = nandsim_write(ndev, noi->noi_len, noi->noi_buf);
+			break;
+		case NAND_OP_WAIT_RDY:
+			nandsim_wait_ready(ndev, 0);
+			if (noi->noi_buf == NULL)
+				break;
+			err = nandsim_command(ndev, NAND_CMD_READ_STATUS);
+			if (err == 0)
+				err = nandsim_read_8(ndev, noi->noi_buf);
+			break;
+		default:
+			return (EOPNOTSUPP);
 		}
-		if (nandsim_attach() != 0) {
-			printf("nandsim: Error in nandsim_attach()\n");
-			return (ENXIO);
+	}
+
+	return (err);
+}
+
+/*
+ * Describes the part of an instance with a geometry of its own. The
+ * core waits on it for the times nandsim has been given. The part is
+ * matched on the IDs the chip gave, which are left as they are.
+ */
+static int
+nandsim_device_info(nand_device_t ndev, struct nand_device_info *ndi)
+{
+	struct nand_device_info info;
+	struct nandsim *sim;
+
+	sim = NANDSIM(ndev);
+	if (ndev->ndev_manf_id != sim->info.ndi_manf_id ||
+	    ndev->ndev_dev_id != sim->info.ndi_dev_id)
+		return (ENODEV);
+	info = sim->info;
+	info.ndi_manf_id = ndi->ndi_manf_id;
+	info.ndi_dev_id = ndi->ndi_dev_id;
+	*ndi = info;
+	return (0);
+}
+
+static void
+nandsim_timing_info(struct nandsim *sim, struct nand_timing *nt, int usec)
+{
+	int jitter;
+
+	jitter = MIN(MAX(sim->timing.jitter, 0), 100);
+	nt->nt_typ = usec;
+	nt->nt_max = usec + usec * jitter / 100;
+}
+
+/*
+ * Fetches an int tunable of the instance, hw.nandsim.<unit>.<name>
+ */
+static int
+nandsim_tunable(struct nandsim *sim, const char *name, int val)
+{
+	char tunable[32];
+
+	snprintf(tunable, sizeof(tunable), "hw.nandsim.%d.%s", sim->unit,
+	    name);
+	TUNABLE_INT_FETCH(tunable, &val);
+	return (val);
+}
+
+/*
+ * Fetches the timing and the features of the instance
+ */
+static void
+nandsim_tunables(struct nandsim *sim)
+{
+	struct nandsim_timing *t;
+	int busy;
+
+	t = &sim->timing;
+	busy = nandsim_tunable(sim, "busy", nandsim_busy);
+	t->t_read = nandsim_tunable(sim, "t_read", nandsim_timing.t_read);
+	if (t->t_read < 0)
+		t->t_read = busy;
+	t->t_prog = nandsim_tunable(sim, "t_prog", nandsim_timing.t_prog);
+	if (t->t_prog < 0)
+		t->t_prog = busy;
+	t->t_erase = nandsim_tunable(sim, "t_erase", nandsim_timing.t_erase);
+	if (t->t_erase < 0)
+		t->t_erase = busy;
+	t->t_rcbsy = nandsim_tunable(sim, "t_rcbsy", nandsim_timing.t_rcbsy);
+	if (t->t_rcbsy < 0)
+		t->t_rcbsy = MIN(busy, 3);
+	t->jitter = nandsim_tunable(sim, "jitter", nandsim_timing.jitter);
+	t->bus_ns = nandsim_tunable(sim, "bus_ns", nandsim_timing.bus_ns);
+	t->virtual = nandsim_tunable(sim, "virtual_clock",
+	    nandsim_timing.virtual);
+
+	sim->ecc = nandsim_tunable(sim, "ecc", nandsim_ecc);
+	sim->bitflips = nandsim_tunable(sim, "bitflips", nandsim_bitflips);
+	sim->bitflip_bits = nandsim_tunable(sim, "bitflip_bits",
+	    nandsim_bitflip_bits);
+	sim->bad_blocks = nandsim_tunable(sim, "bad_blocks",
+	    nandsim_bad_blocks);
+	sim->debug = nandsim_tunable(sim, "debug", nandsim_debug);
+}
+
+/*
+ * Works out the part the instance simulates, one from nandsim_parts
+ * with any of its geometry replaced
+ */
+static int
+nandsim_part(struct nandsim *sim)
+{
+	const struct nandsim_part *part;
+	struct nand_device_info *ndi;
+	uint64_t rows;
+	int device;
+
+	device = nandsim_tunable(sim, "device", nandsim_device);
+	for (part = nandsim_parts; part->page_size != 0; part++)
+		if (part->device == device)
+			break;
+	if (part->page_size == 0) {
+		printf("nandsim%d: Unable to emulate device 0x%x\n",
+		    sim->unit, device);
+		return (EINVAL);
+	}
+
+	ndi = &sim->info;
+	ndi->ndi_manf_id = part->manuf;
+	ndi->ndi_dev_id = part->device;
+	ndi->ndi_page_size = nandsim_tunable(sim, "page_size",
+	    nandsim_page_size);
+	ndi->ndi_spare_size = nandsim_tunable(sim, "spare_size",
+	    nandsim_spare_size);
+	ndi->ndi_page_cnt = nandsim_tunable(sim, "pages", nandsim_pages);
+	ndi->ndi_block_cnt = nandsim_tunable(sim, "blocks", nandsim_blocks);
+	if (ndi->ndi_page_size == 0)
+		ndi->ndi_page_size = part->page_size;
+	if (ndi->ndi_spare_size == 0)
+		ndi->ndi_spare_size = part->spare_size;
+	if (ndi->ndi_page_cnt == 0)
+		ndi->ndi_page_cnt = part->page_cnt;
+	if (ndi->ndi_block_cnt == 0)
+		ndi->ndi_block_cnt = part->block_cnt;
+	ndi->ndi_read_start = part->read_start;
+	if (ndi->ndi_page_size == part->page_size &&
+	    ndi->ndi_spare_size == part->spare_size &&
+	    ndi->ndi_page_cnt == part->page_cnt &&
+	    ndi->ndi_block_cnt == part->block_cnt)
+		return (0);
+
+	/*
+	 * The marker and the FTL's tag are at the start of the spare
+	 * area and the bad block table is kept in the last blocks
+	 */
+	rows = (uint64_t)ndi->ndi_page_cnt * ndi->ndi_block_cnt;
+	if (!powerof2(ndi->ndi_page_size) || ndi->ndi_page_size < 512 ||
+	    ndi->ndi_page_size > 16384 ||
+	    ndi->ndi_spare_size < NAND_TAG_OFFSET + NAND_TAG_SIZE ||
+	    ndi->ndi_spare_size > ndi->ndi_page_size ||
+	    ndi->ndi_page_cnt == 0 || ndi->ndi_page_cnt > 1024 ||
+	    ndi->ndi_block_cnt <= NAND_BBT_BLOCKS || rows > UINT32_MAX) {
+		printf("nandsim%d: Unable to emulate %u+%u byte pages, "
+		    "%u pages a block, %u blocks\n", sim->unit,
+		    ndi->ndi_page_size, ndi->ndi_spare_size,
+		    ndi->ndi_page_cnt, ndi->ndi_block_cnt);
+		return (EINVAL);
+	}
+
+	/* Pages over 512 bytes use the large page commands */
+	ndi->ndi_manf_id = NANDSIM_MANF_CUSTOM;
+	ndi->ndi_dev_id = NANDSIM_DEV_CUSTOM;
+	ndi->ndi_lun_cnt = 1;
+	ndi->ndi_cell_size = 8;
+	ndi->ndi_column_cycles = (ndi->ndi_page_size > 512) ? 2 : 1;
+	for (ndi->ndi_row_cycles = 1;
+	    rows > (1ULL << (8 * ndi->ndi_row_cycles)); ndi->ndi_row_cycles++)
+		continue;
+	ndi->ndi_read_start = (ndi->ndi_page_size > 512);
+	ndi->ndi_options = 0;
+	if (ndi->ndi_page_size > 512)
+		ndi->ndi_options = NAND_OPT_CACHE_PROGRAM | NAND_OPT_CACHE_READ;
+	nandsim_timing_info(sim, &ndi->ndi_timing[NAND_WAIT_READ],
+	    sim->timing.t_read);
+	nandsim_timing_info(sim, &ndi->ndi_timing[NAND_WAIT_PROGRAM],
+	    sim->timing.t_prog);
+	nandsim_timing_info(sim, &ndi->ndi_timing[NAND_WAIT_ERASE],
+	    sim->timing.t_erase);
+	nandsim_timing_info(sim, &ndi->ndi_timing[NAND_WAIT_RESET], 0);
+	snprintf(sim->name, sizeof(sim->name), "nandsim %u+%u byte pages",
+	    ndi->ndi_page_size, ndi->ndi_spare_size);
+	ndi->ndi_name = sim->name;
+
+	return (0);
+}
+
+/*
+ * Sets up the LUNs of an instance erased or from the image
+ */
+static int
+nandsim_chips_init(struct nandsim *sim)
+{
+	struct nand_device_info *ndi;
+	struct nandsim_chip *chip;
+	const uint8_t zero = 0;
+	size_t reg_size;
+	off_t block;
+	int i, lun;
+
+	ndi = &sim->info;
+	reg_size = ndi->ndi_page_size + ndi->ndi_spare_size;
+	for (lun = 0; lun < sim->luns; lun++) {
+		chip = &sim->chips[lun];
+		RESET_STATE(chip);
+		chip->manuf = ndi->ndi_manf_id;
+		chip->device = ndi->ndi_dev_id;
+		chip->read_start = ndi->ndi_read_start;
+		/* Large page parts have the cache commands */
+		chip->cache_cmds = (ndi->ndi_page_size > 512);
+
+		/* The chip starts erased with no memory behind it */
+		chip->block_size = reg_size * ndi->ndi_page_cnt;
+		chip->size = chip->block_size * ndi->ndi_block_cnt;
+		chip->blocks = malloc(ndi->ndi_block_cnt *
+		    sizeof(*chip->blocks), M_NANDSIM, M_WAITOK | M_ZERO);
+		chip->image_offset = sim->capacity;
+		sim->capacity += chip->size;
+		if (sim->image[0] != '\0') {
+			chip->erased = malloc(howmany(ndi->ndi_block_cnt,
+			    NBBY), M_NANDSIM, M_WAITOK | M_ZERO);
+			chip->image_buf = malloc(chip->block_size, M_NANDSIM,
+			    M_WAITOK);
 		}
+
+		/*
+		 * Spread the bad blocks over the chip. Their marker
+		 * is in the spare area of the first page. An image
+		 * has its own bad blocks.
+		 */
+		for (i = 0; i < sim->bad_blocks && sim->image[0] == '\0';
+		    i++) {
+			block = ((off_t)i + 1) * ndi->ndi_block_cnt /
+			    (sim->bad_blocks + 1) + lun;
+			if (block >= ndi->ndi_block_cnt)
+				continue;
+			nandsim_array_program(chip,
+			    block * chip->block_size + ndi->ndi_page_size +
+			    (ndi->ndi_page_size > 512 ?
+			    NAND_BBM_LARGE_OFFSET : NAND_BBM_SMALL_OFFSET),
+			    &zero, 1);
+		}
+
+		chip->cache_reg = malloc(reg_size, M_NANDSIM, M_WAITOK);
+		chip->data_reg = malloc(reg_size, M_NANDSIM, M_WAITOK);
+		chip->reg_valid = 0;
+		chip->data_offset = -1;
+		chip->ready_at = chip->cache_ready_at = 0;
+	}
+
+	if (sim->image[0] == '\0')
 		return (0);
+	return (nandsim_image_open(sim));
+}
+
+static int
+nandsim_attach(struct nandsim *sim)
+{
+	int err;
+
+	err = nand_probe(&sim->dev);
+	if (err != 0) {
+		printf("nandsim%d: Error in nand_probe()\n", sim->unit);
+		return (ENXIO);
+	}
+
+	/* There is no ECC generator so use the software ECC */
+	if (sim->ecc > 0) {
+		sim->dev.ndev_ecc = nand_ecc_layout(&sim->dev, sim->ecc);
+		if (sim->dev.ndev_ecc == NULL) {
+			printf("nandsim%d: No ECC layout for the part\n",
+			    sim->unit);
+			return (EINVAL);
+		}
+	}
+
+	err = nand_attach(&sim->dev);
+	if (err != 0) {
+		printf("nandsim%d: Error in nand_attach()\n", sim->unit);
+		return (ENXIO);
+	}
+	sim->attached = 1;
+	return (0);
+}
+
+/*
+ * Detaches the NAND device and attaches it again with the arrays as
+ * they are, as a reboot would. It comes back as a new NAND unit.
+ */
+static int
+nandsim_reattach_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct nandsim *sim;
+	int err, val;
+
+	sim = arg1;
+	val = 0;
+	err = sysctl_handle_int(oidp, &val, 0, req);
+	if (err != 0 || req->newptr == NULL || val == 0)
+		return (err);
+
+	if (sim->attached) {
+		nand_detach(&sim->dev);
+		sim->attached = 0;
+	}
+	nand_ecc_layout_free(sim->dev.ndev_ecc);
+	sim->dev.ndev_ecc = NULL;
+	return (nandsim_attach(sim));
+}
+
+static void
+nandsim_sysctl_init(struct nandsim *sim)
+{
+	struct sysctl_oid_list *children;
+	struct sysctl_oid *tree;
+	char name[8];
+
+	snprintf(name, sizeof(name), "%d", sim->unit);
+	tree = SYSCTL_ADD_NODE(&sim->sysctl_ctx,
+	    SYSCTL_STATIC_CHILDREN(_hw_nandsim), OID_AUTO, name, CTLFLAG_RD,
+	    0, "Simulated device");
+	children = SYSCTL_CHILDREN(tree);
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "nand_unit",
+	    CTLFLAG_RD, &sim->dev.ndev_unit, 0, "Unit of the NAND device");
+	SYSCTL_ADD_PROC(&sim->sysctl_ctx, children, OID_AUTO, "clock",
+	    CTLTYPE_U64 | CTLFLAG_RD, sim, 0, nandsim_clock_sysctl, "QU",
+	    "Nanoseconds on the simulator clock");
+	SYSCTL_ADD_PROC(&sim->sysctl_ctx, children, OID_AUTO, "reattach",
+	    CTLTYPE_INT | CTLFLAG_RW, sim, 0, nandsim_reattach_sysctl, "I",
+	    "Set to detach the NAND device and attach it again");
+	SYSCTL_ADD_UQUAD(&sim->sysctl_ctx, children, OID_AUTO, "capacity",
+	    CTLFLAG_RD, &sim->capacity,
+	    "Bytes simulated, including the spare area");
+	SYSCTL_ADD_UQUAD(&sim->sysctl_ctx, children, OID_AUTO, "resident",
+	    CTLFLAG_RD, &sim->resident,
+	    "Bytes of memory holding programmed blocks");
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "t_read",
+	    CTLFLAG_RW, &sim->timing.t_read, 0,
+	    "Microseconds to read a page");
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "t_prog",
+	    CTLFLAG_RW, &sim->timing.t_prog, 0,
+	    "Microseconds to program a page");
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "t_erase",
+	    CTLFLAG_RW, &sim->timing.t_erase, 0,
+	    "Microseconds to erase a block");
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "t_rcbsy",
+	    CTLFLAG_RW, &sim->timing.t_rcbsy, 0,
+	    "Microseconds the cache register is busy after a cache command");
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "jitter",
+	    CTLFLAG_RW, &sim->timing.jitter, 0,
+	    "Percent the array times vary by");
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "bus_ns",
+	    CTLFLAG_RW, &sim->timing.bus_ns, 0,
+	    "Nanoseconds to move a byte over the bus");
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "virtual_clock",
+	    CTLFLAG_RD, &sim->timing.virtual, 0,
+	    "Time is simulated rather than spent");
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "bitflips",
+	    CTLFLAG_RW, &sim->bitflips, 0,
+	    "Reads per bitflip_bits bits flipped, 0 for none");
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "bitflip_bits",
+	    CTLFLAG_RW, &sim->bitflip_bits, 0,
+	    "Bits flipped by a read disturb");
+	SYSCTL_ADD_INT(&sim->sysctl_ctx, children, OID_AUTO, "debug",
+	    CTLFLAG_RW, &sim->debug, 0, "Trace the commands");
+}
+
+static void
+nandsim_destroy(struct nandsim *sim)
+{
+	struct nandsim_chip *chip;
+	off_t block;
+	int lun;
+
+	sysctl_ctx_free(&sim->sysctl_ctx);
+	if (sim->attached)
+		nand_detach(&sim->dev);
+	nand_ecc_layout_free(sim->dev.ndev_ecc);
+	nandsim_dma_stop(sim);
+	for (lun = 0; lun < NAND_MAX_LUN; lun++) {
+		chip = &sim->chips[lun];
+		callout_drain(&chip->busy_callout);
+		if (chip->blocks != NULL) {
+			for (block = 0; block < chip->size / chip->block_size;
+			    block++)
+				nandsim_array_free(chip, block);
+			free(chip->blocks, M_NANDSIM);
+		}
+		free(chip->erased, M_NANDSIM);
+		free(chip->image_buf, M_NANDSIM);
+		free(chip->cache_reg, M_NANDSIM);
+		free(chip->data_reg, M_NANDSIM);
+	}
+	nandsim_image_close(sim);
+	mtx_destroy(&sim->mtx);
+	free(sim, M_NANDSIM);
+}
+
+static int
+nandsim_create(int unit, struct nandsim **simp)
+{
+	struct nandsim *sim;
+	char tunable[32];
+	int err, lun;
+
+	sim = malloc(sizeof(*sim), M_NANDSIM, M_WAITOK | M_ZERO);
+	sim->unit = unit;
+	sim->dri = nandsim_dri;
+	sim->dev.ndev_driver = &sim->dri;
+	sysctl_ctx_init(&sim->sysctl_ctx);
+	mtx_init(&sim->mtx, "nandsim", NULL, MTX_DEF);
+	for (lun = 0; lun < NAND_MAX_LUN; lun++) {
+		sim->chips[lun].sim = sim;
+		callout_init_mtx(&sim->chips[lun].busy_callout, &sim->mtx, 0);
+	}
+
+	nandsim_tunables(sim);
+	sim->luns = nandsim_tunable(sim, "luns", nandsim_luns);
+	if (sim->luns < 1 || sim->luns > NAND_MAX_LUN) {
+		printf("nandsim%d: Invalid number of LUNs %d\n", unit,
+		    sim->luns);
+		err = EINVAL;
+		goto out;
+	}
+	err = nandsim_part(sim);
+	if (err != 0)
+		goto out;
+
+	strlcpy(sim->image, nandsim_image, sizeof(sim->image));
+	snprintf(tunable, sizeof(tunable), "hw.nandsim.%d.image", unit);
+	TUNABLE_STR_FETCH(tunable, sim->image, sizeof(sim->image));
+	sim->image_mode = nandsim_tunable(sim, "image_mode",
+	    nandsim_image_mode);
+	err = nandsim_chips_init(sim);
+	if (err != 0) {
+		printf("nandsim%d: Unable to open the image %s: %d\n", unit,
+		    sim->image, err);
+		goto out;
+	}
+
+	if (nandsim_tunable(sim, "page_ops", nandsim_page_ops)) {
+		sim->dri.ndri_read_page = nandsim_page_read;
+		sim->dri.ndri_program_page = nandsim_page_program;
+		sim->dri.ndri_erase_block = nandsim_block_erase;
+	}
+	if (nandsim_tunable(sim, "exec_op", nandsim_exec_ops))
+		sim->dri.ndri_exec_op = nandsim_exec_op;
+	if (nandsim_tunable(sim, "dma", nandsim_dma_enable) &&
+	    nandsim_dma_init(sim) != 0) {
+		printf("nandsim%d: Unable to start the DMA engine\n", unit);
+		err = ENXIO;
+		goto out;
+	}
+
+	err = nandsim_attach(sim);
+	if (err != 0)
+		goto out;
+	nandsim_sysctl_init(sim);
+
+	*simp = sim;
+	return (0);
+
+out:
+	nandsim_destroy(sim);
+	return (err);
+}
+
+/*
+ * Creates or destroys instances from the end until there are count
+ */
+static int
+nandsim_set_count(int count)
+{
+	int err;
+
+	sx_assert(&nandsim_lock, SA_XLOCKED);
+
+	if (count < 0 || count > NANDSIM_MAX)
+		return (EINVAL);
+	while (nandsim_count > count)
+		nandsim_destroy(nandsim_sims[--nandsim_count]);
+	while (nandsim_count < count) {
+		err = nandsim_create(nandsim_count,
+		    &nandsim_sims[nandsim_count]);
+		if (err != 0)
+			return (err);
+		nandsim_count++;
+	}
+	return (0);
+}
+
+static int
+nandsim_instances_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	int count, err;
+
+	sx_xlock(&nandsim_lock);
+	count = nandsim_count;
+	err = sysctl_handle_int(oidp, &count, 0, req);
+	if (err == 0 && req->newptr != NULL)
+		err = nandsim_set_count(count);
+	sx_xunlock(&nandsim_lock);
+
+	return (err);
+}
+
+static int
+nandsim_load(module_t mod, int what, void *arg)
+{
+	int err;
+
+	switch (what) {
+	case MOD_LOAD:
+		sx_xlock(&nandsim_lock);
+		err = nandsim_set_count(nandsim_instances);
+		if (err != 0)
+			nandsim_set_count(0);
+		sx_xunlock(&nandsim_lock);
+		return (err);
 
 	case MOD_UNLOAD:
-		nandsim_detach();
-		free(nand_chip.data, M_NANDSIM);
+		sx_xlock(&nandsim_lock);
+		nandsim_set_count(0);
+		sx_xunlock(&nandsim_lock);
 		return (0);
 
 	default:
@@ -595,4 +2354,3 @@ nandsim_load(module_t mod, int what, void *arg)
 
 DEV_MODULE(nandsim, nandsim_load, NULL);
 MODULE_DEPEND(nandsim, nand, 1, 1, 1);
-
@@ -32,15 +32,55 @@
 
 struct nand_driver;
 struct nand_device;
+struct nand_device_info;
+struct nand_ftl;
+struct nand_op;
 
 typedef struct nand_driver* nand_driver_t;
 typedef struct nand_device* nand_device_t;
 
+/* The most chip enables we will look for a LUN behind */
+#define	NAND_MAX_LUN	4
+
 /*
  * Used to hold callbacks to the NAND controller.
  * Not all functions need to be implemented.
  * (R) Reqired
  * (O) Optional
+ *
+ * ndri_select should enable the chip for ndev->ndev_lun and return
+ * an error if there is no such LUN.
+ *
+ * ndri_wait_ready should sleep until the ready/busy line shows the chip
+ * is ready, e.g. on an interrupt, or until the timeout in ticks passes.
+ * It returns 0 when the chip is ready or an error when it timed out or
+ * is unable to wait, in which case the chip is polled.
+ *
+ * ndri_dma_read and ndri_dma_write start moving the data of a page
+ * between the chip and the buffer, which is the bio's own, and return
+ * without waiting. ndri_dma_wait sleeps until the transfer is done. The
+ * driver loads the buffer into its own bus_dma map. When the transfer
+ * can't be started an error is returned and the page is moved with
+ * ndri_read/ndri_write instead. They are not used with ndri_calc_ecc.
+ *
+ * ndri_read_page, ndri_program_page and ndri_erase_block run a whole
+ * operation on the selected LUN in one call, including the wait, for
+ * controllers that don't need the core to drive the chip a byte at a
+ * time. They take a page or block number within the LUN and the page
+ * data and spare area. They return EIO when the chip reports the
+ * operation failed. Either all three or none are implemented and they
+ * are not used with ndri_calc_ecc.
+ *
+ * ndri_exec_op runs a whole operation, see struct nand_op, on the
+ * selected LUN for controllers with a sequencer. It returns EOPNOTSUPP
+ * for operations it can't run, which the core then runs itself with
+ * the byte level callbacks. The page data is only part of operations
+ * when the ECC is calculated in software.
+ *
+ * ndri_device_info describes a part that isn't in the driver's table
+ * of IDs, e.g. one the controller simulates, by filling in everything
+ * in the nand_device_info but the IDs. It returns ENODEV for parts it
+ * doesn't know either.
  */
 struct nand_driver {
 	int (*ndri_select)(nand_device_t, int);			/* (O) */
@@ -50,14 +90,68 @@ struct nand_driver {
 	int (*ndri_read_8)(nand_device_t, uint8_t *);		/* (R) */
 	int (*ndri_write)(nand_device_t, size_t, uint8_t *);	/* (R) */
 	int (*ndri_read_rnb)(nand_device_t);			/* (O) */
+	int (*ndri_wait_ready)(nand_device_t, int);		/* (O) */
 	int (*ndri_init_ecc)(nand_device_t);			/* (O) */
 	/*
-	 * ndri_calc_ecc and ndri_fix_data can
-	 * be NULL when ndev->ndev_ecc is NULL
+	 * ndri_calc_ecc and ndri_fix_data can be NULL when
+	 * ndev->ndev_ecc is NULL or to use the software ECC
 	 */
 	int (*ndri_calc_ecc)(nand_device_t, uint8_t *);		/* (O) */
 	int (*ndri_fix_data)(nand_device_t, size_t, uint8_t *, uint8_t *,
 	    uint8_t *);						/* (O) */
+	int (*ndri_dma_read)(nand_device_t, size_t, uint8_t *);	/* (O) */
+	int (*ndri_dma_write)(nand_device_t, size_t, uint8_t *); /* (O) */
+	int (*ndri_dma_wait)(nand_device_t);			/* (O) */
+	int (*ndri_read_page)(nand_device_t, off_t, uint8_t *,
+	    uint8_t *);						/* (O) */
+	int (*ndri_program_page)(nand_device_t, off_t, uint8_t *,
+	    uint8_t *);						/* (O) */
+	int (*ndri_erase_block)(nand_device_t, off_t);		/* (O) */
+	int (*ndri_exec_op)(nand_device_t, struct nand_op *);	/* (O) */
+	int (*ndri_device_info)(nand_device_t,
+	    struct nand_device_info *);				/* (O) */
+};
+
+/*
+ * An operation on the chip as a list of instructions. NAND_OP_WAIT_RDY
+ * waits for the chip to finish an operation of type noi_wait. When
+ * noi_buf is set the status is polled and left in noi_buf[0], otherwise
+ * the ready/busy line is used when there is one.
+ */
+#define	NAND_OP_CMD		0	/* Send noi_cmd */
+#define	NAND_OP_ADDR		1	/* Send noi_naddr bytes of noi_addr */
+#define	NAND_OP_DATA_IN		2	/* Read noi_len bytes to noi_buf */
+#define	NAND_OP_DATA_OUT	3	/* Write noi_len bytes of noi_buf */
+#define	NAND_OP_WAIT_RDY	4
+
+#define	NAND_OP_MAX_ADDR	8
+#define	NAND_OP_MAX_INSTR	8
+
+struct nand_op_instr {
+	int		noi_type;	/* NAND_OP_* */
+	uint8_t		noi_cmd;
+	int		noi_naddr;
+	uint8_t		noi_addr[NAND_OP_MAX_ADDR];
+	size_t		noi_len;
+	uint8_t		*noi_buf;
+	int		noi_wait;	/* NAND_WAIT_* */
+};
+
+struct nand_op {
+	int			no_cnt;
+	struct nand_op_instr	no_instr[NAND_OP_MAX_INSTR];
+};
+
+/* Operations the driver waits on the chip for */
+#define	NAND_WAIT_READ		0	/* tR */
+#define	NAND_WAIT_PROGRAM	1	/* tPROG */
+#define	NAND_WAIT_ERASE		2	/* tBERS */
+#define	NAND_WAIT_RESET		3	/* tRST */
+#define	NAND_WAIT_OPS		4
+
+struct nand_timing {
+	uint32_t	nt_typ;		/* Typical microseconds */
+	uint32_t	nt_max;		/* Maximum microseconds */
 };
 
 struct nand_device_info {
@@ -76,15 +170,83 @@ struct nand_device_info {
 
 	char		ndi_read_start;	/* Do we need to issue a read start */
 	const char	*ndi_name;	/* The name of the device */
+
+	uint32_t	ndi_options;	/* Optional commands supported */
+#define	NAND_OPT_CACHE_PROGRAM	0x0001	/* NAND_CMD_PROGRAM_CACHE */
+#define	NAND_OPT_CACHE_READ	0x0002	/* NAND_CMD_READ_CACHE_* */
+
+	struct nand_timing ndi_timing[NAND_WAIT_OPS];
 };
 
 struct nand_ecc_data {
 	size_t		ecc_size;	/* Total size of the ECC */
 	size_t		ecc_stride;	/* Bytes per ECC block */
 	size_t		ecc_protect;	/* Bytes on NAND per stride */
+	int		ecc_strength;	/* Bits corrected, BCH if over 1 */
+	void		*ecc_priv;	/* Used by the software ECC */
 	off_t		ecc_pos[];	/* ECC location */
 };
 
+/* What we have learnt waiting for one type of operation */
+struct nand_wait {
+	u_int		nw_expect;	/* Expected microseconds to wait */
+	u_long		nw_waits;
+	u_long		nw_slept;	/* Microseconds slept */
+	u_long		nw_polled;	/* Microseconds spent polling */
+};
+
+struct nand_stats {
+	u_long		ns_reads;	/* Pages read */
+	u_long		ns_writes;	/* Pages programmed */
+	u_long		ns_erases;	/* Blocks erased */
+	u_long		ns_interleaved;	/* Started while another LUN busy */
+	u_long		ns_dma;		/* Pages moved by DMA */
+	u_long		ns_cache_hits;	/* Pages read from the read cache */
+	u_long		ns_cache_misses; /* Pages the read cache didn't hold */
+	u_long		ns_ra_pages;	/* Pages read ahead */
+	u_long		ns_ra_hits;	/* Pages read ahead then used */
+	u_long		ns_ecc_corrected; /* Bit errors corrected */
+	u_long		ns_ecc_failed;	/* Uncorrectable ECC blocks */
+	u_long		ns_read_pages;	/* Pages read in timed runs */
+	uint64_t	ns_read_time;	/* Nanoseconds spent on them */
+};
+
+/*
+ * The last NAND_BBT_BLOCKS disk blocks are kept for the bad block
+ * table. It is written to NAND_BBT_COPIES of them, the rest are
+ * spares for when those go bad. They are hidden from the disks.
+ */
+#define	NAND_BBT_BLOCKS	4
+#define	NAND_BBT_COPIES	2
+
+/*
+ * Bytes of the spare area of each page available to the FTL. They
+ * are clear of the bad block marker and the controller ECC bytes.
+ */
+#define	NAND_TAG_OFFSET	8
+#define	NAND_TAG_SIZE	8
+
+/* The default number of pages in the read cache of each device */
+#define	NAND_CACHE_ENTRIES	32
+
+/* The smallest read ahead window and how much is read between requests */
+#define	NAND_RA_MIN	4
+#define	NAND_RA_CHUNK	8
+
+/*
+ * A page held in the read cache. Entries are evicted
+ * with the CLOCK algorithm using nce_ref.
+ */
+struct nand_cache_entry {
+	LIST_ENTRY(nand_cache_entry) nce_hash;
+	off_t		nce_page;	/* The disk page or -1 when unused */
+	int		nce_ref;	/* Used since the hand last passed */
+	int		nce_flags;
+#define	NAND_CACHE_RA	0x0001	/* Read ahead and not yet used */
+	uint8_t		*nce_data;	/* From ndev_cache_zone */
+};
+LIST_HEAD(nand_cache_head, nand_cache_entry);
+
 struct nand_device {
 	/* Set by the NAND controller */
 	nand_driver_t	ndev_driver;
@@ -103,8 +265,20 @@ struct nand_device {
 #define ndev_row_cycles	ndev_info.ndi_row_cycles
 #define ndev_read_start	ndev_info.ndi_read_start
 #define ndev_name	ndev_info.ndi_name
+#define ndev_options	ndev_info.ndi_options
+
+	/*
+	 * The bad block table, one bit for each block of each LUN. Only
+	 * the first ndev_data_blocks disk blocks are used for data.
+	 */
+	uint8_t		*ndev_bbt;
+	uint32_t	ndev_bbt_version; /* Of the copy on the chip */
+	int		ndev_bbt_dirty;	/* Changed since it was written */
+	int		ndev_bad_blocks;
+	uint32_t	ndev_data_blocks;
 
 	uint8_t		*ndev_oob;	/* Used to hold the oob to read/write */
+	uint8_t		*ndev_tag;	/* Tag to write with the next page */
 
 	struct nand_ecc_data *ndev_ecc;	/* The layout of the ECC bytes */
 	uint8_t		*ndev_calc_ecc;	/* The calculated ECC value */
@@ -112,6 +286,45 @@ struct nand_device {
 
 	device_t	ndev_dev;
 	struct disk	*ndev_disk;
+	int		ndev_unit;
+	int		ndev_lun;	/* The currently selected LUN */
+
+	struct nand_stats ndev_stats;
+	struct nand_wait ndev_wait[NAND_WAIT_OPS];
+	struct sysctl_ctx_list ndev_sysctl_ctx;
+	struct sysctl_oid *ndev_sysctl_tree;
+
+	/* Held by the worker and the FTL collector while using the chip */
+	struct sx	ndev_chip_lock;
+
+	/* Requests waiting for the worker thread */
+	struct mtx	ndev_mtx;
+	struct bio_queue_head ndev_bioq;
+	struct proc	*ndev_proc;	/* The worker thread */
+	int		ndev_flags;
+#define	NAND_DEV_DYING	0x0001	/* The worker should exit */
+
+	/* The read cache. Only used from the worker thread. */
+	struct nand_cache_entry *ndev_cache;
+	int		ndev_cache_cnt;	/* Number of entries, 0 to disable */
+	int		ndev_cache_hand; /* The next entry to look at evicting */
+	struct nand_cache_head *ndev_cache_hash;
+	u_long		ndev_cache_mask;
+	uma_zone_t	ndev_cache_zone;
+
+	/* Read ahead of sequential streams. Only used from the worker. */
+	uint8_t		*ndev_ra_buf;	/* NAND_RA_CHUNK pages */
+	off_t		ndev_ra_next;	/* The page after the last read */
+	off_t		ndev_ra_end;	/* The page after the last read ahead */
+	off_t		ndev_ra_last;	/* The number of pages on the disk */
+	int		ndev_ra_seq;	/* The last read was sequential */
+	int		ndev_ra_window;	/* Pages to read ahead */
+	int		ndev_ra_max;	/* Largest window, 0 to disable */
+	int		ndev_ra_used;	/* Used since the window changed */
+
+	/* The FTL, if enabled, and the disk it provides */
+	struct nand_ftl	*ndev_ftl;
+	struct disk	*ndev_ftl_disk;
 };
 
 extern uma_zone_t nand_device_zone;
@@ -136,17 +349,13 @@ do {								\
 #define nand_write(ndev, len, data) \
     ndev->ndev_driver->ndri_write(ndev, len, data)
 #define nand_read_rnb(ndev) ndev->ndev_driver->ndri_read_rnb(ndev)
-#define nand_wait_rnb(ndev)				\
-do {							\
-	if (ndev->ndev_driver->ndri_read_rnb != NULL) {	\
-		int rnb;				\
-		rnb = nand_read_rnb(ndev);		\
-		while (rnb == 0) {			\
-			DELAY(100);			\
-			rnb = nand_read_rnb(ndev);	\
-		}					\
-	}						\
-} while (0)
+
+#define	nand_block_isbad(ndev, lun, block) \
+    isset((ndev)->ndev_bbt, (lun) * (ndev)->ndev_block_cnt + (block))
+/* Is the block on the LUN holding a disk page bad */
+#define	nand_page_isbad(ndev, page) \
+    nand_block_isbad(ndev, (page) % (ndev)->ndev_lun_cnt, \
+    (page) / (ndev)->ndev_lun_cnt / (ndev)->ndev_page_cnt)
 
 #define nand_init_ecc(ndev) 				\
 do {							\
@@ -155,11 +364,39 @@ do {							\
 } while (0)
 #define nand_calc_ecc(ndev, ecc) ndev->ndev_driver->ndri_calc_ecc(ndev, ecc)
 #define nand_fix_data(ndev, len, data, calc_ecc, oob)	\
-	ndev->ndev_driver->ndri_fix_data(ndev, len, data, calc_ecc, oob)
+	(ndev->ndev_driver->ndri_fix_data != NULL ?	\
+	ndev->ndev_driver->ndri_fix_data(ndev, len, data, calc_ecc, oob) : \
+	nand_ecc_fix(ndev, len, data, calc_ecc, oob))
 
 int nand_probe(nand_device_t);
 int nand_attach(nand_device_t);
 int nand_detach(nand_device_t);
 
+/* Page access for the FTL. Pages and blocks are numbered as on the disk. */
+int nand_page_read(nand_device_t, off_t, uint8_t *, uint8_t *);
+int nand_page_program(nand_device_t, off_t, uint8_t *, uint8_t *);
+int nand_block_erase(nand_device_t, off_t);
+int nand_rw_pages(nand_device_t, off_t, int, uint8_t *, int);
+
+/* nand_bbt.c */
+int nand_bbt_attach(nand_device_t);
+void nand_bbt_detach(nand_device_t);
+void nand_bbt_mark(nand_device_t, int, off_t);
+int nand_bbt_sync(nand_device_t);
+int nand_bbt_check(nand_device_t, off_t, int);
+int nand_bbt_disk_bad(nand_device_t, off_t);
+
+/* nand_ecc.c */
+struct nand_ecc_data *nand_ecc_layout(nand_device_t, int);
+void nand_ecc_layout_free(struct nand_ecc_data *);
+void nand_ecc_calc(nand_device_t, const uint8_t *, size_t, uint8_t *);
+int nand_ecc_fix(nand_device_t, size_t, uint8_t *, uint8_t *, uint8_t *);
+
+/* nand_ftl.c */
+int nand_ftl_attach(nand_device_t);
+void nand_ftl_detach(nand_device_t);
+off_t nand_ftl_mediasize(nand_device_t);
+void nand_ftl_io(nand_device_t, struct bio *);
+
 #endif
 
@@ -31,10 +31,16 @@ __FBSDID("$FreeBSD$");
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/systm.h>
+#include <sys/bio.h>
 #include <sys/malloc.h>
 #include <sys/kernel.h>
+#include <sys/lock.h>
 #include <sys/module.h>
+#include <sys/mutex.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
 #include <sys/bus.h>
+#include <sys/rman.h>
 
 #include <dev/nand/nandvar.h>
 
@@ -42,6 +48,10 @@ __FBSDID("$FreeBSD$");
 #include <arm/s3c2xx0/s3c2440reg.h>
 #include <arm/s3c2xx0/s3c2410var.h>
 
+/* The S3C2440 can interrupt when the ready/busy line goes high */
+#define	S3C2440_NFCONT_RNB_INT		(1 << 9)	/* EnbRnBINT */
+#define	S3C2440_NFSTAT_RNB_TRANS	(1 << 2)	/* RnB_TransDetect */
+
 struct s3c24x0_nand_softc {
 	struct s3c2xx0_softc	 sc_sx;
 
@@ -55,10 +65,18 @@ struct s3c24x0_nand_softc {
 	bus_size_t		 sc_stat_reg;
 	bus_size_t		 sc_ce_reg;
 	uint32_t		 sc_ce_mask;
+	int			 sc_data_words;	/* NFDATA takes 32 bit access */
+
+	/* Used to sleep until the chip is ready */
+	struct mtx		 sc_mtx;
+	struct resource		*sc_irq;
+	int			 sc_irq_rid;
+	void			*sc_ih;
 };
 
 static int	s3c24x0_nand_probe(device_t);
 static int	s3c24x0_nand_attach(device_t);
+static int	s3c24x0_nand_detach(device_t);
 
 static int	s3c24x0_select(nand_device_t, int);
 static int	s3c24x0_nand_command(nand_device_t, uint8_t);
@@ -67,10 +85,9 @@ static int	s3c24x0_nand_read(nand_device_t, size_t, uint8_t *);
 static int	s3c24x0_nand_read_8(nand_device_t, uint8_t *);
 static int	s3c24x0_nand_write(nand_device_t, size_t, uint8_t *);
 static int	s3c24x0_read_rnb(nand_device_t);
+static int	s3c24x0_wait_ready(nand_device_t, int);
 static int	s3c24x0_init_ecc(nand_device_t);
 static int	s3c24x0_calc_ecc(nand_device_t, uint8_t *);
-static int	s3c24x0_fix_data(nand_device_t, size_t, uint8_t *, uint8_t *,
-    uint8_t *);
 
 static struct nand_driver s3c24x0_nand_dri = {
 	.ndri_select = s3c24x0_select,
@@ -80,9 +97,11 @@ static struct nand_driver s3c24x0_nand_dri = {
 	.ndri_read_8 = s3c24x0_nand_read_8,
 	.ndri_write = s3c24x0_nand_write,
 	.ndri_read_rnb = s3c24x0_read_rnb,
+	.ndri_wait_ready = s3c24x0_wait_ready,
 	.ndri_init_ecc = s3c24x0_init_ecc,
 	.ndri_calc_ecc = s3c24x0_calc_ecc,
-	.ndri_fix_data = s3c24x0_fix_data,
+	/* The controller generates the same code as nand_ecc_calc */
+	.ndri_fix_data = nand_ecc_fix,
 };
 
 struct nand_ecc_data s3c2410_nand_ecc = {
@@ -116,6 +135,8 @@ s3c24x0_nand_init(struct s3c24x0_nand_softc *sc)
 		sc->sc_stat_reg = S3C2440_NANDFC_NFSTAT;
 		sc->sc_ce_reg = S3C2440_NANDFC_NFCONT;
 		sc->sc_ce_mask = S3C2440_NFCONT_NCE;
+		/* A word access moves 4 bytes, the first in the low byte */
+		sc->sc_data_words = (BYTE_ORDER == LITTLE_ENDIAN);
 		break;
 	case CPU_S3C2410:
 		reg = bus_space_read_4(iot, ioh, NANDFC_NFCONF);
@@ -128,6 +149,7 @@ s3c24x0_nand_init(struct s3c24x0_nand_softc *sc)
 		sc->sc_stat_reg = S3C2410_NANDFC_NFSTAT;
 		sc->sc_ce_reg = NANDFC_NFCONF;
 		sc->sc_ce_mask = S3C2410_NFCONF_FCE;
+		sc->sc_data_words = 0;
 		break;
 	default:
 		panic("Unknown processor");
@@ -135,6 +157,97 @@ s3c24x0_nand_init(struct s3c24x0_nand_softc *sc)
 
 }
 
+static void
+s3c24x0_nand_intr(void *arg)
+{
+	struct s3c24x0_nand_softc *sc = arg;
+	bus_space_handle_t ioh;
+	bus_space_tag_t iot;
+	uint8_t stat;
+
+	iot = sc->sc_sx.sc_iot;
+	ioh = sc->sc_nand_ioh;
+
+	mtx_lock(&sc->sc_mtx);
+	stat = bus_space_read_1(iot, ioh, sc->sc_stat_reg);
+	if ((stat & S3C2440_NFSTAT_RNB_TRANS) != 0) {
+		/* Writing the bit back clears it */
+		bus_space_write_1(iot, ioh, sc->sc_stat_reg,
+		    S3C2440_NFSTAT_RNB_TRANS);
+		wakeup(sc);
+	}
+	mtx_unlock(&sc->sc_mtx);
+}
+
+/*
+ * Sets up the ready/busy interrupt. Without it the chip is polled.
+ */
+static void
+s3c24x0_nand_intr_init(device_t dev, struct s3c24x0_nand_softc *sc)
+{
+	bus_space_handle_t ioh;
+	bus_space_tag_t iot;
+	uint32_t reg;
+	int rid;
+
+	iot = sc->sc_sx.sc_iot;
+	ioh = sc->sc_nand_ioh;
+
+	/* Only the S3C2440 detects the ready/busy transition */
+	if (s3c2xx0_softc->sc_cpu != CPU_S3C2440)
+		return;
+
+	rid = 0;
+	sc->sc_irq = bus_alloc_resource(dev, SYS_RES_IRQ, &rid,
+	    S3C24X0_INT_NFCON, S3C24X0_INT_NFCON, 1, RF_ACTIVE);
+	if (sc->sc_irq == NULL) {
+		device_printf(dev, "Unable to allocate the interrupt\n");
+		return;
+	}
+	sc->sc_irq_rid = rid;
+	if (bus_setup_intr(dev, sc->sc_irq, INTR_TYPE_BIO | INTR_MPSAFE,
+	    NULL, s3c24x0_nand_intr, sc, &sc->sc_ih) != 0) {
+		device_printf(dev, "Unable to set up the interrupt\n");
+		bus_release_resource(dev, SYS_RES_IRQ, rid, sc->sc_irq);
+		sc->sc_irq = NULL;
+		sc->sc_ih = NULL;
+		return;
+	}
+
+	/* Interrupt on the ready/busy line going high */
+	bus_space_write_1(iot, ioh, sc->sc_stat_reg, S3C2440_NFSTAT_RNB_TRANS);
+	reg = bus_space_read_4(iot, ioh, S3C2440_NANDFC_NFCONT);
+	reg |= S3C2440_NFCONT_RNB_INT;
+	bus_space_write_4(iot, ioh, S3C2440_NANDFC_NFCONT, reg);
+}
+
+/*
+ * Undoes s3c24x0_nand_intr_init, masking the interrupt before the
+ * handler goes away
+ */
+static void
+s3c24x0_nand_intr_fini(device_t dev, struct s3c24x0_nand_softc *sc)
+{
+	bus_space_handle_t ioh;
+	bus_space_tag_t iot;
+	uint32_t reg;
+
+	if (sc->sc_irq == NULL)
+		return;
+
+	iot = sc->sc_sx.sc_iot;
+	ioh = sc->sc_nand_ioh;
+
+	reg = bus_space_read_4(iot, ioh, S3C2440_NANDFC_NFCONT);
+	reg &= ~S3C2440_NFCONT_RNB_INT;
+	bus_space_write_4(iot, ioh, S3C2440_NANDFC_NFCONT, reg);
+
+	bus_teardown_intr(dev, sc->sc_irq, sc->sc_ih);
+	bus_release_resource(dev, SYS_RES_IRQ, sc->sc_irq_rid, sc->sc_irq);
+	sc->sc_irq = NULL;
+	sc->sc_ih = NULL;
+}
+
 static int
 s3c24x0_nand_probe(device_t dev)
 {
@@ -183,14 +296,40 @@ s3c24x0_nand_attach(device_t dev)
 	/* Make sure the Flash is in a consistent state before use */
 	s3c24x0_nand_init(sc);
 
+	mtx_init(&sc->sc_mtx, "s3c24x0_nand", NULL, MTX_DEF);
+	s3c24x0_nand_intr_init(dev, sc);
+
 	sc->sc_nand_dev.ndev_ecc = &s3c2410_nand_ecc;
 
 	err = nand_attach(&sc->sc_nand_dev);
 	if (err != 0) {
-		device_set_desc(dev, sc->sc_nand_dev.ndev_name);
+		s3c24x0_nand_intr_fini(dev, sc);
+		mtx_destroy(&sc->sc_mtx);
+		bus_space_unmap(sc->sc_sx.sc_iot, sc->sc_nand_ioh,
+		    S3C2410_NANDFC_SIZE * 2);
+		return (err);
 	}
+	device_set_desc(dev, sc->sc_nand_dev.ndev_name);
 
-	return (err);
+	return (0);
+}
+
+static int
+s3c24x0_nand_detach(device_t dev)
+{
+	struct s3c24x0_nand_softc *sc = device_get_softc(dev);
+	int err;
+
+	err = nand_detach(&sc->sc_nand_dev);
+	if (err != 0)
+		return (err);
+
+	s3c24x0_nand_intr_fini(dev, sc);
+	mtx_destroy(&sc->sc_mtx);
+	bus_space_unmap(sc->sc_sx.sc_iot, sc->sc_nand_ioh,
+	    S3C2410_NANDFC_SIZE * 2);
+
+	return (0);
 }
 
 static int
@@ -201,6 +340,10 @@ s3c24x0_select(nand_device_t ndev, int enable)
 	bus_space_tag_t iot;
 	uint32_t reg;
 
+	/* There is only a single chip enable */
+	if (ndev->ndev_lun != 0)
+		return (ENXIO);
+
 	iot = sc->sc_sx.sc_iot;
 	ioh = sc->sc_nand_ioh;
 
@@ -244,21 +387,38 @@ s3c24x0_nand_address(nand_device_t ndev, uint8_t addr)
 	return (0);
 }
 
+/*
+ * Data is moved a word at a time where the controller allows it. The
+ * bytes before the buffer is word aligned and any after the last whole
+ * word are moved one at a time.
+ */
 static int
 s3c24x0_nand_read(nand_device_t ndev, size_t len, uint8_t *data)
 {
 	struct s3c24x0_nand_softc *sc = device_get_softc(ndev->ndev_dev);
 	bus_space_handle_t ioh;
 	bus_space_tag_t iot;
-	size_t pos;
+	size_t pos, words;
 
 	iot = sc->sc_sx.sc_iot;
 	ioh = sc->sc_nand_ioh;
 
-	for (pos = 0; pos < len; pos++) {
-		data[pos] = bus_space_read_4(iot, ioh, sc->sc_data_reg) & 0xFF;
+	if (!sc->sc_data_words) {
+		bus_space_read_multi_1(iot, ioh, sc->sc_data_reg, data, len);
+		return (0);
 	}
 
+	for (pos = 0; pos < len && ((uintptr_t)&data[pos] & 3) != 0; pos++)
+		data[pos] = bus_space_read_1(iot, ioh, sc->sc_data_reg);
+	words = (len - pos) / 4;
+	if (words > 0) {
+		bus_space_read_multi_4(iot, ioh, sc->sc_data_reg,
+		    (uint32_t *)&data[pos], words);
+		pos += words * 4;
+	}
+	for (; pos < len; pos++)
+		data[pos] = bus_space_read_1(iot, ioh, sc->sc_data_reg);
+
 	return (0);
 }
 
@@ -283,14 +443,26 @@ s3c24x0_nand_write(nand_device_t ndev, size_t len, uint8_t *data)
 	struct s3c24x0_nand_softc *sc = device_get_softc(ndev->ndev_dev);
 	bus_space_handle_t ioh;
 	bus_space_tag_t iot;
-	size_t pos;
+	size_t pos, words;
 
 	iot = sc->sc_sx.sc_iot;
 	ioh = sc->sc_nand_ioh;
 
-	for (pos = 0; pos < len; pos++) {
+	if (!sc->sc_data_words) {
+		bus_space_write_multi_1(iot, ioh, sc->sc_data_reg, data, len);
+		return (0);
+	}
+
+	for (pos = 0; pos < len && ((uintptr_t)&data[pos] & 3) != 0; pos++)
 		bus_space_write_1(iot, ioh, sc->sc_data_reg, data[pos]);
+	words = (len - pos) / 4;
+	if (words > 0) {
+		bus_space_write_multi_4(iot, ioh, sc->sc_data_reg,
+		    (uint32_t *)&data[pos], words);
+		pos += words * 4;
 	}
+	for (; pos < len; pos++)
+		bus_space_write_1(iot, ioh, sc->sc_data_reg, data[pos]);
 
 	return (0);
 }
@@ -310,6 +482,28 @@ s3c24x0_read_rnb(nand_device_t ndev)
 	return (rnb == NFSTAT_READY);
 }
 
+/*
+ * Sleeps until the interrupt for the ready/busy line going high. The
+ * line is checked with the lock held so the interrupt can't be missed.
+ */
+static int
+s3c24x0_wait_ready(nand_device_t ndev, int timo)
+{
+	struct s3c24x0_nand_softc *sc = device_get_softc(ndev->ndev_dev);
+	int err;
+
+	if (sc->sc_ih == NULL)
+		return (EOPNOTSUPP);
+
+	err = 0;
+	mtx_lock(&sc->sc_mtx);
+	while (!s3c24x0_read_rnb(ndev) && err == 0)
+		err = msleep(sc, &sc->sc_mtx, PRIBIO, "nandrb", timo);
+	mtx_unlock(&sc->sc_mtx);
+
+	return (err);
+}
+
 static int
 s3c24x0_init_ecc(nand_device_t ndev)
 {
@@ -347,33 +541,10 @@ s3c24x0_calc_ecc(nand_device_t ndev, uint8_t *ecc)
 	return (0);
 }
 
-static int
-s3c24x0_fix_data(nand_device_t ndev, size_t len, uint8_t *data,
-    uint8_t *calc_ecc, uint8_t *read_ecc)
-{
-	uint8_t diff[3];
-
-	diff[0] = calc_ecc[0] ^ read_ecc[0];
-	diff[1] = calc_ecc[1] ^ read_ecc[1];
-	diff[2] = calc_ecc[2] ^ read_ecc[2];
-
-	/* The two ECC's are the same so are correct */
-	if (diff[0] == 0x00 && diff[1] == 0x00 && diff[2] == 0x00)
-		return (0);
-	/* There may be no ECC, ignore this case */
-	if (read_ecc[0] == 0xFF && read_ecc[1] == 0xFF && read_ecc[2] == 0xFF)
-		return (0);
-
-	/* TODO: Fix the data if we are can */
-	device_printf(ndev->ndev_dev, "Bad ECC: %X %X %X != %X %X %X\n",
-	    calc_ecc[0], calc_ecc[1], calc_ecc[2],
-	    read_ecc[0], read_ecc[1], read_ecc[2]);
-	return (EIO);
-}
-
 static device_method_t s3c2410_nand_methods[] = {
 	DEVMETHOD(device_probe, s3c24x0_nand_probe),
 	DEVMETHOD(device_attach, s3c24x0_nand_attach),
+	DEVMETHOD(device_detach, s3c24x0_nand_detach),
 
 	{0, 0},
 };
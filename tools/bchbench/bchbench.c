@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2009 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Measures the speed of the software BCH code used by the NAND driver.
+ * For each strength it reports MB/s of data encoded, decoded without
+ * errors and decoded with as many bit errors as can be corrected.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nand_bch.h"
+
+#define	BCH_M		13
+#define	BCH_LEN		512
+
+static double
+elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start->tv_sec) +
+	    (end.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+static void
+report(const char *what, int t, long blocks, double secs)
+{
+
+	printf("t=%d %-14s %9.1f MB/s\n", t, what,
+	    blocks * (double)BCH_LEN / secs / 1e6);
+}
+
+static void
+bench(int t, long blocks)
+{
+	struct timespec start;
+	struct nand_bch *nb;
+	uint8_t *data, *copy, *calc, *read;
+	size_t bytes;
+	long i;
+	int j, bit, bad;
+
+	nb = nand_bch_init(BCH_M, t, BCH_LEN);
+	if (nb == NULL)
+		errx(1, "Unable to build a code correcting %d bits", t);
+	bytes = nand_bch_ecc_bytes(nb);
+
+	data = malloc(BCH_LEN);
+	copy = malloc(BCH_LEN);
+	calc = malloc(bytes);
+	read = malloc(bytes);
+	if (data == NULL || copy == NULL || calc == NULL || read == NULL)
+		err(1, "malloc");
+	for (i = 0; i < BCH_LEN; i++)
+		data[i] = random();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < blocks; i++) {
+		data[i % BCH_LEN]++;
+		nand_bch_encode(nb, data, read);
+	}
+	report("encode", t, blocks, elapsed(&start));
+
+	/* A clean read recomputes the code and compares it */
+	bad = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < blocks; i++) {
+		nand_bch_encode(nb, data, calc);
+		if (nand_bch_decode(nb, data, calc, read) != 0)
+			bad++;
+	}
+	report("decode clean", t, blocks, elapsed(&start));
+	if (bad != 0)
+		errx(1, "%d clean blocks had errors", bad);
+
+	/* Flip t bits then correct them */
+	memcpy(copy, data, BCH_LEN);
+	blocks /= 4;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < blocks; i++) {
+		for (j = 0; j < t; j++) {
+			bit = (i * 7919 + j * (BCH_LEN * 8 / t)) %
+			    (BCH_LEN * 8);
+			data[bit / 8] ^= 1 << (bit % 8);
+		}
+		nand_bch_encode(nb, data, calc);
+		if (nand_bch_decode(nb, data, calc, read) != t)
+			bad++;
+	}
+	report("decode dirty", t, blocks, elapsed(&start));
+	if (bad != 0 || memcmp(copy, data, BCH_LEN) != 0)
+		errx(1, "%d blocks were not corrected", bad);
+
+	free(read);
+	free(calc);
+	free(copy);
+	free(data);
+	nand_bch_free(nb);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: bchbench [-n blocks] [strength ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long blocks;
+	int ch, i;
+
+	blocks = 200000;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			blocks = strtol(optarg, NULL, 0);
+			if (blocks < 4)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0) {
+		bench(4, blocks);
+		bench(8, blocks);
+	}
+	for (i = 0; i < argc; i++)
+		bench(atoi(argv[i]), blocks);
+
+	return (0);
+}
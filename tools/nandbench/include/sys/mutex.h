@@ -0,0 +1 @@
+/* Provided by kshim.h */
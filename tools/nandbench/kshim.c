@@ -0,0 +1,888 @@
+/*
+ * Copyright (C) 2009 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * The userland stand ins for the kernel interfaces declared in kshim.h.
+ */
+
+#include "kshim.h"
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* The kernel allocator macros would hide the libc functions */
+#undef malloc
+#undef free
+
+int hz = 1000;
+int tick = 1000;	/* Microseconds per tick */
+int ticks;
+int cold;
+
+void
+panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "panic: ");
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+int
+device_printf(device_t dev, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vprintf(fmt, ap);
+	va_end(ap);
+	return (ret);
+}
+
+uint32_t
+crc32(const void *buf, size_t size)
+{
+	const uint8_t *p;
+	uint32_t crc;
+	int i;
+
+	p = buf;
+	crc = ~0U;
+	while (size-- > 0) {
+		crc ^= *p++;
+		for (i = 0; i < NBBY; i++)
+			crc = (crc >> 1) ^ (0xEDB88320U & -(crc & 1));
+	}
+	return (crc ^ ~0U);
+}
+
+void
+DELAY(int usec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000L;
+	nanosleep(&ts, NULL);
+}
+
+void *
+kshim_malloc(size_t size, struct malloc_type *type, int flags)
+{
+	void *p;
+
+	p = malloc(size);
+	if (p == NULL && (flags & M_WAITOK))
+		panic("%s: out of memory", type->ks_shortdesc);
+	if (p != NULL && (flags & M_ZERO))
+		memset(p, 0, size);
+	return (p);
+}
+
+void
+kshim_free(void *addr, struct malloc_type *type)
+{
+
+	free(addr);
+}
+
+void *
+hashinit(int elements, struct malloc_type *type, u_long *hashmask)
+{
+	LIST_HEAD(generic, generic) *hashtbl;
+	long hashsize;
+	int i;
+
+	for (hashsize = 1; hashsize <= elements; hashsize <<= 1)
+		continue;
+	hashsize >>= 1;
+	hashtbl = kshim_malloc(hashsize * sizeof(*hashtbl), type, M_WAITOK);
+	for (i = 0; i < hashsize; i++)
+		LIST_INIT(&hashtbl[i]);
+	*hashmask = hashsize - 1;
+	return (hashtbl);
+}
+
+void
+hashdestroy(void *vhashtbl, struct malloc_type *type, u_long hashmask)
+{
+
+	kshim_free(vhashtbl, type);
+}
+
+struct uma_zone {
+	size_t	uz_size;
+};
+
+uma_zone_t
+uma_zcreate(const char *name, size_t size, uma_ctor ctor, uma_dtor dtor,
+    uma_init uminit, uma_fini fini, int align, uint32_t flags)
+{
+	uma_zone_t zone;
+
+	zone = malloc(sizeof(*zone));
+	if (zone == NULL)
+		panic("%s: out of memory", name);
+	zone->uz_size = size;
+	return (zone);
+}
+
+void
+uma_zdestroy(uma_zone_t zone)
+{
+
+	free(zone);
+}
+
+void *
+uma_zalloc(uma_zone_t zone, int flags)
+{
+	void *item;
+
+	item = malloc(zone->uz_size);
+	if (item != NULL && (flags & M_ZERO))
+		memset(item, 0, zone->uz_size);
+	return (item);
+}
+
+void
+uma_zfree(uma_zone_t zone, void *item)
+{
+
+	free(item);
+}
+
+void
+mtx_init(struct mtx *m, const char *name, const char *type, int opts)
+{
+	pthread_mutexattr_t attr;
+
+	/* Catch recursion and unlocking from the wrong thread */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+	pthread_mutex_init(&m->mtx_m, &attr);
+	pthread_mutexattr_destroy(&attr);
+	m->mtx_inited = 1;
+}
+
+void
+mtx_destroy(struct mtx *m)
+{
+
+	pthread_mutex_destroy(&m->mtx_m);
+	m->mtx_inited = 0;
+}
+
+void
+mtx_lock(struct mtx *m)
+{
+
+	if (pthread_mutex_lock(&m->mtx_m) != 0)
+		panic("mtx_lock");
+}
+
+void
+mtx_unlock(struct mtx *m)
+{
+
+	if (pthread_mutex_unlock(&m->mtx_m) != 0)
+		panic("mtx_unlock");
+}
+
+/*
+ * Each sleeping thread waits on its own condition variable with the
+ * sleep queue lock held. wakeup() takes the sleepers off the queue.
+ */
+struct sleeper {
+	void		*s_chan;
+	int		s_woken;
+	pthread_cond_t	s_cv;
+	TAILQ_ENTRY(sleeper) s_link;
+};
+
+static TAILQ_HEAD(, sleeper) sleepq = TAILQ_HEAD_INITIALIZER(sleepq);
+static pthread_mutex_t sleepq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+msleep(void *chan, struct mtx *m, int pri, const char *wmesg, int timo)
+{
+	pthread_condattr_t attr;
+	struct sleeper s;
+	struct timespec ts;
+	int err;
+
+	s.s_chan = chan;
+	s.s_woken = 0;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s.s_cv, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (timo > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += (long)timo * (1000000000L / hz);
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+	}
+
+	/* Queue before dropping m so a wakeup can't be missed */
+	pthread_mutex_lock(&sleepq_lock);
+	TAILQ_INSERT_TAIL(&sleepq, &s, s_link);
+	if (m != NULL)
+		mtx_unlock(m);
+	err = 0;
+	while (!s.s_woken && err == 0) {
+		if (timo > 0)
+			err = pthread_cond_timedwait(&s.s_cv, &sleepq_lock,
+			    &ts);
+		else
+			err = pthread_cond_wait(&s.s_cv, &sleepq_lock);
+	}
+	if (!s.s_woken)
+		TAILQ_REMOVE(&sleepq, &s, s_link);
+	pthread_mutex_unlock(&sleepq_lock);
+	pthread_cond_destroy(&s.s_cv);
+
+	if (m != NULL)
+		mtx_lock(m);
+	return (s.s_woken ? 0 : EWOULDBLOCK);
+}
+
+int
+kshim_pause(const char *wmesg, int timo)
+{
+	int chan;
+
+	return (msleep(&chan, NULL, 0, wmesg, MAX(timo, 1)));
+}
+
+void
+wakeup(void *chan)
+{
+	struct sleeper *s, *next;
+
+	pthread_mutex_lock(&sleepq_lock);
+	TAILQ_FOREACH_SAFE(s, &sleepq, s_link, next) {
+		if (s->s_chan != chan)
+			continue;
+		TAILQ_REMOVE(&sleepq, s, s_link);
+		s->s_woken = 1;
+		pthread_cond_signal(&s->s_cv);
+	}
+	pthread_mutex_unlock(&sleepq_lock);
+}
+
+/* Protects the callout generation and running counts */
+static pthread_mutex_t callout_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct callout_run {
+	struct callout	*cr_c;
+	int		cr_gen;
+	int		cr_timo;
+	void		(*cr_func)(void *);
+	void		*cr_arg;
+};
+
+void
+callout_init_mtx(struct callout *c, struct mtx *m, int flags)
+{
+
+	c->c_mtx = m;
+	c->c_gen = 0;
+	c->c_running = 0;
+}
+
+static void *
+callout_thread(void *arg)
+{
+	struct callout_run *cr;
+	struct callout *c;
+	struct timespec ts;
+	int run;
+
+	cr = arg;
+	c = cr->cr_c;
+	ts.tv_sec = cr->cr_timo / hz;
+	ts.tv_nsec = (long)(cr->cr_timo % hz) * (1000000000L / hz);
+	nanosleep(&ts, NULL);
+
+	mtx_lock(c->c_mtx);
+	/* Only run if not stopped or reset since being scheduled */
+	pthread_mutex_lock(&callout_lock);
+	run = (cr->cr_gen == c->c_gen);
+	if (run)
+		c->c_gen++;
+	pthread_mutex_unlock(&callout_lock);
+	if (run)
+		cr->cr_func(cr->cr_arg);
+	pthread_mutex_lock(&callout_lock);
+	c->c_running--;
+	pthread_mutex_unlock(&callout_lock);
+	mtx_unlock(c->c_mtx);
+
+	free(cr);
+	return (NULL);
+}
+
+int
+callout_reset(struct callout *c, int timo, void (*func)(void *), void *arg)
+{
+	struct callout_run *cr;
+	pthread_t thread;
+
+	cr = malloc(sizeof(*cr));
+	if (cr == NULL)
+		panic("callout_reset: out of memory");
+	pthread_mutex_lock(&callout_lock);
+	cr->cr_c = c;
+	cr->cr_gen = ++c->c_gen;
+	cr->cr_timo = MAX(timo, 1);
+	cr->cr_func = func;
+	cr->cr_arg = arg;
+	c->c_running++;
+	pthread_mutex_unlock(&callout_lock);
+
+	if (pthread_create(&thread, NULL, callout_thread, cr) != 0)
+		panic("callout_reset: unable to create a thread");
+	pthread_detach(thread);
+	return (0);
+}
+
+int
+callout_stop(struct callout *c)
+{
+
+	pthread_mutex_lock(&callout_lock);
+	c->c_gen++;
+	pthread_mutex_unlock(&callout_lock);
+	return (0);
+}
+
+int
+callout_drain(struct callout *c)
+{
+	int running;
+
+	callout_stop(c);
+	for (;;) {
+		pthread_mutex_lock(&callout_lock);
+		running = c->c_running;
+		pthread_mutex_unlock(&callout_lock);
+		if (running == 0)
+			break;
+		usleep(100);
+	}
+	return (0);
+}
+
+struct kproc_start {
+	void	(*ks_func)(void *);
+	void	*ks_arg;
+};
+
+static void *
+kproc_thread(void *arg)
+{
+	struct kproc_start ks;
+
+	ks = *(struct kproc_start *)arg;
+	free(arg);
+	ks.ks_func(ks.ks_arg);
+	return (NULL);
+}
+
+int
+kproc_create(void (*func)(void *), void *arg, struct proc **procp,
+    int flags, int pages, const char *fmt, ...)
+{
+	struct kproc_start *ks;
+	struct proc *p;
+
+	ks = malloc(sizeof(*ks));
+	p = malloc(sizeof(*p));
+	if (ks == NULL || p == NULL) {
+		free(ks);
+		free(p);
+		return (ENOMEM);
+	}
+	ks->ks_func = func;
+	ks->ks_arg = arg;
+	if (pthread_create(&p->p_thread, NULL, kproc_thread, ks) != 0) {
+		free(ks);
+		free(p);
+		return (EAGAIN);
+	}
+	pthread_detach(p->p_thread);
+	if (procp != NULL)
+		*procp = p;
+	return (0);
+}
+
+void
+kproc_exit(int ecode)
+{
+
+	pthread_exit(NULL);
+}
+
+void
+bioq_init(struct bio_queue_head *head)
+{
+
+	TAILQ_INIT(&head->queue);
+}
+
+void
+bioq_insert_tail(struct bio_queue_head *head, struct bio *bp)
+{
+
+	TAILQ_INSERT_TAIL(&head->queue, bp, bio_queue);
+}
+
+struct bio *
+bioq_first(struct bio_queue_head *head)
+{
+
+	return (TAILQ_FIRST(&head->queue));
+}
+
+struct bio *
+bioq_takefirst(struct bio_queue_head *head)
+{
+	struct bio *bp;
+
+	bp = TAILQ_FIRST(&head->queue);
+	if (bp != NULL)
+		TAILQ_REMOVE(&head->queue, bp, bio_queue);
+	return (bp);
+}
+
+void
+biodone(struct bio *bp)
+{
+
+	bp->bio_flags |= BIO_DONE;
+	if (bp->bio_done != NULL)
+		bp->bio_done(bp);
+}
+
+void
+biofinish(struct bio *bp, void *stat, int error)
+{
+
+	if (error != 0) {
+		bp->bio_error = error;
+		bp->bio_flags |= BIO_ERROR;
+	}
+	biodone(bp);
+}
+
+static TAILQ_HEAD(, disk) disks = TAILQ_HEAD_INITIALIZER(disks);
+static pthread_mutex_t disks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct disk *
+disk_alloc(void)
+{
+	struct disk *dp;
+
+	dp = calloc(1, sizeof(*dp));
+	if (dp == NULL)
+		panic("disk_alloc: out of memory");
+	return (dp);
+}
+
+void
+disk_create(struct disk *dp, int version)
+{
+
+	pthread_mutex_lock(&disks_lock);
+	TAILQ_INSERT_TAIL(&disks, dp, d_list);
+	pthread_mutex_unlock(&disks_lock);
+}
+
+void
+disk_destroy(struct disk *dp)
+{
+
+	pthread_mutex_lock(&disks_lock);
+	TAILQ_REMOVE(&disks, dp, d_list);
+	pthread_mutex_unlock(&disks_lock);
+	free(dp);
+}
+
+struct disk *
+kshim_disk_find(const char *name, int unit)
+{
+	struct disk *dp;
+
+	pthread_mutex_lock(&disks_lock);
+	TAILQ_FOREACH(dp, &disks, d_list)
+		if (strcmp(dp->d_name, name) == 0 && dp->d_unit == unit)
+			break;
+	pthread_mutex_unlock(&disks_lock);
+	return (dp);
+}
+
+int
+g_handleattr_int(struct bio *bp, const char *attribute, int val)
+{
+
+	if (bp->bio_attribute == NULL ||
+	    strcmp(bp->bio_attribute, attribute) != 0)
+		return (0);
+	memcpy(bp->bio_data, &val, sizeof(val));
+	bp->bio_completed = sizeof(val);
+	biodone(bp);
+	return (1);
+}
+
+/* The root of the sysctl tree and the hw node below it */
+static struct sysctl_oid sysctl__root = { .oid_name = "" };
+struct sysctl_oid sysctl__hw = { .oid_name = "hw",
+    .oid_kind = CTLTYPE_NODE };
+
+static void __attribute__((__constructor__(200)))
+sysctl_root_init(void)
+{
+
+	TAILQ_INIT(&sysctl__root.oid_children.head);
+	TAILQ_INIT(&sysctl__hw.oid_children.head);
+	kshim_sysctl_link(&sysctl__root.oid_children, &sysctl__hw);
+}
+
+void
+kshim_sysctl_link(struct sysctl_oid_list *parent, struct sysctl_oid *oid)
+{
+
+	oid->oid_parent = parent;
+	TAILQ_INSERT_TAIL(&parent->head, oid, oid_link);
+}
+
+int
+sysctl_ctx_init(struct sysctl_ctx_list *ctx)
+{
+
+	TAILQ_INIT(&ctx->head);
+	return (0);
+}
+
+int
+sysctl_ctx_free(struct sysctl_ctx_list *ctx)
+{
+	struct sysctl_oid *oid;
+
+	/* Newest first so children go before their parents */
+	while ((oid = TAILQ_FIRST(&ctx->head)) != NULL) {
+		TAILQ_REMOVE(&ctx->head, oid, oid_ctx_link);
+		TAILQ_REMOVE(&oid->oid_parent->head, oid, oid_link);
+		free((void *)oid->oid_name);
+		free(oid);
+	}
+	return (0);
+}
+
+struct sysctl_oid *
+kshim_sysctl_add(struct sysctl_ctx_list *ctx, struct sysctl_oid_list *parent,
+    const char *name, int kind, void *arg1, intptr_t arg2,
+    sysctl_handler_t handler)
+{
+	struct sysctl_oid *oid;
+
+	oid = calloc(1, sizeof(*oid));
+	if (oid == NULL || (oid->oid_name = strdup(name)) == NULL)
+		panic("sysctl: out of memory");
+	oid->oid_kind = kind;
+	oid->oid_arg1 = arg1;
+	oid->oid_arg2 = arg2;
+	oid->oid_handler = handler;
+	TAILQ_INIT(&oid->oid_children.head);
+	kshim_sysctl_link(parent, oid);
+	if (ctx != NULL)
+		TAILQ_INSERT_HEAD(&ctx->head, oid, oid_ctx_link);
+	return (oid);
+}
+
+int
+SYSCTL_OUT(struct sysctl_req *req, const void *p, size_t len)
+{
+
+	if (req->oldptr != NULL) {
+		if (req->oldidx + len > req->oldlen)
+			return (ENOMEM);
+		memcpy((char *)req->oldptr + req->oldidx, p, len);
+	}
+	req->oldidx += len;
+	return (0);
+}
+
+int
+SYSCTL_IN(struct sysctl_req *req, void *p, size_t len)
+{
+
+	if (req->newptr == NULL)
+		return (0);
+	if (req->newidx + len > req->newlen)
+		return (EINVAL);
+	memcpy(p, (const char *)req->newptr + req->newidx, len);
+	req->newidx += len;
+	return (0);
+}
+
+int
+sysctl_handle_int(SYSCTL_HANDLER_ARGS)
+{
+	int err, tmp;
+
+	tmp = arg1 != NULL ? *(int *)arg1 : (int)arg2;
+	err = SYSCTL_OUT(req, &tmp, sizeof(tmp));
+	if (err != 0 || req->newptr == NULL)
+		return (err);
+	if (arg1 == NULL)
+		return (EPERM);
+	return (SYSCTL_IN(req, arg1, sizeof(int)));
+}
+
+int
+sysctl_handle_long(SYSCTL_HANDLER_ARGS)
+{
+	long tmp;
+	int err;
+
+	tmp = arg1 != NULL ? *(long *)arg1 : (long)arg2;
+	err = SYSCTL_OUT(req, &tmp, sizeof(tmp));
+	if (err != 0 || req->newptr == NULL)
+		return (err);
+	if (arg1 == NULL)
+		return (EPERM);
+	return (SYSCTL_IN(req, arg1, sizeof(long)));
+}
+
+int
+sysctl_handle_64(SYSCTL_HANDLER_ARGS)
+{
+	uint64_t tmp;
+	int err;
+
+	tmp = *(uint64_t *)arg1;
+	err = SYSCTL_OUT(req, &tmp, sizeof(tmp));
+	if (err != 0 || req->newptr == NULL)
+		return (err);
+	return (SYSCTL_IN(req, arg1, sizeof(uint64_t)));
+}
+
+int
+sysctl_handle_string(SYSCTL_HANDLER_ARGS)
+{
+	int err;
+
+	err = SYSCTL_OUT(req, arg1, strlen(arg1) + 1);
+	if (err != 0 || req->newptr == NULL)
+		return (err);
+	if (req->newlen >= (size_t)arg2)
+		return (EINVAL);
+	memcpy(arg1, req->newptr, req->newlen);
+	((char *)arg1)[req->newlen] = '\0';
+	return (0);
+}
+
+static struct sysctl_oid *
+sysctl_lookup(const char *path)
+{
+	struct sysctl_oid_list *list;
+	struct sysctl_oid *oid;
+	char buf[256], *name, *p;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	list = &sysctl__root.oid_children;
+	oid = NULL;
+	for (p = buf; (name = strsep(&p, ".")) != NULL;) {
+		TAILQ_FOREACH(oid, &list->head, oid_link)
+			if (strcmp(oid->oid_name, name) == 0)
+				break;
+		if (oid == NULL)
+			return (NULL);
+		list = &oid->oid_children;
+	}
+	return (oid);
+}
+
+/* Like sysctlbyname(3) */
+int
+kshim_sysctl(const char *name, void *old, size_t *oldlenp, const void *new,
+    size_t newlen)
+{
+	struct sysctl_req req;
+	struct sysctl_oid *oid;
+	int err;
+
+	oid = sysctl_lookup(name);
+	if (oid == NULL || oid->oid_handler == NULL)
+		return (ENOENT);
+	memset(&req, 0, sizeof(req));
+	req.oldptr = old;
+	req.oldlen = oldlenp != NULL ? *oldlenp : 0;
+	req.newptr = new;
+	req.newlen = newlen;
+	err = oid->oid_handler(oid, oid->oid_arg1, oid->oid_arg2, &req);
+	if (oldlenp != NULL)
+		*oldlenp = req.oldidx;
+	return (err);
+}
+
+static SLIST_HEAD(, kshim_tunable) tunables =
+    SLIST_HEAD_INITIALIZER(tunables);
+
+void
+kshim_tunable_register(struct kshim_tunable *kt)
+{
+
+	SLIST_INSERT_HEAD(&tunables, kt, kt_link);
+}
+
+void
+kshim_tunables_load(void)
+{
+	struct kshim_tunable *kt;
+
+	SLIST_FOREACH(kt, &tunables, kt_link) {
+		if (kt->kt_var != NULL) {
+			kshim_tunable_fetch(kt->kt_path, kt->kt_var);
+			continue;
+		}
+		kshim_tunable_str_fetch(kt->kt_path, kt->kt_str, kt->kt_size);
+	}
+}
+
+int
+kshim_tunable_fetch(const char *path, int *var)
+{
+	const char *env;
+
+	env = getenv(path);
+	if (env == NULL)
+		return (0);
+	*var = strtol(env, NULL, 0);
+	return (1);
+}
+
+int
+kshim_tunable_str_fetch(const char *path, char *var, size_t size)
+{
+	const char *env;
+
+	env = getenv(path);
+	if (env == NULL)
+		return (0);
+	kshim_strlcpy(var, env, size);
+	return (1);
+}
+
+size_t
+kshim_strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len;
+
+	len = strlen(src);
+	if (size > 0) {
+		size = MIN(len, size - 1);
+		memcpy(dst, src, size);
+		dst[size] = '\0';
+	}
+	return (len);
+}
+
+struct thread kshim_thread;
+
+int
+vn_open(struct nameidata *ndp, int *flagp, int cmode, void *fp)
+{
+	struct stat sb;
+	struct vnode *vp;
+	int fd;
+
+	fd = open(ndp->ni_dirp, (*flagp & FWRITE) ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+		return (errno);
+	if (fstat(fd, &sb) != 0) {
+		close(fd);
+		return (errno);
+	}
+	vp = calloc(1, sizeof(*vp));
+	vp->v_fd = fd;
+	vp->v_type = S_ISREG(sb.st_mode) ? VREG : VOTHER;
+	ndp->ni_vp = vp;
+	return (0);
+}
+
+int
+vn_close(struct vnode *vp, int flags, struct ucred *cred, struct thread *td)
+{
+	int err;
+
+	err = close(vp->v_fd) != 0 ? errno : 0;
+	free(vp);
+	return (err);
+}
+
+int
+vn_rdwr(enum uio_rw rw, struct vnode *vp, void *base, int len, off_t offset,
+    int segflg, int ioflg, struct ucred *active_cred, struct ucred *file_cred,
+    int *aresid, struct thread *td)
+{
+	ssize_t done;
+
+	if (rw == UIO_READ)
+		done = pread(vp->v_fd, base, len, offset);
+	else
+		done = pwrite(vp->v_fd, base, len, offset);
+	if (done < 0)
+		return (errno);
+	if (aresid != NULL)
+		*aresid = len - done;
+	else if (done != len)
+		return (EIO);
+	return (0);
+}
+
+int
+VOP_GETATTR(struct vnode *vp, struct vattr *vap, struct ucred *cred)
+{
+	struct stat sb;
+
+	if (fstat(vp->v_fd, &sb) != 0)
+		return (errno);
+	vap->va_size = sb.st_size;
+	return (0);
+}
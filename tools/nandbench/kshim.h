@@ -0,0 +1,508 @@
+/*
+ * Copyright (C) 2009 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Just enough of the kernel for the NAND core and nandsim to run as a
+ * userland program. Locks and kernel processes are pthreads, tunables
+ * come from the environment and disks are kept on a list for the
+ * program driving them to find. Sources are built with this header
+ * forced in front of them and the empty headers under include/
+ * standing in for the kernel ones.
+ */
+
+#ifndef _KSHIM_H_
+#define	_KSHIM_H_
+
+#define	_GNU_SOURCE
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef __FBSDID
+#define	__FBSDID(s)
+#endif
+#ifndef __unused
+#define	__unused	__attribute__((__unused__))
+#endif
+#ifndef __predict_false
+#define	__predict_false(x)	__builtin_expect((x), 0)
+#endif
+
+/* Not every libc has it */
+size_t	kshim_strlcpy(char *, const char *, size_t);
+#define	strlcpy		kshim_strlcpy
+
+#ifndef TAILQ_FOREACH_SAFE
+#define	TAILQ_FOREACH_SAFE(var, head, field, tvar)			\
+	for ((var) = TAILQ_FIRST((head));				\
+	    (var) && ((tvar) = TAILQ_NEXT((var), field), 1);		\
+	    (var) = (tvar))
+#endif
+#ifndef TAILQ_FIRST
+#define	TAILQ_FIRST(head)	((head)->tqh_first)
+#endif
+#ifndef TAILQ_NEXT
+#define	TAILQ_NEXT(elm, field)	((elm)->field.tqe_next)
+#endif
+#ifndef SLIST_FOREACH
+#define	SLIST_FOREACH(var, head, field)					\
+	for ((var) = (head)->slh_first; (var); (var) = (var)->field.sle_next)
+#endif
+
+#ifndef NBBY
+#define	NBBY	8
+#endif
+#ifndef howmany
+#define	howmany(x, y)	(((x) + ((y) - 1)) / (y))
+#endif
+#ifndef isset
+#define	setbit(a, i)	(((uint8_t *)(a))[(i) / NBBY] |= 1 << ((i) % NBBY))
+#define	isset(a, i)							\
+	(((const uint8_t *)(a))[(i) / NBBY] & (1 << ((i) % NBBY)))
+#endif
+
+#define	EDOOFUS		88
+#define	ENOIOCTL	(-3)
+
+typedef void *device_t;
+
+/* Diagnostics */
+#define	KASSERT(exp, msg) do {						\
+	if (__predict_false(!(exp)))					\
+		panic msg;						\
+} while (0)
+void	panic(const char *, ...) __attribute__((__noreturn__));
+int	device_printf(device_t, const char *, ...);
+
+static __inline uint32_t
+bitcount32(uint32_t x)
+{
+
+	return (__builtin_popcount(x));
+}
+
+uint32_t crc32(const void *, size_t);
+
+static __inline void
+le32enc(void *pp, uint32_t v)
+{
+	uint8_t *p = pp;
+
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static __inline uint32_t
+le32dec(const void *pp)
+{
+	const uint8_t *p = pp;
+
+	return ((uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]);
+}
+
+/* Time */
+extern int hz;
+extern int tick;
+extern int ticks;
+extern int cold;
+void	DELAY(int);
+#define	nanouptime(ts)	clock_gettime(CLOCK_MONOTONIC, (ts))
+
+/* Memory */
+struct malloc_type {
+	const char	*ks_shortdesc;
+};
+#define	MALLOC_DEFINE(type, shortdesc, longdesc)			\
+	struct malloc_type type[1] = { { shortdesc } }
+#define	MALLOC_DECLARE(type)	extern struct malloc_type type[1]
+#define	M_NOWAIT	0x0001
+#define	M_WAITOK	0x0002
+#define	M_ZERO		0x0100
+void	*kshim_malloc(size_t, struct malloc_type *, int);
+void	kshim_free(void *, struct malloc_type *);
+#define	malloc(size, type, flags)	kshim_malloc((size), (type), (flags))
+#define	free(addr, type)		kshim_free((addr), (type))
+
+void	*hashinit(int, struct malloc_type *, u_long *);
+void	hashdestroy(void *, struct malloc_type *, u_long);
+
+typedef struct uma_zone *uma_zone_t;
+typedef int (*uma_ctor)(void *, int, void *, int);
+typedef void (*uma_dtor)(void *, int, void *);
+typedef int (*uma_init)(void *, int, int);
+typedef void (*uma_fini)(void *, int);
+uma_zone_t uma_zcreate(const char *, size_t, uma_ctor, uma_dtor, uma_init,
+	    uma_fini, int, uint32_t);
+void	uma_zdestroy(uma_zone_t);
+void	*uma_zalloc(uma_zone_t, int);
+void	uma_zfree(uma_zone_t, void *);
+#define	uma_zone_set_max(zone, nitems)	((void)(zone), (void)(nitems))
+
+/* Locks and sleeping */
+struct mtx {
+	pthread_mutex_t	mtx_m;
+	int		mtx_inited;
+};
+#define	MTX_DEF		0
+#define	MA_OWNED	1
+#define	MA_NOTOWNED	2
+void	mtx_init(struct mtx *, const char *, const char *, int);
+void	mtx_destroy(struct mtx *);
+void	mtx_lock(struct mtx *);
+void	mtx_unlock(struct mtx *);
+#define	mtx_initialized(m)	((m)->mtx_inited)
+#define	mtx_assert(m, what)
+
+/* Only exclusive locking is used so an sx lock is a plain mutex */
+struct sx {
+	struct mtx	sx_m;
+};
+#define	SA_XLOCKED	1
+#define	sx_init(sx, name)	mtx_init(&(sx)->sx_m, (name), NULL, MTX_DEF)
+#define	sx_destroy(sx)		mtx_destroy(&(sx)->sx_m)
+#define	sx_xlock(sx)		mtx_lock(&(sx)->sx_m)
+#define	sx_xunlock(sx)		mtx_unlock(&(sx)->sx_m)
+#define	sx_assert(sx, what)
+#define	SX_SYSINIT(name, sx, desc)					\
+static void __attribute__((__constructor__(203)))			\
+name##_sx_sysinit(void)							\
+{									\
+	sx_init((sx), (desc));						\
+}
+
+#define	PRIBIO		16
+int	msleep(void *, struct mtx *, int, const char *, int);
+int	kshim_pause(const char *, int);
+#define	pause(wmesg, timo)	kshim_pause((wmesg), (timo))
+void	wakeup(void *);
+
+/* Each pending callout runs on a thread of its own */
+struct callout {
+	struct mtx	*c_mtx;
+	int		c_gen;		/* Bumped to cancel pending calls */
+	int		c_running;	/* Threads yet to finish */
+};
+void	callout_init_mtx(struct callout *, struct mtx *, int);
+int	callout_reset(struct callout *, int, void (*)(void *), void *);
+int	callout_stop(struct callout *);
+int	callout_drain(struct callout *);
+
+struct proc {
+	pthread_t	p_thread;
+};
+int	kproc_create(void (*)(void *), void *, struct proc **, int, int,
+	    const char *, ...);
+void	kproc_exit(int) __attribute__((__noreturn__));
+
+/* Modules are loaded by calling <name>_modevent() */
+#define	MOD_LOAD	1
+#define	MOD_UNLOAD	2
+#define	DEV_MODULE(name, evh, arg)					\
+int name##_modevent(int);						\
+int									\
+name##_modevent(int what)						\
+{									\
+	return (evh(NULL, what, arg));					\
+}
+#define	MODULE_VERSION(name, ver)
+#define	MODULE_DEPEND(name, busname, vmin, vpref, vmax)
+typedef void *module_t;
+
+/* I/O requests and disks */
+#define	BIO_READ	0x01
+#define	BIO_WRITE	0x02
+#define	BIO_DELETE	0x04
+#define	BIO_GETATTR	0x08
+#define	BIO_FLUSH	0x10
+#define	BIO_ERROR	0x01
+#define	BIO_DONE	0x02
+
+struct disk;
+struct bio {
+	uint8_t		bio_cmd;
+	uint8_t		bio_flags;
+	struct disk	*bio_disk;
+	off_t		bio_offset;
+	long		bio_bcount;
+	caddr_t		bio_data;
+	int		bio_error;
+	long		bio_resid;
+	void		(*bio_done)(struct bio *);
+	void		*bio_caller1;
+	const char	*bio_attribute;
+	off_t		bio_length;
+	long		bio_completed;
+	TAILQ_ENTRY(bio) bio_queue;
+};
+
+struct bio_queue_head {
+	TAILQ_HEAD(bio_queue, bio) queue;
+};
+void	bioq_init(struct bio_queue_head *);
+void	bioq_insert_tail(struct bio_queue_head *, struct bio *);
+struct bio *bioq_first(struct bio_queue_head *);
+struct bio *bioq_takefirst(struct bio_queue_head *);
+void	biodone(struct bio *);
+void	biofinish(struct bio *, void *, int);
+
+typedef void disk_strategy_t(struct bio *);
+typedef disk_strategy_t d_strategy_t;
+#define	DISK_VERSION		0
+#define	DISKFLAG_CANDELETE	0x4
+struct disk {
+	const char	*d_name;
+	int		d_unit;
+	int		d_flags;
+	disk_strategy_t	*d_strategy;
+	u_int		d_sectorsize;
+	off_t		d_mediasize;
+	u_int		d_maxsize;
+	void		*d_drv1;
+	TAILQ_ENTRY(disk) d_list;
+};
+struct disk *disk_alloc(void);
+void	disk_create(struct disk *, int);
+void	disk_destroy(struct disk *);
+int	g_handleattr_int(struct bio *, const char *, int);
+struct disk *kshim_disk_find(const char *, int);
+
+/* Sysctls, looked up by name with kshim_sysctl() */
+#define	CTLTYPE_NODE	1
+#define	CTLTYPE_INT	2
+#define	CTLTYPE_STRING	3
+#define	CTLTYPE_UINT	6
+#define	CTLTYPE_LONG	7
+#define	CTLTYPE_ULONG	8
+#define	CTLTYPE_U64	9
+#define	CTLTYPE_MASK	0xf
+#define	CTLFLAG_RD	0x80000000
+#define	CTLFLAG_WR	0x40000000
+#define	CTLFLAG_RW	(CTLFLAG_RD | CTLFLAG_WR)
+#define	OID_AUTO	(-1)
+
+struct sysctl_req {
+	void		*oldptr;
+	size_t		oldlen;
+	size_t		oldidx;
+	const void	*newptr;
+	size_t		newlen;
+	size_t		newidx;
+};
+
+struct sysctl_oid;
+#define	SYSCTL_HANDLER_ARGS	struct sysctl_oid *oidp, void *arg1,	\
+	intptr_t arg2, struct sysctl_req *req
+typedef int (*sysctl_handler_t)(SYSCTL_HANDLER_ARGS);
+
+struct sysctl_oid_list {
+	TAILQ_HEAD(, sysctl_oid) head;
+};
+
+struct sysctl_oid {
+	const char	*oid_name;
+	int		oid_kind;
+	void		*oid_arg1;
+	intptr_t	oid_arg2;
+	sysctl_handler_t oid_handler;
+	struct sysctl_oid_list oid_children;
+	struct sysctl_oid_list *oid_parent;
+	TAILQ_ENTRY(sysctl_oid) oid_link;
+	TAILQ_ENTRY(sysctl_oid) oid_ctx_link;
+};
+
+/* The oids added with a context, freed newest first */
+struct sysctl_ctx_list {
+	TAILQ_HEAD(, sysctl_oid) head;
+};
+
+int	sysctl_ctx_init(struct sysctl_ctx_list *);
+int	sysctl_ctx_free(struct sysctl_ctx_list *);
+struct sysctl_oid *kshim_sysctl_add(struct sysctl_ctx_list *,
+	    struct sysctl_oid_list *, const char *, int, void *, intptr_t,
+	    sysctl_handler_t);
+void	kshim_sysctl_link(struct sysctl_oid_list *, struct sysctl_oid *);
+int	kshim_sysctl(const char *, void *, size_t *, const void *, size_t);
+int	sysctl_handle_int(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_long(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_64(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_string(SYSCTL_HANDLER_ARGS);
+int	SYSCTL_OUT(struct sysctl_req *, const void *, size_t);
+int	SYSCTL_IN(struct sysctl_req *, void *, size_t);
+
+extern struct sysctl_oid sysctl__hw;
+#define	SYSCTL_CHILDREN(oid)		(&(oid)->oid_children)
+#define	SYSCTL_STATIC_CHILDREN(parent)	(&sysctl_##parent.oid_children)
+#define	SYSCTL_NODE(parent, nbr, name, access, handler, descr)		\
+struct sysctl_oid sysctl_##parent##_##name = { .oid_name = #name,	\
+    .oid_kind = CTLTYPE_NODE };						\
+static void __attribute__((__constructor__(201)))			\
+sysctl_init_##parent##_##name(void)					\
+{									\
+	TAILQ_INIT(&sysctl_##parent##_##name.oid_children.head);	\
+	kshim_sysctl_link(SYSCTL_STATIC_CHILDREN(parent),		\
+	    &sysctl_##parent##_##name);					\
+}
+
+#define	SYSCTL_INT(parent, nbr, name, access, ptr, val, descr)		\
+static void __attribute__((__constructor__(202)))			\
+sysctl_init_##parent##_##name(void)					\
+{									\
+	SYSCTL_ADD_INT(NULL, SYSCTL_STATIC_CHILDREN(parent), (nbr),	\
+	    #name, (access), (ptr), (val), (descr));			\
+}
+#define	SYSCTL_UQUAD(parent, nbr, name, access, ptr, val, descr)	\
+	SYSCTL_PROC(parent, nbr, name, CTLTYPE_U64 | (access), ptr,	\
+	    val, sysctl_handle_64, "QU", descr)
+#define	SYSCTL_PROC(parent, nbr, name, access, ptr, arg, handler, fmt,	\
+    descr)								\
+static void __attribute__((__constructor__(202)))			\
+sysctl_init_##parent##_##name(void)					\
+{									\
+	SYSCTL_ADD_PROC(NULL, SYSCTL_STATIC_CHILDREN(parent), (nbr),	\
+	    #name, (access), (ptr), (arg), (handler), (fmt), (descr));	\
+}
+
+#define	SYSCTL_ADD_NODE(ctx, parent, nbr, name, access, handler, descr)	\
+	kshim_sysctl_add((ctx), (parent), (name), CTLTYPE_NODE, NULL, 0, NULL)
+#define	SYSCTL_ADD_INT(ctx, parent, nbr, name, access, ptr, val, descr)	\
+	kshim_sysctl_add((ctx), (parent), (name), CTLTYPE_INT, (ptr),	\
+	    (val), sysctl_handle_int)
+#define	SYSCTL_ADD_UINT(ctx, parent, nbr, name, access, ptr, val, descr) \
+	kshim_sysctl_add((ctx), (parent), (name), CTLTYPE_UINT, (ptr),	\
+	    (val), sysctl_handle_int)
+#define	SYSCTL_ADD_ULONG(ctx, parent, nbr, name, access, ptr, descr)	\
+	kshim_sysctl_add((ctx), (parent), (name), CTLTYPE_ULONG, (ptr),	\
+	    0, sysctl_handle_long)
+#define	SYSCTL_ADD_UQUAD(ctx, parent, nbr, name, access, ptr, descr)	\
+	kshim_sysctl_add((ctx), (parent), (name), CTLTYPE_U64, (ptr),	\
+	    0, sysctl_handle_64)
+#define	SYSCTL_ADD_PROC(ctx, parent, nbr, name, access, ptr, arg,	\
+    handler, fmt, descr)						\
+	kshim_sysctl_add((ctx), (parent), (name),			\
+	    (access) & CTLTYPE_MASK, (ptr), (arg), (handler))
+
+/*
+ * Tunables are read from the environment. Static ones are fetched
+ * by kshim_tunables_load() so a program can set them up first.
+ */
+struct kshim_tunable {
+	const char	*kt_path;
+	int		*kt_var;
+	char		*kt_str;
+	size_t		 kt_size;
+	SLIST_ENTRY(kshim_tunable) kt_link;
+};
+void	kshim_tunable_register(struct kshim_tunable *);
+void	kshim_tunables_load(void);
+int	kshim_tunable_fetch(const char *, int *);
+int	kshim_tunable_str_fetch(const char *, char *, size_t);
+#define	KSHIM_CAT2(a, b)	a##b
+#define	KSHIM_CAT(a, b)		KSHIM_CAT2(a, b)
+#define	TUNABLE_INT(path, var)						\
+static struct kshim_tunable KSHIM_CAT(kshim_tunable_, __LINE__) = {	\
+    .kt_path = (path), .kt_var = (var) };				\
+static void __attribute__((__constructor__(203)))			\
+KSHIM_CAT(kshim_tunable_init_, __LINE__)(void)				\
+{									\
+	kshim_tunable_register(&KSHIM_CAT(kshim_tunable_, __LINE__));	\
+}
+#define	TUNABLE_INT_FETCH(path, var)	kshim_tunable_fetch((path), (var))
+#define	TUNABLE_STR_FETCH(path, var, size)				\
+	kshim_tunable_str_fetch((path), (var), (size))
+#define	TUNABLE_STR(path, var, size)					\
+static struct kshim_tunable KSHIM_CAT(kshim_tunable_, __LINE__) = {	\
+    .kt_path = (path), .kt_str = (var), .kt_size = (size) };		\
+static void __attribute__((__constructor__(203)))			\
+KSHIM_CAT(kshim_tunable_init_, __LINE__)(void)				\
+{									\
+	kshim_tunable_register(&KSHIM_CAT(kshim_tunable_, __LINE__));	\
+}
+
+/*
+ * Vnodes are file descriptors and the lookup is open(2). There is only
+ * one thread and one set of credentials.
+ */
+#define	VREG		1
+#define	VOTHER		2
+struct vnode {
+	int		v_fd;
+	int		v_type;
+};
+struct vattr {
+	off_t		va_size;
+};
+struct ucred;
+struct thread {
+	struct ucred	*td_ucred;
+};
+extern struct thread kshim_thread;
+#define	curthread	(&kshim_thread)
+#define	NOCRED		((struct ucred *)0)
+
+struct nameidata {
+	const char	*ni_dirp;
+	struct vnode	*ni_vp;
+};
+#define	LOOKUP		0
+#define	FOLLOW		0
+#define	UIO_SYSSPACE	0
+#define	NDF_ONLY_PNBUF	0
+#define	NDINIT(ndp, op, flags, seg, path, td)				\
+	((ndp)->ni_dirp = (path), (ndp)->ni_vp = NULL)
+#define	NDFREE(ndp, flags)	do { } while (0)
+#ifndef FREAD
+#define	FREAD		0x0001
+#define	FWRITE		0x0002
+#endif
+
+enum uio_rw { UIO_READ, UIO_WRITE };
+
+int	vn_open(struct nameidata *, int *, int, void *);
+int	vn_close(struct vnode *, int, struct ucred *, struct thread *);
+int	vn_rdwr(enum uio_rw, struct vnode *, void *, int, off_t, int, int,
+	    struct ucred *, struct ucred *, int *, struct thread *);
+int	VOP_GETATTR(struct vnode *, struct vattr *, struct ucred *);
+#define	VOP_UNLOCK(vp, flags)	do { } while (0)
+#define	IO_NODELOCKED	0x0008
+#ifndef MAXBSIZE
+#define	MAXBSIZE	65536
+#endif
+
+#endif /* !_KSHIM_H_ */
@@ -0,0 +1,741 @@
+/*
+ * Copyright (C) 2009 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Measures the NAND driver running on nandsim as a userland program.
+ * Each workload is a run of synchronous requests to the nand disk, or
+ * the nandftl disk with -F, and reports the IOPS, MB/s and latency
+ * percentiles seen. Sequential and random reads and writes move -s
+ * pages each, erases work on a block from every LUN.
+ *
+ * The raw disk can't be rewritten so the region used is erased
+ * before writes and written before reads when it isn't already, none
+ * of which is timed. Driver and nandsim tunables may be set with -o,
+ * e.g. -o hw.nandsim.t_read=25 -o hw.nand.0.cache_entries=0. With
+ * hw.nandsim.virtual_clock set times are from the simulator's clock.
+ * Tunables of one instance are hw.nandsim.<unit>.<name>.
+ *
+ * With -i the workload runs on that many nandsim instances at once, a
+ * thread for each, and the rates seen by each are added up.
+ *
+ * With -v each page is written with a pattern made from its LBA and the
+ * workload writing it, every page read is checked against what was
+ * last written there and the region is read back after each workload.
+ * Making and checking the patterns is between the timed requests, so
+ * rates in real time drop.
+ *
+ * The remount workload detaches each NAND device and attaches it again
+ * with the simulated arrays as they were, timing the attach. With -F
+ * that is the FTL rebuilding its map from the spare areas and with -v
+ * the region is then read back. With -F the region defaults to the
+ * whole disk, so the writes before it wrap around and make the FTL
+ * collect garbage.
+ */
+
+#include "kshim.h"
+
+#include <err.h>
+#include <unistd.h>
+
+/* The benchmark itself uses the libc allocator */
+#undef malloc
+#undef free
+
+int	nand_modevent(int);
+int	nandsim_modevent(int);
+
+#define	REGION_ERASED	0
+#define	REGION_WRITTEN	1
+#define	REGION_UNKNOWN	2
+
+/* The generation of a page never written or erased by the benchmark */
+#define	GEN_ERASED	0
+#define	GEN_UNKNOWN	0xFFFFFFFF
+
+/* The command of the remount workload, it sends no request */
+#define	CMD_REMOUNT	(-1)
+
+static const struct workload {
+	const char	*name;
+	int		cmd;
+	int		random;
+} workloads[] = {
+	{ "erase",	BIO_DELETE,	0 },
+	{ "seqwrite",	BIO_WRITE,	0 },
+	{ "seqread",	BIO_READ,	0 },
+	{ "randread",	BIO_READ,	1 },
+	{ "randwrite",	BIO_WRITE,	1 },
+	{ "remount",	CMD_REMOUNT,	0 },
+	{ NULL,		0,		0 }
+};
+
+/* A disk the workloads run on */
+struct target {
+	struct disk	*dp;
+	int		unit;		/* Of nandsim */
+	int		nand_unit;
+	u_long		gc_copies;	/* Of the NAND units before this one */
+	u_long		gc_blocks;
+	int		virtual_clock;
+	int		region_state;
+	uint8_t		*buf;
+	uint8_t		*expect;	/* A page to check reads against */
+	uint32_t	*gens;		/* The workload that wrote each page */
+	pthread_t	thread;
+
+	/* The current run */
+	const struct workload *wl;
+	long		len;
+	long		n;
+	off_t		*offsets;
+	uint64_t	*lat;
+	uint64_t	start;
+	uint64_t	end;
+};
+
+static struct target *targets;
+static int ntargets = 1;
+static int ftl;
+static int verify;
+static uint32_t generation;	/* Of the current workload */
+static off_t region_size;	/* Bytes of each disk used */
+static long io_size;		/* Bytes in each read or write */
+static long count;		/* Requests in a run, 0 for the region */
+static int nand_units;		/* NAND units attached so far */
+
+static void	set_tunable(const char *, const char *);
+static void	target_disk(struct target *);
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cv = PTHREAD_COND_INITIALIZER;
+
+static void
+io_done(struct bio *bp)
+{
+
+	pthread_mutex_lock(&io_lock);
+	pthread_cond_broadcast(&io_cv);
+	pthread_mutex_unlock(&io_lock);
+}
+
+static int
+io(struct target *t, int cmd, off_t offset, long len)
+{
+	struct bio bp;
+
+	memset(&bp, 0, sizeof(bp));
+	bp.bio_cmd = cmd;
+	bp.bio_offset = offset;
+	bp.bio_bcount = len;
+	bp.bio_length = len;
+	bp.bio_data = (caddr_t)t->buf;
+	bp.bio_disk = t->dp;
+	bp.bio_done = io_done;
+	t->dp->d_strategy(&bp);
+
+	pthread_mutex_lock(&io_lock);
+	while ((bp.bio_flags & BIO_DONE) == 0)
+		pthread_cond_wait(&io_cv, &io_lock);
+	pthread_mutex_unlock(&io_lock);
+	return ((bp.bio_flags & BIO_ERROR) != 0 ? bp.bio_error : 0);
+}
+
+/*
+ * The data a page should hold, an xorshift sequence seeded by the LBA
+ * and the workload that wrote it
+ */
+static void
+pattern(struct target *t, off_t lba, uint8_t *buf)
+{
+	uint64_t x;
+	u_int i;
+
+	if (t->gens[lba] == GEN_ERASED) {
+		memset(buf, 0xFF, t->dp->d_sectorsize);
+		return;
+	}
+	x = ((uint64_t)t->gens[lba] << 32 | (uint64_t)lba) *
+	    0x9E3779B97F4A7C15ULL + 1;
+	for (i = 0; i < t->dp->d_sectorsize; i += sizeof(x)) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(&buf[i], &x, sizeof(x));
+	}
+}
+
+/* Records a write or delete and fills the buffer to write */
+static void
+verify_start(struct target *t, int cmd, off_t offset, long len)
+{
+	off_t lba;
+	long i;
+
+	lba = offset / t->dp->d_sectorsize;
+	for (i = 0; i < len / t->dp->d_sectorsize; i++, lba++) {
+		if (cmd == BIO_DELETE) {
+			t->gens[lba] = GEN_ERASED;
+		} else if (cmd == BIO_WRITE) {
+			t->gens[lba] = generation;
+			pattern(t, lba, &t->buf[i * t->dp->d_sectorsize]);
+		}
+	}
+}
+
+/* Checks the pages read are as last written */
+static void
+verify_done(struct target *t, int cmd, off_t offset, long len)
+{
+	off_t lba;
+	long i;
+
+	if (cmd != BIO_READ)
+		return;
+	lba = offset / t->dp->d_sectorsize;
+	for (i = 0; i < len / t->dp->d_sectorsize; i++, lba++) {
+		if (t->gens[lba] == GEN_UNKNOWN)
+			continue;
+		pattern(t, lba, t->expect);
+		if (memcmp(&t->buf[i * t->dp->d_sectorsize], t->expect,
+		    t->dp->d_sectorsize) != 0)
+			errx(1, "Page %jd of instance %d read back wrong",
+			    (intmax_t)lba, t->unit);
+	}
+}
+
+/* Runs a request over the whole region, the last may be shorter */
+static void
+fill(struct target *t, int cmd, long len)
+{
+	off_t offset;
+	long n;
+	int error;
+
+	for (offset = 0; offset < region_size; offset += n) {
+		n = MIN(len, region_size - offset);
+		if (verify)
+			verify_start(t, cmd, offset, n);
+		error = io(t, cmd, offset, n);
+		if (error != 0)
+			errx(1, "Unable to prepare the region at %jd: %s",
+			    (intmax_t)offset, strerror(error));
+		if (verify)
+			verify_done(t, cmd, offset, n);
+	}
+}
+
+static uint64_t
+nsecs(struct target *t)
+{
+	struct timespec ts;
+	uint64_t now;
+	char name[32];
+	size_t len;
+
+	if (t->virtual_clock) {
+		snprintf(name, sizeof(name), "hw.nandsim.%d.clock", t->unit);
+		len = sizeof(now);
+		if (kshim_sysctl(name, &now, &len, NULL, 0) != 0)
+			errx(1, "Unable to read the simulator clock");
+		return (now);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static int
+cmp_lat(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return (x < y ? -1 : x > y);
+}
+
+/* The latency below which a fraction pct / 1000 of requests finished */
+static double
+percentile(const uint64_t *lat, long n, int pct)
+{
+	long i;
+
+	i = (n * pct + 999) / 1000 - 1;
+	return (lat[MAX(i, 0)] / 1e3);
+}
+
+/* Reads a counter of the FTL on the NAND unit of t */
+static u_long
+ftl_stat(struct target *t, const char *stat)
+{
+	char name[48];
+	u_long val;
+	size_t len;
+
+	snprintf(name, sizeof(name), "hw.nand.%d.ftl.%s", t->nand_unit, stat);
+	len = sizeof(val);
+	if (kshim_sysctl(name, &val, &len, NULL, 0) != 0)
+		return (0);
+	return (val);
+}
+
+/*
+ * Attaches the NAND device of t again. It comes back as the next NAND
+ * unit, so the tunables of the old unit are given to it first.
+ */
+static void
+remount(struct target *t)
+{
+	extern char **environ;
+	char **envp, *env, name[48], prefix[32];
+	size_t len;
+	int error, one, unit;
+
+	unit = nand_units++;
+	len = snprintf(prefix, sizeof(prefix), "hw.nand.%d.", t->nand_unit);
+	envp = environ;
+	while (*envp != NULL) {
+		if (strncmp(*envp, prefix, len) != 0) {
+			envp++;
+			continue;
+		}
+		env = strdup(*envp + len);
+		if (env == NULL)
+			err(1, "strdup");
+		*strchr(env, '=') = '\0';
+		snprintf(name, sizeof(name), "hw.nand.%d.%s", unit, env);
+		if (getenv(name) != NULL) {
+			free(env);
+			envp++;
+			continue;
+		}
+		set_tunable(name, env + strlen(env) + 1);
+		free(env);
+		/* setenv() may have moved environ, start again */
+		envp = environ;
+	}
+
+	t->gc_copies += ftl_stat(t, "gc_copies");
+	t->gc_blocks += ftl_stat(t, "gc_blocks");
+	snprintf(name, sizeof(name), "hw.nandsim.%d.reattach", t->unit);
+	one = 1;
+	error = kshim_sysctl(name, NULL, NULL, &one, sizeof(one));
+	if (error != 0)
+		errx(1, "Unable to attach instance %d again: %s", t->unit,
+		    strerror(error));
+	target_disk(t);
+	if (t->nand_unit != unit)
+		errx(1, "Instance %d came back as nand%d rather than nand%d",
+		    t->unit, t->nand_unit, unit);
+}
+
+/* The timed part of a run on one disk */
+static void *
+run(void *arg)
+{
+	struct target *t;
+	long i;
+	int error;
+
+	t = arg;
+	t->start = nsecs(t);
+	if (t->wl->cmd == CMD_REMOUNT) {
+		t->lat[0] = t->start;
+		remount(t);
+		t->end = nsecs(t);
+		t->lat[0] = t->end - t->lat[0];
+		return (NULL);
+	}
+	for (i = 0; i < t->n; i++) {
+		if (verify)
+			verify_start(t, t->wl->cmd, t->offsets[i], t->len);
+		t->lat[i] = nsecs(t);
+		error = io(t, t->wl->cmd, t->offsets[i], t->len);
+		if (error != 0)
+			errx(1, "%s at %jd: %s", t->wl->name,
+			    (intmax_t)t->offsets[i], strerror(error));
+		t->lat[i] = nsecs(t) - t->lat[i];
+		if (verify)
+			verify_done(t, t->wl->cmd, t->offsets[i], t->len);
+	}
+	t->end = nsecs(t);
+	return (NULL);
+}
+
+static void
+prepare(struct target *t, const struct workload *wl)
+{
+	off_t tmp;
+	long i, j, slots;
+
+	t->wl = wl;
+	if (wl->cmd == CMD_REMOUNT) {
+		t->len = 0;
+		t->n = 1;
+		t->offsets = calloc(1, sizeof(*t->offsets));
+		t->lat = calloc(1, sizeof(*t->lat));
+		if (t->offsets == NULL || t->lat == NULL)
+			err(1, "calloc");
+		/* The FTL forgets deletes, the old data may come back */
+		for (i = 0; ftl && verify &&
+		    i < region_size / t->dp->d_sectorsize; i++)
+			if (t->gens[i] == GEN_ERASED)
+				t->gens[i] = GEN_UNKNOWN;
+		return;
+	}
+
+	/* Erases work on whole disk blocks, everything else on io_size */
+	t->len = (wl->cmd == BIO_DELETE) ? t->dp->d_maxsize : io_size;
+	slots = region_size / t->len;
+
+	if (!ftl) {
+		if (wl->cmd == BIO_READ && t->region_state != REGION_WRITTEN) {
+			if (t->region_state != REGION_ERASED)
+				fill(t, BIO_DELETE, t->dp->d_maxsize);
+			fill(t, BIO_WRITE, io_size);
+		} else if (wl->cmd == BIO_WRITE &&
+		    t->region_state != REGION_ERASED)
+			fill(t, BIO_DELETE, t->dp->d_maxsize);
+	}
+
+	/*
+	 * Writes to the raw disk only go to erased pages so may not
+	 * cover the region more than once.
+	 */
+	t->n = (count > 0) ? count : slots;
+	if (!ftl && wl->cmd != BIO_READ)
+		t->n = MIN(t->n, slots);
+
+	t->offsets = malloc(t->n * sizeof(*t->offsets));
+	t->lat = malloc(t->n * sizeof(*t->lat));
+	if (t->offsets == NULL || t->lat == NULL)
+		err(1, "malloc");
+	for (i = 0; i < t->n; i++)
+		t->offsets[i] = (i % slots) * t->len;
+	if (wl->random) {
+		/* A shuffle, so random writes still hit each slot once */
+		for (i = t->n - 1; i > 0; i--) {
+			j = random() % (i + 1);
+			tmp = t->offsets[i];
+			t->offsets[i] = t->offsets[j];
+			t->offsets[j] = tmp;
+		}
+	}
+}
+
+static void
+bench(const struct workload *wl)
+{
+	struct target *t;
+	uint64_t *lat;
+	double iops, mbps, secs;
+	long n;
+	int error, i;
+
+	generation++;
+	for (i = 0; i < ntargets; i++)
+		prepare(&targets[i], wl);
+
+	/* NAND units are numbered in the order they attach */
+	if (ntargets == 1 || wl->cmd == CMD_REMOUNT) {
+		for (i = 0; i < ntargets; i++)
+			run(&targets[i]);
+	} else {
+		for (i = 0; i < ntargets; i++) {
+			error = pthread_create(&targets[i].thread, NULL, run,
+			    &targets[i]);
+			if (error != 0)
+				errx(1, "pthread_create: %s", strerror(error));
+		}
+		for (i = 0; i < ntargets; i++)
+			pthread_join(targets[i].thread, NULL);
+	}
+
+	/* Each disk may have a clock of its own so the rates are added */
+	n = 0;
+	iops = mbps = 0;
+	for (i = 0; i < ntargets; i++) {
+		t = &targets[i];
+		secs = (t->end - t->start) / 1e9;
+		iops += t->n / secs;
+		mbps += (double)t->n * t->len / secs / 1e6;
+		n += t->n;
+		if (wl->cmd == BIO_DELETE)
+			t->region_state = REGION_ERASED;
+		else if (wl->cmd == BIO_WRITE)
+			t->region_state = REGION_WRITTEN;
+	}
+	lat = malloc(n * sizeof(*lat));
+	if (lat == NULL)
+		err(1, "malloc");
+	for (n = 0, i = 0; i < ntargets; i++) {
+		t = &targets[i];
+		memcpy(&lat[n], t->lat, t->n * sizeof(*lat));
+		n += t->n;
+		free(t->lat);
+		free(t->offsets);
+	}
+
+	qsort(lat, n, sizeof(*lat), cmp_lat);
+	printf("%-10s %8ld %8ld %10.0f %9.2f %9.1f %9.1f %9.1f\n",
+	    wl->name, n, targets[0].len, iops, mbps, percentile(lat, n, 500),
+	    percentile(lat, n, 990), percentile(lat, n, 999));
+
+	free(lat);
+
+	/* Catch requests that damaged pages they were not meant to touch */
+	for (i = 0; verify && i < ntargets; i++)
+		fill(&targets[i], BIO_READ, io_size);
+}
+
+static const struct workload *
+find_workload(const char *name)
+{
+	const struct workload *wl;
+
+	for (wl = workloads; wl->name != NULL; wl++)
+		if (strcmp(wl->name, name) == 0)
+			return (wl);
+	return (NULL);
+}
+
+static void
+set_tunable(const char *name, const char *value)
+{
+
+	if (setenv(name, value, 1) != 0)
+		err(1, "setenv");
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: nandbench [-Fv] [-d device] [-i instances] "
+	    "[-l luns] [-n count]\n"
+	    "                 [-o name=value] [-r blocks] [-s pages] "
+	    "[workload ...]\n"
+	    "workloads: erase seqwrite seqread randread randwrite "
+	    "remount\n");
+	exit(1);
+}
+
+/* Finds the disk of the nandsim instance of t */
+static void
+target_disk(struct target *t)
+{
+	char name[48];
+	size_t len;
+
+	snprintf(name, sizeof(name), "hw.nandsim.%d.nand_unit", t->unit);
+	len = sizeof(t->nand_unit);
+	if (kshim_sysctl(name, &t->nand_unit, &len, NULL, 0) != 0)
+		errx(1, "No nandsim instance %d", t->unit);
+	t->dp = kshim_disk_find(ftl ? "nandftl" : "nand", t->nand_unit);
+	if (t->dp == NULL)
+		errx(1, "No %s%d disk was created", ftl ? "nandftl" : "nand",
+		    t->nand_unit);
+	if (t->dp->d_sectorsize != targets[0].dp->d_sectorsize ||
+	    t->dp->d_maxsize != targets[0].dp->d_maxsize)
+		errx(1, "The instances have different geometries");
+}
+
+/* Finds the disk of a nandsim instance and sets it up */
+static void
+target_init(struct target *t, int unit)
+{
+	char name[48];
+	size_t len;
+	long i;
+
+	t->unit = unit;
+	target_disk(t);
+
+	/* Rates are added up so must all be in the same time */
+	snprintf(name, sizeof(name), "hw.nandsim.%d.virtual_clock", unit);
+	len = sizeof(t->virtual_clock);
+	if (kshim_sysctl(name, &t->virtual_clock, &len, NULL, 0) != 0)
+		t->virtual_clock = 0;
+	if (t->virtual_clock != targets[0].virtual_clock)
+		errx(1, "The instances have different clocks");
+	t->region_state = REGION_UNKNOWN;
+	t->buf = malloc(t->dp->d_maxsize);
+	if (t->buf == NULL)
+		err(1, "malloc");
+	for (i = 0; i < (long)t->dp->d_maxsize; i++)
+		t->buf[i] = random();
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct workload *wl;
+	struct disk *dp;
+	uint64_t capacity, resident, val;
+	u_long gc_blocks, gc_copies;
+	char name[32], *value;
+	size_t len;
+	long blocks, pages;
+	int ch, i;
+
+	blocks = 0;
+	pages = 1;
+	while ((ch = getopt(argc, argv, "Fd:i:l:n:o:r:s:v")) != -1) {
+		switch (ch) {
+		case 'F':
+			ftl = 1;
+			break;
+		case 'd':
+			set_tunable("hw.nandsim.device", optarg);
+			break;
+		case 'i':
+			ntargets = strtol(optarg, NULL, 0);
+			if (ntargets <= 0)
+				usage();
+			set_tunable("hw.nandsim.instances", optarg);
+			break;
+		case 'l':
+			set_tunable("hw.nandsim.luns", optarg);
+			break;
+		case 'n':
+			count = strtol(optarg, NULL, 0);
+			if (count <= 0)
+				usage();
+			break;
+		case 'o':
+			value = strchr(optarg, '=');
+			if (value == NULL)
+				usage();
+			*value++ = '\0';
+			set_tunable(optarg, value);
+			break;
+		case 'r':
+			blocks = strtol(optarg, NULL, 0);
+			if (blocks <= 0)
+				usage();
+			break;
+		case 's':
+			pages = strtol(optarg, NULL, 0);
+			if (pages <= 0)
+				usage();
+			break;
+		case 'v':
+			verify = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	for (i = 0; i < argc; i++)
+		if (find_workload(argv[i]) == NULL)
+			usage();
+	/* The NAND devices are numbered as the instances are attached */
+	for (i = 0; ftl && i < ntargets; i++) {
+		snprintf(name, sizeof(name), "hw.nand.%d.ftl", i);
+		set_tunable(name, "1");
+	}
+
+	kshim_tunables_load();
+	if (nand_modevent(MOD_LOAD) != 0 || nandsim_modevent(MOD_LOAD) != 0)
+		errx(1, "Unable to attach the simulated chip");
+	targets = calloc(ntargets, sizeof(*targets));
+	if (targets == NULL)
+		err(1, "calloc");
+	for (i = 0; i < ntargets; i++)
+		target_init(&targets[i], i);
+	nand_units = ntargets;
+	dp = targets[0].dp;
+
+	/* Disk blocks are one block from each LUN */
+	if (blocks == 0)
+		blocks = ftl ? dp->d_mediasize / dp->d_maxsize : 256;
+	region_size = MIN((off_t)blocks * dp->d_maxsize,
+	    dp->d_mediasize / dp->d_maxsize * dp->d_maxsize);
+	io_size = pages * dp->d_sectorsize;
+	if (io_size > dp->d_maxsize || region_size < io_size)
+		errx(1, "%ld pages is larger than a disk block", pages);
+	for (i = 0; verify && i < ntargets; i++) {
+		pages = region_size / dp->d_sectorsize;
+		targets[i].gens = malloc(pages * sizeof(*targets[i].gens));
+		targets[i].expect = malloc(dp->d_sectorsize);
+		if (targets[i].gens == NULL || targets[i].expect == NULL)
+			err(1, "malloc");
+		while (pages-- > 0)
+			targets[i].gens[pages] = GEN_UNKNOWN;
+	}
+
+	printf("%s: %u byte pages, %u byte blocks, %jd of %jd bytes used%s\n",
+	    ftl ? "nandftl" : "nand", dp->d_sectorsize, dp->d_maxsize,
+	    (intmax_t)region_size, (intmax_t)dp->d_mediasize,
+	    targets[0].virtual_clock ? ", simulated time" : "");
+	if (ntargets > 1)
+		printf("%d instances at once\n", ntargets);
+	printf("%-10s %8s %8s %10s %9s %9s %9s %9s\n", "workload", "ops",
+	    "bytes", "IOPS", "MB/s", "p50 us", "p99 us", "p999 us");
+
+	if (argc == 0) {
+		for (wl = workloads; wl->name != NULL; wl++)
+			bench(wl);
+	}
+	for (i = 0; i < argc; i++)
+		bench(find_workload(argv[i]));
+
+	gc_copies = gc_blocks = 0;
+	for (i = 0; ftl && i < ntargets; i++) {
+		gc_copies += targets[i].gc_copies +
+		    ftl_stat(&targets[i], "gc_copies");
+		gc_blocks += targets[i].gc_blocks +
+		    ftl_stat(&targets[i], "gc_blocks");
+	}
+	if (ftl)
+		printf("nandftl: %lu pages moved and %lu blocks reclaimed by "
+		    "garbage collection\n", gc_copies, gc_blocks);
+
+	capacity = resident = 0;
+	for (i = 0; i < ntargets; i++) {
+		len = sizeof(val);
+		snprintf(name, sizeof(name), "hw.nandsim.%d.capacity", i);
+		if (kshim_sysctl(name, &val, &len, NULL, 0) == 0)
+			capacity += val;
+		snprintf(name, sizeof(name), "hw.nandsim.%d.resident", i);
+		if (kshim_sysctl(name, &val, &len, NULL, 0) == 0)
+			resident += val;
+		free(targets[i].buf);
+		free(targets[i].expect);
+		free(targets[i].gens);
+	}
+	printf("nandsim: %ju of %ju bytes resident\n", (uintmax_t)resident,
+	    (uintmax_t)capacity);
+
+	free(targets);
+	nandsim_modevent(MOD_UNLOAD);
+	nand_modevent(MOD_UNLOAD);
+	return (0);
+}
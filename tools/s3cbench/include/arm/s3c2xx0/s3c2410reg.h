@@ -0,0 +1,17 @@
+/* The NAND controller registers s3c24x0_nand.c uses */
+
+#define	S3C24X0_NANDFC_BASE	0x4e000000
+#define	S3C24X0_INT_NFCON	24
+
+#define	NANDFC_NFCONF		0x00
+#define	S3C2410_NANDFC_NFCMD	0x04
+#define	S3C2410_NANDFC_NFADDR	0x08
+#define	S3C2410_NANDFC_NFDATA	0x0c
+#define	S3C2410_NANDFC_NFSTAT	0x10
+#define	S3C2410_NANDFC_NFECC	0x14
+#define	S3C2410_NANDFC_SIZE	0x18
+
+#define	S3C2410_NFCONF_ENABLE	(1 << 15)
+#define	S3C2410_NFCONF_ECC	(1 << 12)
+#define	S3C2410_NFCONF_FCE	(1 << 11)
+#define	NFSTAT_READY		(1 << 0)
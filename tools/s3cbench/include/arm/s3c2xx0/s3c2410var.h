@@ -0,0 +1,12 @@
+/* The parts of the SoC softc s3c24x0_nand.c uses */
+
+#define	CPU_S3C2410	1
+#define	CPU_S3C2440	2
+
+struct s3c2xx0_softc {
+	bus_space_tag_t	sc_iot;
+	int		sc_cpu;
+};
+
+extern struct s3c2xx0_softc *s3c2xx0_softc;
+extern struct bus_space s3c2xx0_bs_tag;
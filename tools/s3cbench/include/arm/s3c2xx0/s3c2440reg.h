@@ -0,0 +1,11 @@
+/* The NAND controller registers s3c24x0_nand.c uses */
+
+#define	S3C2440_NANDFC_NFCONT	0x04
+#define	S3C2440_NANDFC_NFCMMD	0x08
+#define	S3C2440_NANDFC_NFADDR	0x0c
+#define	S3C2440_NANDFC_NFDATA	0x10
+#define	S3C2440_NANDFC_NFSTAT	0x20
+#define	S3C2440_NANDFC_SIZE	0x40
+
+#define	S3C2440_NFCONT_ENABLE	(1 << 0)
+#define	S3C2440_NFCONT_NCE	(1 << 1)
@@ -0,0 +1,69 @@
+/*
+ * Just enough of newbus and bus_space for s3c24x0_nand.c. The device
+ * is its own softc and the bus_space calls are counted by s3cbench.c.
+ */
+
+#ifndef _S3CBENCH_SYS_BUS_H_
+#define	_S3CBENCH_SYS_BUS_H_
+
+struct bus_space {
+	int		bs_unused;
+};
+typedef struct bus_space *bus_space_tag_t;
+typedef uintptr_t	bus_space_handle_t;
+typedef u_long		bus_addr_t;
+typedef u_long		bus_size_t;
+
+int	bus_space_map(bus_space_tag_t, bus_addr_t, bus_size_t, int,
+	    bus_space_handle_t *);
+void	bus_space_unmap(bus_space_tag_t, bus_space_handle_t, bus_size_t);
+uint8_t	bus_space_read_1(bus_space_tag_t, bus_space_handle_t,
+	    bus_size_t);
+uint32_t bus_space_read_4(bus_space_tag_t, bus_space_handle_t, bus_size_t);
+void	bus_space_write_1(bus_space_tag_t, bus_space_handle_t, bus_size_t,
+	    uint8_t);
+void	bus_space_write_4(bus_space_tag_t, bus_space_handle_t, bus_size_t,
+	    uint32_t);
+void	bus_space_read_multi_1(bus_space_tag_t, bus_space_handle_t,
+	    bus_size_t, uint8_t *, bus_size_t);
+void	bus_space_read_multi_4(bus_space_tag_t, bus_space_handle_t,
+	    bus_size_t, uint32_t *, bus_size_t);
+void	bus_space_write_multi_1(bus_space_tag_t, bus_space_handle_t,
+	    bus_size_t, const uint8_t *, bus_size_t);
+void	bus_space_write_multi_4(bus_space_tag_t, bus_space_handle_t,
+	    bus_size_t, const uint32_t *, bus_size_t);
+
+struct resource;
+typedef void driver_intr_t(void *);
+typedef int driver_filter_t(void *);
+#define	SYS_RES_IRQ	1
+#define	RF_ACTIVE	0x0002
+#define	INTR_TYPE_BIO	4
+#define	INTR_MPSAFE	512
+
+void	*device_get_softc(device_t);
+void	device_set_desc(device_t, const char *);
+struct resource *bus_alloc_resource(device_t, int, int *, u_long, u_long,
+	    u_long, u_int);
+int	bus_release_resource(device_t, int, int, struct resource *);
+int	bus_setup_intr(device_t, struct resource *, int, driver_filter_t *,
+	    driver_intr_t *, void *, void **);
+int	bus_teardown_intr(device_t, struct resource *, void *);
+
+typedef struct {
+	const char	*dm_name;
+	void		*dm_func;
+} device_method_t;
+#define	DEVMETHOD(name, func)	{ #name, (void *)(func) }
+
+typedef struct {
+	const char	*name;
+	device_method_t	*methods;
+	size_t		size;
+} driver_t;
+typedef void *devclass_t;
+#define	DRIVER_MODULE(name, busname, driver, devclass, evh, arg)	\
+static void *name##_##busname##_module[] __unused = {			\
+	&(driver), &(devclass) }
+
+#endif /* !_S3CBENCH_SYS_BUS_H_ */
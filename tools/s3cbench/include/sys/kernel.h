@@ -0,0 +1 @@
+/* Provided by s3cshim.h */
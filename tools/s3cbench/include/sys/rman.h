@@ -0,0 +1 @@
+/* Provided by sys/bus.h */
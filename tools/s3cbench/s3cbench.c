@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2009 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Counts the bus transactions the s3c24x0 NAND driver makes to move a
+ * 2112 byte page. The driver is built in against a bus_space that only
+ * counts the accesses to each register. A page is moved as the core
+ * moves it, one call for each ECC block followed by the spare area,
+ * from buffers at each offset from a word boundary. The byte at a time
+ * loop the driver used before is counted the same way for comparison.
+ */
+
+#include "s3c24x0_nand.c"
+
+#include <err.h>
+
+#define	S3CBENCH_PAGE	2048
+#define	S3CBENCH_SPARE	64
+
+#define	S3CBENCH_FMT	"%-8s %-5s %6d %6lu %6lu %6lu %6lu\n"
+
+typedef int s3cbench_xfer_t(nand_device_t, size_t, uint8_t *);
+
+struct s3c2xx0_softc *s3c2xx0_softc;
+struct bus_space s3c2xx0_bs_tag;
+
+static struct s3c2xx0_softc soc;
+static struct s3c24x0_nand_softc softc;
+
+/* Accesses to each register, a multiple access counts each transfer */
+static u_long accesses[S3C2440_NANDFC_SIZE];
+
+static uint8_t page_buf[S3CBENCH_PAGE + 4] __attribute__((__aligned__(4)));
+static uint8_t oob_buf[S3CBENCH_SPARE] __attribute__((__aligned__(4)));
+
+int
+bus_space_map(bus_space_tag_t t, bus_addr_t a, bus_size_t s, int f,
+    bus_space_handle_t *hp)
+{
+
+	*hp = 0;
+	return (0);
+}
+
+void
+bus_space_unmap(bus_space_tag_t t, bus_space_handle_t h, bus_size_t s)
+{
+}
+
+/* The registers read as all ones so the chip is always ready */
+uint8_t
+bus_space_read_1(bus_space_tag_t t, bus_space_handle_t h, bus_size_t o)
+{
+
+	accesses[o]++;
+	return (0xFF);
+}
+
+uint32_t
+bus_space_read_4(bus_space_tag_t t, bus_space_handle_t h, bus_size_t o)
+{
+
+	accesses[o]++;
+	return (0xFFFFFFFF);
+}
+
+void
+bus_space_write_1(bus_space_tag_t t, bus_space_handle_t h, bus_size_t o,
+    uint8_t v)
+{
+
+	accesses[o]++;
+}
+
+void
+bus_space_write_4(bus_space_tag_t t, bus_space_handle_t h, bus_size_t o,
+    uint32_t v)
+{
+
+	accesses[o]++;
+}
+
+void
+bus_space_read_multi_1(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o, uint8_t *p, bus_size_t c)
+{
+
+	accesses[o] += c;
+	memset(p, 0xFF, c);
+}
+
+void
+bus_space_read_multi_4(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o, uint32_t *p, bus_size_t c)
+{
+
+	accesses[o] += c;
+	memset(p, 0xFF, c * 4);
+}
+
+void
+bus_space_write_multi_1(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o, const uint8_t *p, bus_size_t c)
+{
+
+	accesses[o] += c;
+}
+
+void
+bus_space_write_multi_4(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o, const uint32_t *p, bus_size_t c)
+{
+
+	accesses[o] += c;
+}
+
+void *
+device_get_softc(device_t dev)
+{
+
+	return (dev);
+}
+
+void
+device_set_desc(device_t dev, const char *desc)
+{
+}
+
+struct resource *
+bus_alloc_resource(device_t dev, int type, int *rid, u_long start,
+    u_long end, u_long count, u_int flags)
+{
+
+	return (NULL);
+}
+
+int
+bus_release_resource(device_t dev, int type, int rid, struct resource *r)
+{
+
+	return (0);
+}
+
+int
+bus_setup_intr(device_t dev, struct resource *r, int flags,
+    driver_filter_t *filter, driver_intr_t *handler, void *arg,
+    void **cookiep)
+{
+
+	return (ENXIO);
+}
+
+void
+panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	verrx(1, fmt, ap);
+}
+
+/* Only the driver's own functions are run */
+int
+nand_probe(nand_device_t ndev)
+{
+
+	return (ENXIO);
+}
+
+int
+nand_attach(nand_device_t ndev)
+{
+
+	return (ENXIO);
+}
+
+int
+nand_ecc_fix(nand_device_t ndev, size_t len, uint8_t *data,
+    uint8_t *calc_ecc, uint8_t *read_ecc)
+{
+
+	return (0);
+}
+
+/* s3c24x0_nand_read and s3c24x0_nand_write as they were */
+static int
+byte_read(nand_device_t ndev, size_t len, uint8_t *data)
+{
+	struct s3c24x0_nand_softc *sc = device_get_softc(ndev->ndev_dev);
+	size_t pos;
+
+	for (pos = 0; pos < len; pos++)
+		data[pos] = bus_space_read_4(sc->sc_sx.sc_iot,
+		    sc->sc_nand_ioh, sc->sc_data_reg) & 0xFF;
+	return (0);
+}
+
+static int
+byte_write(nand_device_t ndev, size_t len, uint8_t *data)
+{
+	struct s3c24x0_nand_softc *sc = device_get_softc(ndev->ndev_dev);
+	size_t pos;
+
+	for (pos = 0; pos < len; pos++)
+		bus_space_write_1(sc->sc_sx.sc_iot, sc->sc_nand_ioh,
+		    sc->sc_data_reg, data[pos]);
+	return (0);
+}
+
+/*
+ * Moves a page from offset bytes into page_buf and returns the
+ * accesses to NFDATA, setting *total to the accesses to all registers
+ */
+static u_long
+page(s3cbench_xfer_t *xfer, int offset, u_long *total)
+{
+	nand_device_t ndev;
+	uint8_t ecc[3];
+	size_t pos, stride;
+	u_int i;
+
+	ndev = &softc.sc_nand_dev;
+	stride = s3c2410_nand_ecc.ecc_protect;
+	memset(accesses, 0, sizeof(accesses));
+	for (pos = 0; pos < S3CBENCH_PAGE; pos += stride) {
+		s3c24x0_init_ecc(ndev);
+		xfer(ndev, stride, &page_buf[offset + pos]);
+		s3c24x0_calc_ecc(ndev, ecc);
+	}
+	xfer(ndev, S3CBENCH_SPARE, oob_buf);
+
+	*total = 0;
+	for (i = 0; i < sizeof(accesses) / sizeof(accesses[0]); i++)
+		*total += accesses[i];
+	return (accesses[softc.sc_data_reg]);
+}
+
+static void
+bench(const char *name, int cpu)
+{
+	u_long after, after_total, before, before_total;
+	int offset;
+
+	soc.sc_cpu = cpu;
+	s3c24x0_nand_init(&softc);
+
+	for (offset = 0; offset < 4; offset++) {
+		before = page(byte_read, offset, &before_total);
+		after = page(s3c24x0_nand_read, offset, &after_total);
+		printf(S3CBENCH_FMT, name, "read", offset, before, after,
+		    before_total, after_total);
+	}
+	for (offset = 0; offset < 4; offset++) {
+		before = page(byte_write, offset, &before_total);
+		after = page(s3c24x0_nand_write, offset, &after_total);
+		printf(S3CBENCH_FMT, name, "write", offset, before, after,
+		    before_total, after_total);
+	}
+}
+
+int
+main(int argc, char *argv[] __unused)
+{
+
+	if (argc != 1)
+		errx(1, "usage: s3cbench");
+
+	s3c2xx0_softc = &soc;
+	soc.sc_iot = &s3c2xx0_bs_tag;
+	softc.sc_sx.sc_iot = &s3c2xx0_bs_tag;
+	softc.sc_nand_dev.ndev_dev = &softc;
+
+	printf("Bus accesses to move a %d byte page\n",
+	    S3CBENCH_PAGE + S3CBENCH_SPARE);
+	printf("%-8s %-5s %6s %13s %13s\n", "", "", "", "NFDATA", "All");
+	printf("%-8s %-5s %6s %6s %6s %6s %6s\n", "CPU", "Op", "Offset",
+	    "Before", "After", "Before", "After");
+	bench("S3C2410", CPU_S3C2410);
+	bench("S3C2440", CPU_S3C2440);
+
+	return (0);
+}
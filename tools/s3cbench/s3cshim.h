@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2009 Andrew Turner
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Just enough of the kernel for s3c24x0_nand.c and the NAND core's
+ * nandvar.h to build as a userland program. The structures the softc
+ * holds are stand-ins and nothing sleeps or takes a lock. Sources are
+ * built with this header forced in front of them and the empty
+ * headers under include/ standing in for the kernel ones.
+ */
+
+#ifndef _S3CSHIM_H_
+#define	_S3CSHIM_H_
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __FBSDID
+#define	__FBSDID(s)
+#endif
+#ifndef __unused
+#define	__unused	__attribute__((__unused__))
+#endif
+#ifndef __predict_false
+#define	__predict_false(x)	__builtin_expect((x), 0)
+#endif
+
+typedef void *device_t;
+
+#define	KASSERT(exp, msg) do {						\
+	if (__predict_false(!(exp)))					\
+		panic msg;						\
+} while (0)
+void	panic(const char *, ...) __attribute__((__noreturn__));
+int	device_printf(device_t, const char *, ...);
+
+struct malloc_type {
+	const char	*ks_shortdesc;
+};
+#define	MALLOC_DECLARE(type)	extern struct malloc_type type[1]
+typedef struct uma_zone *uma_zone_t;
+
+struct mtx {
+	int		mtx_unused;
+};
+#define	MTX_DEF		0
+void	mtx_init(struct mtx *, const char *, const char *, int);
+void	mtx_destroy(struct mtx *);
+void	mtx_lock(struct mtx *);
+void	mtx_unlock(struct mtx *);
+
+struct sx {
+	int		sx_unused;
+};
+
+#define	PRIBIO		16
+int	msleep(void *, struct mtx *, int, const char *, int);
+void	wakeup(void *);
+
+struct proc;
+struct disk;
+struct bio;
+struct bio_queue_head {
+	TAILQ_HEAD(bio_queue, bio) queue;
+};
+
+struct sysctl_oid;
+struct sysctl_ctx_list {
+	TAILQ_HEAD(, sysctl_oid) head;
+};
+
+#define	MODULE_DEPEND(name, busname, vmin, vpref, vmax)
+
+#endif /* !_S3CSHIM_H_ */